@@ -0,0 +1,400 @@
+#define _POSIX_C_SOURCE 200809L
+#include "session.h"
+#include "geotypes.h"
+#include "binary.h"
+
+// Benchmarks of the paths decoding results to Lua values and encoding Lua values to
+// parameters, on results made up with the libpq result functions so that no server is
+// needed. Each case is repeated for at least the time given, and reported as a line of tab
+// separated values: the time, the Lua allocations and the bytes allocated by Lua, per cell.
+
+int
+luaopen_moonpg (lua_State *L);
+
+// The Lua allocations counted, of new blocks and blocks grown.
+typedef struct {
+    unsigned long allocs;
+    double bytes;
+} AllocCount;
+
+typedef struct Case Case;
+
+struct Case {
+    const char *suite;
+    const char *name;
+    int rows;
+    int cols;
+    int width;              // Characters of a text value, or elements of an array.
+    Oid type;
+    TypeMapping mapping;
+    int byArray;
+    void (*run) (lua_State *L, Case *c);
+    PGresult *result;       // The result made up for the case.
+    PGresult *copy;         // Its copy for the next run, for those taking the result.
+    char **values;          // The values of a geometric case, or NULL.
+};
+
+static DBSession session;
+static AllocCount count;
+
+static void *
+countingAlloc (void *ud, void *ptr, size_t osize, size_t nsize)
+{
+    if (nsize == 0) {
+        free(ptr);
+        return NULL;
+    }
+    if (nsize > osize) {
+        count.allocs++;
+        count.bytes += nsize - osize;
+    }
+    return realloc(ptr, nsize);
+}
+
+// Write the text of value row, col of type, of width characters or elements, to buf.
+static int
+valueText (Oid type, int width, int row, int col, char *buf)
+{
+    int n = row * 31 + col * 7;
+    char *p = buf;
+    switch (type) {
+        case int4OID:
+            return sprintf(buf, "%d", n * 1013 % 1000000);
+        case float8OID:
+            return sprintf(buf, "%.6f", n * 1.37);
+        case numericOID:
+            return sprintf(buf, "%d.%04d", n, n % 10000);
+        case boolOID:
+            return sprintf(buf, "%s", n % 2 ? "t" : "f");
+        case intA4OID:
+            *p++ = '{';
+            for (int i = 0; i < width; i++) {
+                p += sprintf(p, i ? ",%d" : "%d", (n + i) % 100000);
+            }
+            *p++ = '}';
+            *p = '\0';
+            return p - buf;
+        case textAOID:
+            *p++ = '{';
+            for (int i = 0; i < width; i++) {
+                p += sprintf(p, i ? ",\"e%06d\"" : "\"e%06d\"", (n + i) % 1000000);
+            }
+            *p++ = '}';
+            *p = '\0';
+            return p - buf;
+        default:
+            for (int i = 0; i < width; i++) {
+                buf[i] = 'a' + (n + i) % 26;
+            }
+            buf[width] = '\0';
+            return width;
+    }
+}
+
+static PGresult *
+makeResult (const Case *c)
+{
+    PGresult *result = PQmakeEmptyPGresult(NULL, PGRES_TUPLES_OK);
+    PGresAttDesc *attrs = calloc(c->cols, sizeof *attrs);
+    char (*names)[16] = malloc(c->cols * sizeof *names);
+    char *buf = malloc(16 * c->width + 64);
+    if (!result || !attrs || !names || !buf) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    for (int i = 0; i < c->cols; i++) {
+        sprintf(names[i], "c%d", i);
+        attrs[i].name = names[i];
+        attrs[i].typid = c->type;
+        attrs[i].typlen = -1;
+        attrs[i].atttypmod = -1;
+    }
+    int ok = PQsetResultAttrs(result, c->cols, attrs);
+    for (int r = 0; ok && r < c->rows; r++) {
+        for (int i = 0; ok && i < c->cols; i++) {
+            int len = valueText(c->type, c->width, r, i, buf);
+            ok = PQsetvalue(result, r, i, buf, len);
+        }
+    }
+    if (!ok) {
+        fprintf(stderr, "cannot make the result of %s/%s\n", c->suite, c->name);
+        exit(1);
+    }
+    free(attrs);
+    free(names);
+    free(buf);
+    return result;
+}
+
+// Set the type map of the session to the mapping of the case for all its columns.
+static void
+mapColumns (const Case *c, TypeMap *map, char (*names)[16], TypeMapping *mappings)
+{
+    for (int i = 0; i < c->cols; i++) {
+        sprintf(names[i], "c%d", i);
+        map->fields[i] = names[i];
+        mappings[i] = c->mapping;
+    }
+    map->count = c->mapping == mapDefault ? 0 : c->cols;
+    map->mappings = mappings;
+}
+
+static void
+runResult (lua_State *L, Case *c)
+{
+    session.getbyarray = c->byArray;
+    processResultStatus(L, c->copy, PGRES_TUPLES_OK, &session);
+    c->copy = NULL;
+}
+
+static void
+runValues (lua_State *L, Case *c)
+{
+    ColumnDecoder columns[c->cols];
+    resolveColumns(c->result, session.typeMap, columns);
+    for (int r = 0; r < c->rows; r++) {
+        for (int i = 0; i < c->cols; i++) {
+            pushValue(L, c->result, r, i, columns + i);
+            lua_pop(L, 1);
+        }
+    }
+}
+
+static void
+runGeo (lua_State *L, Case *c)
+{
+    void (*push) (lua_State *, char *) =
+        c->type == pointOID ? pushGeoPoint :
+        c->type == boxOID ? pushGeoBox :
+        c->type == circleOID ? pushGeoCircle : pushGeoPolygon;
+    for (int r = 0; r < c->rows; r++) {
+        push(L, c->values[r % 16]);
+        lua_pop(L, 1);
+    }
+}
+
+// Push an array of n numbers.
+static void
+pushNumbers (lua_State *L, int n)
+{
+    lua_createtable(L, n, 0);
+    for (int i = 1; i <= n; i++) {
+        lua_pushnumber(L, i * 37 % 100000);
+        lua_rawseti(L, -2, i);
+    }
+}
+
+static void
+runArrayText (lua_State *L, Case *c)
+{
+    lua_rawgeti(L, LUA_REGISTRYINDEX, c->width);
+    int index = lua_gettop(L);
+    for (int r = 0; r < c->rows; r++) {
+        TextBuffer tb;
+        textBufferInit(L, &tb);
+        arrayText(L, index, &tb);
+        lua_settop(L, index);
+    }
+}
+
+static void
+runArrayBinary (lua_State *L, Case *c)
+{
+    lua_rawgeti(L, LUA_REGISTRYINDEX, c->width);
+    int index = lua_gettop(L);
+    for (int r = 0; r < c->rows; r++) {
+        arrayBinaryFromTable(L, index, intA4OID);
+        lua_settop(L, index);
+    }
+}
+
+// Make the geometric values of a case, of width points for polygons.
+static char **
+makeGeoValues (const Case *c)
+{
+    char **values = malloc(16 * sizeof *values);
+    for (int v = 0; v < 16; v++) {
+        char *p = values[v] = malloc(40 * c->width + 64);
+        switch (c->type) {
+            case pointOID:
+                sprintf(p, "(%d.5,-%d.25)", v, v * 3);
+                break;
+            case boxOID:
+                sprintf(p, "(%d.5,%d.25),(-%d.5,-%d.75)", v + 10, v * 3, v, v);
+                break;
+            case circleOID:
+                sprintf(p, "<(%d.5,-%d.25),%d.125>", v, v * 3, v + 1);
+                break;
+            default:
+                *p++ = '(';
+                for (int i = 0; i < c->width; i++) {
+                    p += sprintf(p, i ? ",(%d.5,%d.25)" : "(%d.5,%d.25)", v + i, v * i);
+                }
+                strcpy(p, ")");
+        }
+    }
+    return values;
+}
+
+static double minTime = 0.2;
+
+// Ready a case for its next run, outside of the time measured.
+static void
+prepareRun (Case *c)
+{
+    if (c->run == runResult) {
+        c->copy = PQcopyResult(c->result, PG_COPYRES_ATTRS | PG_COPYRES_TUPLES);
+    }
+}
+
+// Run a case at least 3 times and for minTime, and report it. Called by lua_cpcall.
+static int
+measureCase (lua_State *L)
+{
+    Case *c = lua_touserdata(L, 1);
+    lua_settop(L, 0);
+    lua_gc(L, LUA_GCCOLLECT, 0);
+    prepareRun(c);
+    c->run(L, c);
+    lua_settop(L, 0);
+    unsigned long allocs = count.allocs;
+    double bytes = count.bytes, elapsed = 0;
+    long iterations = 0;
+    while (iterations < 3 || elapsed < minTime) {
+        prepareRun(c);
+        double start = monotonicTime();
+        c->run(L, c);
+        elapsed += monotonicTime() - start;
+        lua_settop(L, 0);
+        iterations++;
+    }
+    double cells = (double)iterations * c->rows * c->cols;
+    printf("%s\t%s\t%d\t%d\t%d\t%ld\t%.2f\t%.3f\t%.1f\n", c->suite, c->name, c->rows, c->cols,
+        c->width, iterations, elapsed * 1e9 / cells, (count.allocs - allocs) / cells,
+        (count.bytes - bytes) / cells);
+    fflush(stdout);
+    return 0;
+}
+
+// The rows and columns of the results decoded.
+static const int resultShapes[][2] = {
+    {1, 1}, {100, 1}, {100, 8}, {10000, 1}, {10000, 8}, {1000, 32}
+};
+
+static const struct {
+    const char *name;
+    Oid type;
+    int width;
+} resultTypes[] = {
+    {"int4", int4OID, 0},
+    {"float8", float8OID, 0},
+    {"numeric", numericOID, 0},
+    {"bool", boolOID, 0},
+    {"text16", textOID, 16},
+    {"text256", textOID, 256}
+};
+
+#define NCASES 256
+
+// Add the cases of the benchmark to cases, returning their number.
+static int
+makeCases (Case *cases)
+{
+    int n = 0;
+    int ntypes = sizeof resultTypes / sizeof *resultTypes;
+    for (int t = 0; t < ntypes; t++) {
+        for (int s = 0; s < sizeof resultShapes / sizeof *resultShapes; s++) {
+            cases[n++] = (Case){"result", resultTypes[t].name, resultShapes[s][0],
+                resultShapes[s][1], resultTypes[t].width, resultTypes[t].type, mapDefault, 0,
+                runResult};
+        }
+        cases[n++] = (Case){"result.byarray", resultTypes[t].name, 10000, 8,
+            resultTypes[t].width, resultTypes[t].type, mapDefault, 1, runResult};
+        cases[n++] = (Case){"value", resultTypes[t].name, 10000, 1, resultTypes[t].width,
+            resultTypes[t].type, mapDefault, 0, runValues};
+    }
+    int widths[] = {10, 100, 1000};
+    for (int w = 0; w < 3; w++) {
+        cases[n++] = (Case){"array", "int4[]", 100, 1, widths[w], intA4OID, mapArray, 0,
+            runValues};
+        cases[n++] = (Case){"array", "text[]", 100, 1, widths[w], textAOID, mapArray, 0,
+            runValues};
+        cases[n++] = (Case){"result.array", "int4[]", 100, 4, widths[w], intA4OID, mapArray, 0,
+            runResult};
+        cases[n++] = (Case){"encode.text", "numbers", 100, 1, widths[w], 0, mapDefault, 0,
+            runArrayText};
+        cases[n++] = (Case){"encode.binary", "int4[]", 100, 1, widths[w], 0, mapDefault, 0,
+            runArrayBinary};
+    }
+    cases[n++] = (Case){"geo", "point", 1000, 1, 1, pointOID, mapDefault, 0, runGeo};
+    cases[n++] = (Case){"geo", "box", 1000, 1, 2, boxOID, mapDefault, 0, runGeo};
+    cases[n++] = (Case){"geo", "circle", 1000, 1, 1, circleOID, mapDefault, 0, runGeo};
+    for (int w = 0; w < 3; w++) {
+        cases[n++] = (Case){"geo", "polygon", 1000 / widths[w], 1, widths[w], polygonOID,
+            mapDefault, 0, runGeo};
+    }
+    return n;
+}
+
+int
+main (int argc, char *argv[])
+{
+    const char *filter = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            minTime = atof(argv[++i]);
+        }
+        else if (argv[i][0] != '-') {
+            filter = argv[i];
+        }
+        else {
+            fprintf(stderr, "usage: %s [-t seconds] [suite]\n", argv[0]);
+            return 2;
+        }
+    }
+    lua_State *L = lua_newstate(countingAlloc, NULL);
+    luaL_openlibs(L);
+    lua_pushcfunction(L, luaopen_moonpg);
+    lua_call(L, 0, 0);
+    // The tables encoded, by their size, in the registry.
+    int widths[] = {10, 100, 1000};
+    for (int w = 0; w < 3; w++) {
+        pushNumbers(L, widths[w]);
+        lua_rawseti(L, LUA_REGISTRYINDEX, widths[w]);
+    }
+
+    Case cases[NCASES];
+    int ncases = makeCases(cases);
+    printf("suite\tcase\trows\tcols\twidth\titerations\tns_per_cell\tallocs_per_cell\t"
+        "bytes_per_cell\n");
+    for (int n = 0; n < ncases; n++) {
+        Case *c = cases + n;
+        if (filter && strcmp(filter, c->suite) != 0) {
+            continue;
+        }
+        char (*names)[16] = malloc(c->cols * sizeof *names);
+        char **fields = malloc(c->cols * sizeof *fields);
+        TypeMapping *mappings = malloc(c->cols * sizeof *mappings);
+        TypeMap map = {0, fields, mappings};
+        mapColumns(c, &map, names, mappings);
+        session.typeMap = &map;
+        c->result = c->type && c->run != runGeo ? makeResult(c) : NULL;
+        c->values = c->run == runGeo ? makeGeoValues(c) : NULL;
+        if (lua_cpcall(L, measureCase, c) != 0) {
+            fprintf(stderr, "%s/%s: %s\n", c->suite, c->name, lua_tostring(L, -1));
+            return 1;
+        }
+        session.typeMap = NULL;
+        PQclear(c->result);
+        for (int v = 0; c->values && v < 16; v++) {
+            free(c->values[v]);
+        }
+        free(c->values);
+        free(names);
+        free(fields);
+        free(mappings);
+    }
+    free(session.columns);
+    lua_close(L);
+    return 0;
+}
@@ -0,0 +1,146 @@
+-- Drives moonpg sessions against a server, normally bench/mockpg, and reports throughput
+-- and latency as tab separated values.
+--
+--     lua bench/load.lua [-c conninfo] [-n sessions] [-d seconds] [-m mode] [-b batch]
+--         [-q query]
+--
+-- Modes: run, each session in turn running the query; async, a scheduler task per session;
+-- pipeline, batches of the query in a pipeline; stream, the query read in batches of rows.
+
+local pg = require'moonpg'
+
+local options = {
+    c = 'host=127.0.0.1 port=15432 user=bench dbname=bench sslmode=disable',
+    n = 4,
+    d = 5,
+    m = 'run',
+    b = 100,
+    q = 'select rows=10 cols=4'
+}
+local i = 1
+while i <= #arg do
+    local flag = arg[i]:match('^%-(%a)$')
+    if not flag or options[flag] == nil or not arg[i + 1] then
+        io.stderr:write('usage: load.lua [-c conninfo] [-n sessions] [-d seconds] [-m mode] ',
+            '[-b batch] [-q query]\n')
+        os.exit(2)
+    end
+    options[flag] = type(options[flag]) == 'number' and tonumber(arg[i + 1]) or arg[i + 1]
+    i = i + 2
+end
+
+local sessions = {}
+for n = 1, options.n do
+    local con, err = pg.connect(options.c)
+    if not con then
+        error(err)
+    end
+    sessions[n] = con
+end
+
+local latencies, ops, rows = {}, 0, 0
+
+local function record (started, count, nrows)
+    latencies[#latencies + 1] = pg.clock() - started
+    ops = ops + count
+    rows = rows + nrows
+end
+
+local function check (result, err)
+    if result == false or result == nil then
+        error(err or 'no result')
+    end
+    return result
+end
+
+local modes = {}
+
+function modes.run (deadline)
+    while pg.clock() < deadline do
+        for _, con in ipairs(sessions) do
+            local started = pg.clock()
+            local result = check(con:run(options.q))
+            record(started, 1, type(result) == 'table' and #result or 0)
+        end
+    end
+end
+
+function modes.async (deadline)
+    local sched = pg.scheduler()
+    for _, con in ipairs(sessions) do
+        sched:spawn(function ()
+            while pg.clock() < deadline do
+                local started = pg.clock()
+                local result = check(sched:run(con, options.q))
+                record(started, 1, type(result) == 'table' and #result or 0)
+            end
+        end)
+    end
+    sched:loop()
+end
+
+function modes.pipeline (deadline)
+    local pipes = {}
+    for n, con in ipairs(sessions) do
+        pipes[n] = check(con:pipeline())
+    end
+    while pg.clock() < deadline do
+        for _, pipe in ipairs(pipes) do
+            local started = pg.clock()
+            for _ = 1, options.b do
+                pipe:run(options.q)
+            end
+            local results, errors = pipe:execute()
+            local nrows = 0
+            for n = 1, options.b do
+                if errors[n] then
+                    error(errors[n])
+                end
+                nrows = nrows + (type(results[n]) == 'table' and #results[n] or 0)
+            end
+            record(started, options.b, nrows)
+        end
+    end
+    for _, pipe in ipairs(pipes) do
+        pipe:close()
+    end
+end
+
+function modes.stream (deadline)
+    while pg.clock() < deadline do
+        for _, con in ipairs(sessions) do
+            local started = pg.clock()
+            local nrows = 0
+            for batch in check(con:streamBatches(options.b, options.q)) do
+                nrows = nrows + #batch
+            end
+            record(started, 1, nrows)
+        end
+    end
+end
+
+local mode = modes[options.m]
+if not mode then
+    error('unknown mode ' .. options.m)
+end
+local started = pg.clock()
+mode(started + options.d)
+local elapsed = pg.clock() - started
+for _, con in ipairs(sessions) do
+    con:close()
+end
+
+table.sort(latencies)
+local function percentile (q)
+    if #latencies == 0 then
+        return 0
+    end
+    return latencies[math.max(1, math.ceil(q * #latencies))] * 1000
+end
+
+print(table.concat({'mode', 'sessions', 'batch', 'seconds', 'ops', 'ops_per_s', 'rows_per_s',
+    'p50_ms', 'p95_ms', 'p99_ms', 'max_ms'}, '\t'))
+print(table.concat({options.m, options.n, options.b, string.format('%.3f', elapsed), ops,
+    string.format('%.1f', ops / elapsed), string.format('%.1f', rows / elapsed),
+    string.format('%.3f', percentile(0.5)), string.format('%.3f', percentile(0.95)),
+    string.format('%.3f', percentile(0.99)), string.format('%.3f', percentile(1))}, '\t'))
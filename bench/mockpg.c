@@ -0,0 +1,1438 @@
+#define _POSIX_C_SOURCE 200809L
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+// A stand-in PostgreSQL server for load testing, speaking the v3 protocol: startup, simple
+// and extended query, transactions, text and binary COPY and LISTEN/NOTIFY. Queries return
+// result sets generated from the key=value settings in their text, or in a script line whose
+// prefix they match:
+//
+//     select rows=1000 cols=4 type=text width=32 delay=0.002
+//
+// Responses are held back by the round trip time given and sent at the bandwidth given, so
+// that runs are reproducible without a server.
+
+#define MAX_CLIENTS 1024
+#define MAX_STATEMENTS 64
+#define MAX_LISTEN 16
+#define SEND_CHUNK 65536
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t size;
+} Buffer;
+
+// Output held until it is due.
+typedef struct Segment {
+    struct Segment *next;
+    double due;
+    size_t len;
+    size_t off;
+    char data[];
+} Segment;
+
+typedef struct {
+    char *name;
+    char *query;
+    int nparams;
+    uint32_t *types;
+} Statement;
+
+typedef struct {
+    char *query;
+    int nformats;
+    int16_t *formats;       // Of the result columns.
+    int described;
+} Portal;
+
+typedef struct {
+    int fd;
+    int pid;
+    int started;
+    int failed;             // An extended query failed, so messages are skipped to Sync.
+    char txStatus;          // I when idle, T in a transaction, E in a failed one.
+    int copyIn;
+    int copyBinary;
+    int copyHeader;         // The header of binary COPY data is yet to be skipped.
+    long copyRows;
+    Buffer copyPending;     // Binary COPY data short of a whole row.
+    Buffer in;
+    Buffer out;             // The response being made.
+    double delay;           // Server time the response takes.
+    Segment *head, *tail;
+    double busy;            // When the server is done with the work queued so far.
+    double nextSend;        // When bandwidth allows the next bytes.
+    Statement statements[MAX_STATEMENTS];
+    Portal portal;
+    char *listen[MAX_LISTEN];
+} Client;
+
+typedef enum {
+    genInt4,
+    genInt8,
+    genFloat8,
+    genNumeric,
+    genBool,
+    genText
+} GenType;
+
+static const struct {
+    const char *name;
+    uint32_t oid;
+    int16_t len;
+} genTypes[] = {
+    [genInt4] = {"int4", 23, 4},
+    [genInt8] = {"int8", 20, 8},
+    [genFloat8] = {"float8", 701, 8},
+    [genNumeric] = {"numeric", 1700, -1},
+    [genBool] = {"bool", 16, 1},
+    [genText] = {"text", 25, -1}
+};
+
+// The result of a query, from its settings.
+typedef struct {
+    long rows;
+    int cols;
+    GenType type;
+    int width;
+    double delay;
+    const char *error;
+    size_t errorLen;
+    int generated;          // Whether rows or columns were asked for.
+} Spec;
+
+static Client *clients[MAX_CLIENTS];
+static double rtt = 0;
+static double bandwidth = 0;   // Bytes per second, or 0 for no limit.
+static char **scriptPrefixes, **scriptSpecs;
+static int scriptSize;
+static int verbose;
+static int nextPid = 1000;
+
+static double
+now (void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *
+checkedAlloc (void *p)
+{
+    if (!p) {
+        fprintf(stderr, "mockpg: out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+static void
+bufferAdd (Buffer *b, const void *data, size_t len)
+{
+    if (b->len + len > b->size) {
+        b->size = b->size * 2 > b->len + len ? b->size * 2 : b->len + len + 256;
+        b->data = checkedAlloc(realloc(b->data, b->size));
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+static void
+putInt16 (Buffer *b, int v)
+{
+    uint16_t n = htons(v);
+    bufferAdd(b, &n, 2);
+}
+
+static void
+putInt32 (Buffer *b, int32_t v)
+{
+    uint32_t n = htonl(v);
+    bufferAdd(b, &n, 4);
+}
+
+static void
+putString (Buffer *b, const char *s)
+{
+    bufferAdd(b, s, strlen(s) + 1);
+}
+
+// Begin a message of type, returning the position of its length.
+static size_t
+beginMessage (Buffer *b, char type)
+{
+    bufferAdd(b, &type, 1);
+    size_t at = b->len;
+    putInt32(b, 0);
+    return at;
+}
+
+static void
+endMessage (Buffer *b, size_t at)
+{
+    uint32_t n = htonl(b->len - at);
+    memcpy(b->data + at, &n, 4);
+}
+
+static void
+emptyMessage (Buffer *b, char type)
+{
+    endMessage(b, beginMessage(b, type));
+}
+
+static void
+readyForQuery (Client *c)
+{
+    size_t at = beginMessage(&c->out, 'Z');
+    bufferAdd(&c->out, &c->txStatus, 1);
+    endMessage(&c->out, at);
+}
+
+static void
+parameterStatus (Client *c, const char *name, const char *value)
+{
+    size_t at = beginMessage(&c->out, 'S');
+    putString(&c->out, name);
+    putString(&c->out, value);
+    endMessage(&c->out, at);
+}
+
+static void
+errorResponse (Client *c, const char *code, const char *message, size_t len)
+{
+    size_t at = beginMessage(&c->out, 'E');
+    if (c->txStatus == 'T') {
+        c->txStatus = 'E';
+    }
+    putString(&c->out, "SERROR");
+    putString(&c->out, "VERROR");
+    bufferAdd(&c->out, "C", 1);
+    putString(&c->out, code);
+    bufferAdd(&c->out, "M", 1);
+    bufferAdd(&c->out, message, len);
+    bufferAdd(&c->out, "", 1);
+    bufferAdd(&c->out, "", 1);
+    endMessage(&c->out, at);
+}
+
+static void
+commandComplete (Client *c, const char *tag)
+{
+    size_t at = beginMessage(&c->out, 'C');
+    putString(&c->out, tag);
+    endMessage(&c->out, at);
+}
+
+// Queue the response made so far, due once the server has done its work and the round
+// trip has passed.
+static void
+commit (Client *c)
+{
+    double t = now();
+    if (c->busy < t) {
+        c->busy = t;
+    }
+    c->busy += c->delay;
+    c->delay = 0;
+    if (c->out.len == 0) {
+        return;
+    }
+    Segment *s = checkedAlloc(malloc(sizeof *s + c->out.len));
+    s->next = NULL;
+    s->due = c->busy + rtt;
+    s->len = c->out.len;
+    s->off = 0;
+    memcpy(s->data, c->out.data, c->out.len);
+    c->out.len = 0;
+    if (c->tail) {
+        c->tail->next = s;
+    }
+    else {
+        c->head = s;
+    }
+    c->tail = s;
+}
+
+// Find the value of key= in text, returning its length, or -1 if not there.
+static int
+findSetting (const char *text, const char *key, const char **value)
+{
+    size_t klen = strlen(key);
+    for (const char *p = text; (p = strstr(p, key)); p += klen) {
+        if ((p == text || !isalnum((unsigned char)p[-1])) && p[klen] == '=') {
+            *value = p + klen + 1;
+            int len = 0;
+            while ((*value)[len] && !isspace((unsigned char)(*value)[len]) &&
+                    (*value)[len] != ';' && (*value)[len] != ',' && (*value)[len] != ')') {
+                len++;
+            }
+            return len;
+        }
+    }
+    return -1;
+}
+
+static double
+settingNumber (const char *text, const char *key, double dflt)
+{
+    const char *v;
+    return findSetting(text, key, &v) > 0 ? atof(v) : dflt;
+}
+
+// Read the settings of a query from its text, or from the script line it matches.
+static Spec
+querySpec (const char *query)
+{
+    const char *text = query;
+    for (int i = 0; i < scriptSize; i++) {
+        if (strncasecmp(query, scriptPrefixes[i], strlen(scriptPrefixes[i])) == 0) {
+            text = scriptSpecs[i];
+            break;
+        }
+    }
+    Spec spec = {1, 1, genInt4, 8, 0, NULL, 0, 0};
+    const char *v;
+    int len;
+    spec.generated = findSetting(text, "rows", &v) >= 0 || findSetting(text, "cols", &v) >= 0 ||
+        findSetting(text, "type", &v) >= 0;
+    spec.rows = (long)settingNumber(text, "rows", 1);
+    spec.cols = (int)settingNumber(text, "cols", 1);
+    spec.width = (int)settingNumber(text, "width", 8);
+    spec.delay = settingNumber(text, "delay", 0);
+    if ((len = findSetting(text, "type", &v)) > 0) {
+        for (int t = 0; t < sizeof genTypes / sizeof *genTypes; t++) {
+            if (strlen(genTypes[t].name) == len && strncasecmp(v, genTypes[t].name, len) == 0) {
+                spec.type = t;
+            }
+        }
+    }
+    if ((len = findSetting(text, "error", &v)) > 0) {
+        spec.error = v;
+        spec.errorLen = len;
+    }
+    const char *sleep = strstr(text, "pg_sleep(");
+    if (sleep) {
+        spec.delay += atof(sleep + 9);
+    }
+    if (spec.rows < 0) {
+        spec.rows = 0;
+    }
+    if (spec.cols < 1) {
+        spec.cols = 1;
+    }
+    if (spec.width < 0) {
+        spec.width = 0;
+    }
+    return spec;
+}
+
+static void
+rowDescription (Client *c, const Spec *spec, const Portal *portal)
+{
+    size_t at = beginMessage(&c->out, 'T');
+    putInt16(&c->out, spec->cols);
+    for (int i = 0; i < spec->cols; i++) {
+        char name[16];
+        if (spec->generated) {
+            sprintf(name, "c%d", i + 1);
+        }
+        else {
+            strcpy(name, "?column?");
+        }
+        putString(&c->out, name);
+        putInt32(&c->out, 0);
+        putInt16(&c->out, 0);
+        putInt32(&c->out, genTypes[spec->type].oid);
+        putInt16(&c->out, genTypes[spec->type].len);
+        putInt32(&c->out, -1);
+        int format = 0;
+        if (portal && portal->nformats == 1) {
+            format = portal->formats[0];
+        }
+        else if (portal && portal->nformats > i) {
+            format = portal->formats[i];
+        }
+        putInt16(&c->out, format);
+    }
+    endMessage(&c->out, at);
+}
+
+// Write the text of the value of row, col to buf, returning its length.
+static int
+valueText (const Spec *spec, long row, int col, char *buf)
+{
+    long n = row * spec->cols + col + 1;
+    switch (spec->type) {
+        case genInt4:
+            return sprintf(buf, "%ld", n % 2147483647);
+        case genInt8:
+            return sprintf(buf, "%ld", n * 1000003);
+        case genFloat8:
+            return sprintf(buf, "%.3f", n * 0.125);
+        case genNumeric:
+            return sprintf(buf, "%ld.%04ld", n, n * 37 % 10000);
+        case genBool:
+            return sprintf(buf, "%s", n % 2 ? "t" : "f");
+        default:
+            for (int i = 0; i < spec->width; i++) {
+                buf[i] = 'a' + (n + i) % 26;
+            }
+            buf[spec->width] = '\0';
+            return spec->width;
+    }
+}
+
+static void
+putValueBinary (Buffer *b, const Spec *spec, long row, int col, const char *text, int len)
+{
+    long n = row * spec->cols + col + 1;
+    switch (spec->type) {
+        case genInt4:
+            putInt32(b, 4);
+            putInt32(b, n % 2147483647);
+            break;
+        case genInt8:
+        case genFloat8: {
+            uint64_t v;
+            if (spec->type == genInt8) {
+                v = (uint64_t)(n * 1000003);
+            }
+            else {
+                double d = n * 0.125;
+                memcpy(&v, &d, 8);
+            }
+            putInt32(b, 8);
+            putInt32(b, (int32_t)(v >> 32));
+            putInt32(b, (int32_t)v);
+            break;
+        }
+        case genBool:
+            putInt32(b, 1);
+            bufferAdd(b, n % 2 ? "\1" : "\0", 1);
+            break;
+        case genNumeric: {
+            // Base 10000 digits of the integer part, then the four decimals.
+            int16_t digits[8];
+            int ndigits = 0, weight = -1;
+            for (long ip = n; ip > 0; ip /= 10000) {
+                memmove(digits + 1, digits, ndigits * sizeof *digits);
+                digits[0] = ip % 10000;
+                ndigits++;
+                weight++;
+            }
+            digits[ndigits++] = n * 37 % 10000;
+            putInt32(b, 8 + 2 * ndigits);
+            putInt16(b, ndigits);
+            putInt16(b, weight);
+            putInt16(b, 0);
+            putInt16(b, 4);
+            for (int i = 0; i < ndigits; i++) {
+                putInt16(b, digits[i]);
+            }
+            break;
+        }
+        default:
+            putInt32(b, len);
+            bufferAdd(b, text, len);
+    }
+}
+
+static void
+dataRows (Client *c, const Spec *spec, const Portal *portal)
+{
+    char *buf = checkedAlloc(malloc(spec->width + 64));
+    for (long r = 0; r < spec->rows; r++) {
+        size_t at = beginMessage(&c->out, 'D');
+        putInt16(&c->out, spec->cols);
+        for (int i = 0; i < spec->cols; i++) {
+            int binary = portal && (portal->nformats == 1 ? portal->formats[0] :
+                portal->nformats > i ? portal->formats[i] : 0);
+            int len = spec->generated ? valueText(spec, r, i, buf) : sprintf(buf, "1");
+            if (binary) {
+                putValueBinary(&c->out, spec, r, i, buf, len);
+            }
+            else {
+                putInt32(&c->out, len);
+                bufferAdd(&c->out, buf, len);
+            }
+        }
+        endMessage(&c->out, at);
+        // Large results are queued as they are made, to keep the buffer bounded.
+        if (c->out.len > (1 << 20)) {
+            commit(c);
+        }
+    }
+    free(buf);
+}
+
+static void
+notification (Client *c, int pid, const char *channel, const char *payload)
+{
+    size_t at = beginMessage(&c->out, 'A');
+    putInt32(&c->out, pid);
+    putString(&c->out, channel);
+    putString(&c->out, payload);
+    endMessage(&c->out, at);
+}
+
+// Copy the next word of p, a name or a quoted literal, to word, returning what follows it.
+static const char *
+nextWord (const char *p, char *word, size_t size)
+{
+    size_t n = 0;
+    while (isspace((unsigned char)*p) || *p == ',') {
+        p++;
+    }
+    char quote = *p == '\'' || *p == '"' ? *p++ : 0;
+    while (*p && (quote ? *p != quote : !isspace((unsigned char)*p) && *p != ',' && *p != ';')) {
+        if (n + 1 < size) {
+            word[n++] = quote ? *p : tolower((unsigned char)*p);
+        }
+        p++;
+    }
+    if (quote && *p) {
+        p++;
+    }
+    word[n] = '\0';
+    return p;
+}
+
+static void
+listenTo (Client *c, const char *channel, int add)
+{
+    for (int i = 0; i < MAX_LISTEN; i++) {
+        if (c->listen[i] && (strcmp(channel, "*") == 0 || strcmp(c->listen[i], channel) == 0)) {
+            free(c->listen[i]);
+            c->listen[i] = NULL;
+        }
+    }
+    for (int i = 0; add && i < MAX_LISTEN; i++) {
+        if (!c->listen[i]) {
+            c->listen[i] = checkedAlloc(strdup(channel));
+            break;
+        }
+    }
+}
+
+// Send a notification to the clients listening to channel, the sender's own among its
+// response.
+static void
+notifyListeners (Client *sender, const char *channel, const char *payload)
+{
+    for (int n = 0; n < MAX_CLIENTS; n++) {
+        Client *c = clients[n];
+        for (int i = 0; c && i < MAX_LISTEN; i++) {
+            if (c->listen[i] && strcmp(c->listen[i], channel) == 0) {
+                notification(c, sender->pid, channel, payload);
+                if (c != sender) {
+                    commit(c);
+                }
+                break;
+            }
+        }
+    }
+}
+
+// Whether text has word in it, in any case.
+static int
+mentions (const char *text, const char *word)
+{
+    size_t len = strlen(word);
+    for (; *text; text++) {
+        if (strncasecmp(text, word, len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Run a single statement of query, with the portal of an extended query or NULL.
+// Returns 0 if it failed.
+static int
+runStatement (Client *c, const char *query, Portal *portal)
+{
+    char verb[32], word[256], tag[128];
+    const char *rest = nextWord(query, verb, sizeof verb);
+    Spec spec = querySpec(query);
+    c->delay += spec.delay;
+    if (verbose) {
+        fprintf(stderr, "mockpg: %d: %s\n", c->pid, query);
+    }
+    int ends = strcmp(verb, "commit") == 0 || strcmp(verb, "end") == 0 ||
+        strcmp(verb, "rollback") == 0 || strcmp(verb, "abort") == 0;
+    if (c->txStatus == 'E' && !ends) {
+        const char *m = "current transaction is aborted, commands ignored until end of "
+            "transaction block";
+        errorResponse(c, "25P02", m, strlen(m));
+        return 0;
+    }
+    if (spec.error) {
+        errorResponse(c, "XX000", spec.error, spec.errorLen);
+        return 0;
+    }
+    if (verb[0] == '\0') {
+        emptyMessage(&c->out, 'I');
+    }
+    else if (strcmp(verb, "begin") == 0 || strcmp(verb, "start") == 0) {
+        c->txStatus = 'T';
+        commandComplete(c, "BEGIN");
+    }
+    else if (ends) {
+        int commits = verb[0] == 'c' || verb[0] == 'e';
+        commandComplete(c, commits && c->txStatus == 'T' ? "COMMIT" : "ROLLBACK");
+        c->txStatus = 'I';
+    }
+    else if (strcmp(verb, "select") == 0 || strcmp(verb, "values") == 0 ||
+            strcmp(verb, "with") == 0 || strcmp(verb, "table") == 0) {
+        if (!portal || !portal->described) {
+            rowDescription(c, &spec, portal);
+        }
+        dataRows(c, &spec, portal);
+        sprintf(tag, "SELECT %ld", spec.rows);
+        commandComplete(c, tag);
+    }
+    else if (strcmp(verb, "listen") == 0 || strcmp(verb, "unlisten") == 0) {
+        nextWord(rest, word, sizeof word);
+        listenTo(c, word, verb[0] == 'l');
+        commandComplete(c, verb[0] == 'l' ? "LISTEN" : "UNLISTEN");
+    }
+    else if (strcmp(verb, "notify") == 0) {
+        char payload[256];
+        nextWord(nextWord(rest, word, sizeof word), payload, sizeof payload);
+        commandComplete(c, "NOTIFY");
+        notifyListeners(c, word, payload);
+    }
+    else if (strcmp(verb, "copy") == 0 && mentions(query, "stdin")) {
+        // The columns are those listed after the table name, or else as many as cols says.
+        int cols = spec.cols;
+        const char *list = nextWord(rest, word, sizeof word);
+        while (isspace((unsigned char)*list)) {
+            list++;
+        }
+        if (*list == '(') {
+            cols = 1;
+            for (list++; *list && *list != ')'; list++) {
+                cols += *list == ',';
+            }
+        }
+        c->copyBinary = mentions(query, "binary");
+        size_t at = beginMessage(&c->out, 'G');
+        bufferAdd(&c->out, c->copyBinary ? "\1" : "\0", 1);
+        putInt16(&c->out, cols);
+        for (int i = 0; i < cols; i++) {
+            putInt16(&c->out, c->copyBinary);
+        }
+        endMessage(&c->out, at);
+        c->copyIn = 1;
+        c->copyHeader = 1;
+        c->copyRows = 0;
+        c->copyPending.len = 0;
+    }
+    else if (strcmp(verb, "copy") == 0) {
+        int binary = mentions(query, "binary");
+        char *buf = checkedAlloc(malloc(spec.width + 64));
+        size_t at = beginMessage(&c->out, 'H');
+        bufferAdd(&c->out, binary ? "\1" : "\0", 1);
+        putInt16(&c->out, spec.cols);
+        for (int i = 0; i < spec.cols; i++) {
+            putInt16(&c->out, binary);
+        }
+        endMessage(&c->out, at);
+        if (binary) {
+            at = beginMessage(&c->out, 'd');
+            bufferAdd(&c->out, "PGCOPY\n\377\r\n\0", 11);
+            putInt32(&c->out, 0);
+            putInt32(&c->out, 0);
+            endMessage(&c->out, at);
+        }
+        for (long r = 0; r < spec.rows; r++) {
+            at = beginMessage(&c->out, 'd');
+            if (binary) {
+                putInt16(&c->out, spec.cols);
+            }
+            for (int i = 0; i < spec.cols; i++) {
+                int len = valueText(&spec, r, i, buf);
+                if (binary) {
+                    putValueBinary(&c->out, &spec, r, i, buf, len);
+                }
+                else {
+                    bufferAdd(&c->out, buf, len);
+                    bufferAdd(&c->out, i + 1 < spec.cols ? "\t" : "\n", 1);
+                }
+            }
+            endMessage(&c->out, at);
+        }
+        if (binary) {
+            at = beginMessage(&c->out, 'd');
+            putInt16(&c->out, -1);
+            endMessage(&c->out, at);
+        }
+        free(buf);
+        emptyMessage(&c->out, 'c');
+        sprintf(tag, "COPY %ld", spec.rows);
+        commandComplete(c, tag);
+    }
+    else {
+        // Other commands complete with a tag from their verb, affecting the rows asked for.
+        long rows = (long)settingNumber(query, "rows", 1);
+        for (char *p = verb; *p; p++) {
+            *p = toupper((unsigned char)*p);
+        }
+        if (strcmp(verb, "INSERT") == 0) {
+            sprintf(tag, "INSERT 0 %ld", rows);
+        }
+        else if (strcmp(verb, "UPDATE") == 0 || strcmp(verb, "DELETE") == 0) {
+            sprintf(tag, "%s %ld", verb, rows);
+        }
+        else if (strcmp(verb, "CREATE") == 0 || strcmp(verb, "DROP") == 0) {
+            nextWord(rest, word, sizeof word);
+            for (char *p = word; *p; p++) {
+                *p = toupper((unsigned char)*p);
+            }
+            snprintf(tag, sizeof tag, "%s %.40s", verb, word);
+        }
+        else {
+            strcpy(tag, verb);
+        }
+        commandComplete(c, tag);
+    }
+    return 1;
+}
+
+// Run the statements of a simple query, split at semicolons outside of quotes.
+static void
+simpleQuery (Client *c, char *query)
+{
+    char *start = query;
+    char quote = 0;
+    int ran = 0;
+    for (char *p = query; ; p++) {
+        if (quote) {
+            quote = *p == quote ? 0 : quote;
+            if (*p) {
+                continue;
+            }
+        }
+        if (*p == '\'' || *p == '"') {
+            quote = *p;
+        }
+        else if (*p == ';' || *p == '\0') {
+            char end = *p;
+            *p = '\0';
+            const char *s = start;
+            while (isspace((unsigned char)*s)) {
+                s++;
+            }
+            if (*s || (!ran && end == '\0')) {
+                ran = 1;
+                if (!runStatement(c, s, NULL) || c->copyIn) {
+                    break;
+                }
+            }
+            if (end == '\0') {
+                break;
+            }
+            start = p + 1;
+        }
+    }
+    if (!c->copyIn) {
+        readyForQuery(c);
+    }
+    commit(c);
+}
+
+static int32_t
+getInt32 (const char **p)
+{
+    uint32_t n;
+    memcpy(&n, *p, 4);
+    *p += 4;
+    return ntohl(n);
+}
+
+static int16_t
+getInt16 (const char **p)
+{
+    uint16_t n;
+    memcpy(&n, *p, 2);
+    *p += 2;
+    return ntohs(n);
+}
+
+static Statement *
+findStatement (Client *c, const char *name, int create)
+{
+    Statement *unused = NULL;
+    for (int i = 0; i < MAX_STATEMENTS; i++) {
+        Statement *s = c->statements + i;
+        if (s->name && strcmp(s->name, name) == 0) {
+            return s;
+        }
+        if (!s->name && !unused) {
+            unused = s;
+        }
+    }
+    return create ? unused : NULL;
+}
+
+static void
+dropStatement (Statement *s)
+{
+    free(s->name);
+    free(s->query);
+    free(s->types);
+    memset(s, 0, sizeof *s);
+}
+
+// Append the text of a parameter value to b.
+static void
+paramText (Buffer *b, const char *value, int len, int binary, uint32_t type)
+{
+    char num[64];
+    if (len < 0) {
+        bufferAdd(b, "NULL", 4);
+    }
+    else if (!binary) {
+        bufferAdd(b, value, len);
+    }
+    else if (len == 1) {
+        bufferAdd(b, value[0] ? "t" : "f", 1);
+    }
+    else if (len == 2 || len == 4) {
+        const char *p = value;
+        bufferAdd(b, num, sprintf(num, "%d", len == 2 ? getInt16(&p) : getInt32(&p)));
+    }
+    else if (len == 8) {
+        const char *p = value;
+        uint64_t v = (uint64_t)(uint32_t)getInt32(&p) << 32;
+        v |= (uint32_t)getInt32(&p);
+        if (type == 701) {
+            double d;
+            memcpy(&d, &v, 8);
+            bufferAdd(b, num, sprintf(num, "%.17g", d));
+        }
+        else {
+            bufferAdd(b, num, sprintf(num, "%lld", (long long)(int64_t)v));
+        }
+    }
+    else {
+        bufferAdd(b, value, len);
+    }
+}
+
+static void
+bindMessage (Client *c, const char *p)
+{
+    const char *portalName = p;
+    p += strlen(p) + 1;
+    Statement *s = findStatement(c, p, 0);
+    p += strlen(p) + 1;
+    if (!s || portalName[0]) {
+        const char *m = s ? "only the unnamed portal is supported" : "no such statement";
+        errorResponse(c, "26000", m, strlen(m));
+        c->failed = 1;
+        return;
+    }
+    int nformats = getInt16(&p);
+    const char *formats = p;
+    p += 2 * nformats;
+    int nvalues = getInt16(&p);
+    const char **values = checkedAlloc(calloc(nvalues + 1, sizeof *values));
+    int *lengths = checkedAlloc(calloc(nvalues + 1, sizeof *lengths));
+    for (int i = 0; i < nvalues; i++) {
+        lengths[i] = getInt32(&p);
+        values[i] = p;
+        p += lengths[i] > 0 ? lengths[i] : 0;
+    }
+    // The parameters are put into the query as text.
+    Buffer q = {0};
+    for (const char *t = s->query; *t; t++) {
+        int n;
+        if (*t == '$' && isdigit((unsigned char)t[1]) && (n = atoi(t + 1)) >= 1 && n <= nvalues) {
+            const char *f = formats + 2 * (nformats == 1 ? 0 : n - 1);
+            int binary = nformats > 0 && (nformats == 1 || n <= nformats) && getInt16(&f);
+            paramText(&q, values[n - 1], lengths[n - 1], binary,
+                n <= s->nparams ? s->types[n - 1] : 0);
+            while (isdigit((unsigned char)t[1])) {
+                t++;
+            }
+        }
+        else {
+            bufferAdd(&q, t, 1);
+        }
+    }
+    bufferAdd(&q, "", 1);
+    free(values);
+    free(lengths);
+    free(c->portal.query);
+    free(c->portal.formats);
+    c->portal.query = q.data;
+    c->portal.nformats = getInt16(&p);
+    c->portal.formats = checkedAlloc(malloc((c->portal.nformats + 1) * sizeof (int16_t)));
+    for (int i = 0; i < c->portal.nformats; i++) {
+        c->portal.formats[i] = getInt16(&p);
+    }
+    c->portal.described = 0;
+    emptyMessage(&c->out, '2');
+}
+
+// Whether query returns rows, by its verb.
+static int
+returnsRows (const char *query)
+{
+    char verb[32];
+    nextWord(query, verb, sizeof verb);
+    return strcmp(verb, "select") == 0 || strcmp(verb, "values") == 0 ||
+        strcmp(verb, "with") == 0 || strcmp(verb, "table") == 0;
+}
+
+// The highest $n parameter of query.
+static int
+countParams (const char *query)
+{
+    int n = 0;
+    for (const char *p = query; (p = strchr(p, '$')); p++) {
+        if (isdigit((unsigned char)p[1]) && atoi(p + 1) > n) {
+            n = atoi(p + 1);
+        }
+    }
+    return n;
+}
+
+static void
+describeMessage (Client *c, const char *p)
+{
+    char kind = *p++;
+    if (kind == 'S') {
+        Statement *s = findStatement(c, p, 0);
+        if (!s) {
+            errorResponse(c, "26000", "no such statement", 17);
+            c->failed = 1;
+            return;
+        }
+        size_t at = beginMessage(&c->out, 't');
+        putInt16(&c->out, s->nparams);
+        for (int i = 0; i < s->nparams; i++) {
+            putInt32(&c->out, s->types[i] ? s->types[i] : 25);
+        }
+        endMessage(&c->out, at);
+        if (returnsRows(s->query)) {
+            Spec spec = querySpec(s->query);
+            rowDescription(c, &spec, NULL);
+        }
+        else {
+            emptyMessage(&c->out, 'n');
+        }
+    }
+    else if (c->portal.query && returnsRows(c->portal.query)) {
+        Spec spec = querySpec(c->portal.query);
+        rowDescription(c, &spec, &c->portal);
+        c->portal.described = 1;
+    }
+    else {
+        emptyMessage(&c->out, 'n');
+    }
+}
+
+static void
+parseMessage (Client *c, const char *p)
+{
+    const char *name = p;
+    p += strlen(p) + 1;
+    const char *query = p;
+    p += strlen(p) + 1;
+    Statement *s = findStatement(c, name, 1);
+    if (!s) {
+        errorResponse(c, "53000", "too many statements", 19);
+        c->failed = 1;
+        return;
+    }
+    dropStatement(s);
+    s->name = checkedAlloc(strdup(name));
+    s->query = checkedAlloc(strdup(query));
+    int ntypes = getInt16(&p);
+    s->nparams = ntypes > countParams(query) ? ntypes : countParams(query);
+    s->types = checkedAlloc(calloc(s->nparams + 1, sizeof *s->types));
+    for (int i = 0; i < ntypes; i++) {
+        s->types[i] = getInt32(&p);
+    }
+    emptyMessage(&c->out, '1');
+}
+
+// Count the rows of binary COPY data, whose rows may be split across messages, so that the
+// end of the data short of a whole row is kept for the next.
+static void
+copyBinaryData (Client *c, const char *data, size_t len)
+{
+    Buffer *b = &c->copyPending;
+    bufferAdd(b, data, len);
+    const char *end = b->data + b->len, *done = b->data;
+    if (c->copyHeader) {
+        // The signature and flags, then the length of the header extension and the extension.
+        if (end - done < 19) {
+            return;
+        }
+        const char *p = done + 15;
+        int32_t extension = getInt32(&p);
+        if (end - done < 19 + extension) {
+            return;
+        }
+        done += 19 + extension;
+        c->copyHeader = 0;
+    }
+    while (end - done >= 2) {
+        const char *p = done;
+        int fields = getInt16(&p), whole = 1;
+        if (fields < 0) {
+            // The trailer, after which nothing counts.
+            done = end;
+            break;
+        }
+        for (int i = 0; whole && i < fields; i++) {
+            if (end - p < 4) {
+                whole = 0;
+                break;
+            }
+            int32_t flen = getInt32(&p);
+            if (flen > 0 && end - p < flen) {
+                whole = 0;
+                break;
+            }
+            p += flen > 0 ? flen : 0;
+        }
+        if (!whole) {
+            break;
+        }
+        c->copyRows++;
+        done = p;
+    }
+    b->len = end - done;
+    memmove(b->data, done, b->len);
+}
+
+static void
+copyData (Client *c, const char *data, size_t len)
+{
+    if (c->copyBinary) {
+        copyBinaryData(c, data, len);
+        return;
+    }
+    for (size_t i = 0; i < len; i++) {
+        c->copyRows += data[i] == '\n';
+    }
+}
+
+// Handle a message of type with its body, after startup.
+static void
+handleMessage (Client *c, char type, char *body, size_t len)
+{
+    char tag[32];
+    if (c->copyIn) {
+        if (type == 'd') {
+            copyData(c, body, len);
+        }
+        else if (type == 'c' || type == 'f') {
+            c->copyIn = 0;
+            if (type == 'c') {
+                sprintf(tag, "COPY %ld", c->copyRows);
+                commandComplete(c, tag);
+            }
+            else {
+                errorResponse(c, "57014", "COPY from stdin failed", 22);
+            }
+            readyForQuery(c);
+            commit(c);
+        }
+        return;
+    }
+    if (c->failed && type != 'S') {
+        return;
+    }
+    switch (type) {
+        case 'Q':
+            simpleQuery(c, body);
+            break;
+        case 'P':
+            parseMessage(c, body);
+            break;
+        case 'B':
+            bindMessage(c, body);
+            break;
+        case 'D':
+            describeMessage(c, body);
+            break;
+        case 'E':
+            if (!c->portal.query) {
+                errorResponse(c, "34000", "no portal", 9);
+                c->failed = 1;
+            }
+            else if (!runStatement(c, c->portal.query, &c->portal)) {
+                c->failed = 1;
+            }
+            break;
+        case 'C': {
+            Statement *s = body[0] == 'S' ? findStatement(c, body + 1, 0) : NULL;
+            if (s) {
+                dropStatement(s);
+            }
+            emptyMessage(&c->out, '3');
+            break;
+        }
+        case 'H':
+            commit(c);
+            break;
+        case 'S':
+            c->failed = 0;
+            readyForQuery(c);
+            commit(c);
+            break;
+        case 'd':
+        case 'c':
+        case 'f':
+            break;
+        default: {
+            char m[64];
+            errorResponse(c, "08P01", m, sprintf(m, "unsupported message type %c", type));
+            readyForQuery(c);
+            commit(c);
+        }
+    }
+}
+
+// Handle the startup message, returning 0 if the connection is to be closed.
+static int
+handleStartup (Client *c, const char *body, size_t len)
+{
+    const char *p = body;
+    int32_t code = getInt32(&p);
+    if (code == 80877103 || code == 80877104) {
+        // No SSL or GSS encryption.
+        bufferAdd(&c->out, "N", 1);
+        commit(c);
+        return 1;
+    }
+    if (code == 80877102) {
+        // Cancel requests are accepted and ignored.
+        return 0;
+    }
+    if (code >> 16 != 3) {
+        errorResponse(c, "0A000", "unsupported protocol", 20);
+        commit(c);
+        return 0;
+    }
+    const char *user = "mockpg";
+    while (p < body + len && *p) {
+        const char *name = p;
+        p += strlen(p) + 1;
+        if (strcmp(name, "user") == 0) {
+            user = p;
+        }
+        p += strlen(p) + 1;
+    }
+    c->started = 1;
+    size_t at = beginMessage(&c->out, 'R');
+    putInt32(&c->out, 0);
+    endMessage(&c->out, at);
+    parameterStatus(c, "server_version", "15.0 (mockpg)");
+    parameterStatus(c, "server_encoding", "UTF8");
+    parameterStatus(c, "client_encoding", "UTF8");
+    parameterStatus(c, "DateStyle", "ISO, MDY");
+    parameterStatus(c, "IntervalStyle", "postgres");
+    parameterStatus(c, "TimeZone", "UTC");
+    parameterStatus(c, "integer_datetimes", "on");
+    parameterStatus(c, "standard_conforming_strings", "on");
+    parameterStatus(c, "is_superuser", "off");
+    parameterStatus(c, "session_authorization", user);
+    parameterStatus(c, "default_transaction_read_only", "off");
+    parameterStatus(c, "in_hot_standby", "off");
+    at = beginMessage(&c->out, 'K');
+    putInt32(&c->out, c->pid);
+    putInt32(&c->out, c->pid * 7919);
+    endMessage(&c->out, at);
+    readyForQuery(c);
+    commit(c);
+    return 1;
+}
+
+static void
+closeClient (int n)
+{
+    Client *c = clients[n];
+    close(c->fd);
+    while (c->head) {
+        Segment *s = c->head;
+        c->head = s->next;
+        free(s);
+    }
+    for (int i = 0; i < MAX_STATEMENTS; i++) {
+        dropStatement(c->statements + i);
+    }
+    for (int i = 0; i < MAX_LISTEN; i++) {
+        free(c->listen[i]);
+    }
+    free(c->portal.query);
+    free(c->portal.formats);
+    free(c->in.data);
+    free(c->out.data);
+    free(c->copyPending.data);
+    free(c);
+    clients[n] = NULL;
+}
+
+// Handle the complete messages read, returning 0 if the connection is to be closed.
+static int
+handleInput (Client *c)
+{
+    size_t pos = 0;
+    for (;;) {
+        size_t header = c->started ? 5 : 4;
+        if (c->in.len - pos < header) {
+            break;
+        }
+        const char *p = c->in.data + pos + header - 4;
+        uint32_t len = (uint32_t)getInt32(&p);
+        if (len < 4 || len > (1u << 30)) {
+            return 0;
+        }
+        if (c->in.len - pos < header - 4 + len) {
+            break;
+        }
+        char type = c->started ? c->in.data[pos] : 0;
+        char *body = c->in.data + pos + header;
+        size_t blen = len - 4;
+        // Bodies are read as strings, so the byte after each is set to NUL, the type of the
+        // next message being kept aside.
+        char next = pos + header + blen < c->in.len ? body[blen] : 0;
+        if (pos + header + blen == c->in.len) {
+            bufferAdd(&c->in, "", 1);
+            c->in.len--;
+            body = c->in.data + pos + header;
+        }
+        body[blen] = '\0';
+        int ok = 1;
+        if (!c->started) {
+            ok = handleStartup(c, body, blen);
+        }
+        else if (type == 'X') {
+            ok = 0;
+        }
+        else {
+            handleMessage(c, type, body, blen);
+        }
+        body[blen] = next;
+        pos += header + blen;
+        if (!ok) {
+            return 0;
+        }
+    }
+    memmove(c->in.data, c->in.data + pos, c->in.len - pos);
+    c->in.len -= pos;
+    return 1;
+}
+
+// Send what is due of the output of c, as bandwidth allows. Returns 0 on a write error.
+static int
+sendDue (Client *c, double t)
+{
+    while (c->head && c->head->due <= t && c->nextSend <= t) {
+        Segment *s = c->head;
+        size_t n = s->len - s->off;
+        if (bandwidth > 0) {
+            size_t allowed = bandwidth * 0.001 > 1 ? bandwidth * 0.001 : 1;
+            n = n < allowed ? n : allowed;
+        }
+        n = n < SEND_CHUNK ? n : SEND_CHUNK;
+        ssize_t w = send(c->fd, s->data + s->off, n, MSG_NOSIGNAL);
+        if (w < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        s->off += w;
+        if (bandwidth > 0) {
+            c->nextSend = (c->nextSend > t - 0.001 ? c->nextSend : t) + w / bandwidth;
+        }
+        if (s->off == s->len) {
+            c->head = s->next;
+            if (!c->head) {
+                c->tail = NULL;
+            }
+            free(s);
+        }
+        if ((size_t)w < n) {
+            break;
+        }
+    }
+    return 1;
+}
+
+static void
+loadScript (const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        exit(1);
+    }
+    char line[4096];
+    while (fgets(line, sizeof line, f)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        char *tab = strchr(line, '\t');
+        if (line[0] == '#' || !tab) {
+            continue;
+        }
+        *tab = '\0';
+        scriptPrefixes = checkedAlloc(realloc(scriptPrefixes,
+            (scriptSize + 1) * sizeof *scriptPrefixes));
+        scriptSpecs = checkedAlloc(realloc(scriptSpecs, (scriptSize + 1) * sizeof *scriptSpecs));
+        scriptPrefixes[scriptSize] = checkedAlloc(strdup(line));
+        scriptSpecs[scriptSize++] = checkedAlloc(strdup(tab + 1));
+    }
+    fclose(f);
+}
+
+static void
+usage (const char *name)
+{
+    fprintf(stderr, "usage: %s [-a address] [-p port] [-r rtt] [-b bytes/s] [-s script] [-v]\n",
+        name);
+    exit(2);
+}
+
+int
+main (int argc, char *argv[])
+{
+    const char *address = "127.0.0.1";
+    int port = 15432, opt;
+    while ((opt = getopt(argc, argv, "a:p:r:b:s:v")) != -1) {
+        switch (opt) {
+            case 'a':
+                address = optarg;
+                break;
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 'r':
+                rtt = atof(optarg);
+                break;
+            case 'b':
+                bandwidth = atof(optarg);
+                break;
+            case 's':
+                loadScript(optarg);
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    signal(SIGPIPE, SIG_IGN);
+    int lfd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+    struct sockaddr_in sa = {0};
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(port);
+    if (inet_pton(AF_INET, address, &sa.sin_addr) != 1) {
+        usage(argv[0]);
+    }
+    if (bind(lfd, (struct sockaddr *)&sa, sizeof sa) != 0 || listen(lfd, 128) != 0) {
+        perror("mockpg");
+        return 1;
+    }
+    fcntl(lfd, F_SETFL, O_NONBLOCK);
+    fprintf(stderr, "mockpg: listening on %s:%d\n", address, port);
+
+    struct pollfd fds[MAX_CLIENTS + 1];
+    int owners[MAX_CLIENTS + 1];
+    for (;;) {
+        double t = now(), wake = -1;
+        int nfds = 1;
+        fds[0].fd = lfd;
+        fds[0].events = POLLIN;
+        for (int n = 0; n < MAX_CLIENTS; n++) {
+            Client *c = clients[n];
+            if (!c) {
+                continue;
+            }
+            fds[nfds].fd = c->fd;
+            fds[nfds].events = POLLIN;
+            if (c->head) {
+                double ready = c->head->due > c->nextSend ? c->head->due : c->nextSend;
+                if (ready <= t) {
+                    fds[nfds].events |= POLLOUT;
+                }
+                else if (wake < 0 || ready < wake) {
+                    wake = ready;
+                }
+            }
+            owners[nfds++] = n;
+        }
+        int timeout = wake < 0 ? -1 : (int)ceil((wake - t) * 1000);
+        if (poll(fds, nfds, timeout) < 0 && errno != EINTR) {
+            perror("mockpg");
+            return 1;
+        }
+        if (fds[0].revents & POLLIN) {
+            int fd;
+            while ((fd = accept(lfd, NULL, NULL)) >= 0) {
+                int n = 0;
+                while (n < MAX_CLIENTS && clients[n]) {
+                    n++;
+                }
+                if (n == MAX_CLIENTS) {
+                    close(fd);
+                    continue;
+                }
+                fcntl(fd, F_SETFL, O_NONBLOCK);
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+                Client *c = checkedAlloc(calloc(1, sizeof *c));
+                c->fd = fd;
+                c->pid = nextPid++;
+                c->txStatus = 'I';
+                clients[n] = c;
+            }
+        }
+        t = now();
+        for (int i = 1; i < nfds; i++) {
+            int n = owners[i];
+            Client *c = clients[n];
+            int ok = 1;
+            if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                char buf[65536];
+                ssize_t r = recv(c->fd, buf, sizeof buf, 0);
+                if (r > 0) {
+                    bufferAdd(&c->in, buf, r);
+                    ok = handleInput(c);
+                }
+                else if (r == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                    ok = 0;
+                }
+            }
+            if (ok) {
+                ok = sendDue(c, t);
+            }
+            if (!ok) {
+                closeClient(n);
+            }
+        }
+    }
+}
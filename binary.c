@@ -0,0 +1,592 @@
+#include "binary.h"
+#include "geotypes.h"
+
+// Days between the Unix epoch and the PostgreSQL epoch (2000-01-01).
+#define PG_EPOCH_DAYS 10957
+#define USECS_PER_DAY INT64_C(86400000000)
+
+// Sign word values of the binary numeric format.
+#define NUMERIC_NEG 0x4000
+#define NUMERIC_NAN 0xC000
+#define NUMERIC_PINF 0xD000
+#define NUMERIC_NINF 0xF000
+
+int
+isArrayType (PGtype type)
+{
+    switch (type) {
+        case boolAOID:
+        case byteaAOID:
+        case intA2OID:
+        case intA4OID:
+        case textAOID:
+        case bpcharAOID:
+        case varcharAOID:
+        case intA8OID:
+        case floatA4OID:
+        case floatA8OID:
+        case timestampAOID:
+        case dateAOID:
+        case timestamptzAOID:
+        case numericAOID:
+        case uuidAOID:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// Upper bound on the text length of a binary numeric value: sign, integer digits, point,
+// scale digits, the overrun of the last digit group and the terminator.
+static int
+numericTextSize (const char *value)
+{
+    return 1 + MAX(readInt16(value + 2) + 1, 1) * 4 + 1 + readInt16(value + 6) + 4 + 1;
+}
+
+// Write the decimal text of a binary numeric value into buf.
+// Returns the text length, or -1 if buf is too small to hold it.
+int
+numericText (const char *value, char *buf, int size)
+{
+    int ndigits = readInt16(value);
+    int weight = readInt16(value + 2);
+    int sign = (uint16_t)readInt16(value + 4);
+    int dscale = readInt16(value + 6);
+    const char *digits = value + 8;
+    char *p = buf;
+
+    switch (sign) {
+        case NUMERIC_NAN:
+            return snprintf(buf, size, "NaN");
+        case NUMERIC_PINF:
+            return snprintf(buf, size, "Infinity");
+        case NUMERIC_NINF:
+            return snprintf(buf, size, "-Infinity");
+    }
+    if (size < numericTextSize(value)) {
+        return -1;
+    }
+    if (sign == NUMERIC_NEG) {
+        *p++ = '-';
+    }
+    if (weight < 0) {
+        *p++ = '0';
+    }
+    else {
+        for (int d = 0; d <= weight; d++) {
+            int dig = d < ndigits ? readInt16(digits + d * 2) : 0;
+            // No leading zeros on the first digit group.
+            if (d == 0) {
+                p += sprintf(p, "%d", dig);
+            }
+            else {
+                p += sprintf(p, "%04d", dig);
+            }
+        }
+    }
+    if (dscale > 0) {
+        char *point = p;
+        *p++ = '.';
+        for (int d = weight + 1; p - point - 1 < dscale; d++) {
+            int dig = (d >= 0 && d < ndigits) ? readInt16(digits + d * 2) : 0;
+            p += sprintf(p, "%04d", dig);
+        }
+        // Cut off the digits past the display scale.
+        p = point + 1 + dscale;
+    }
+    *p = '\0';
+    return p - buf;
+}
+
+static void
+pushNumeric (lua_State *L, const char *value, TypeMapping mapping)
+{
+    char local[64];
+    char *buf = local;
+    int len = numericText(value, local, sizeof local);
+    if (len < 0) {
+        // Very wide values, size the buffer from the header.
+        int size = numericTextSize(value);
+        buf = malloc(size);
+        len = numericText(value, buf, size);
+    }
+    if (mapping == mapString) {
+        lua_pushlstring(L, buf, len);
+    }
+    else {
+        lua_pushnumber(L, strtod(buf, NULL));
+    }
+    if (buf != local) {
+        free(buf);
+    }
+}
+
+// The value of a binary numeric as a double, as it would be parsed from its text.
+double
+numericDouble (const char *value)
+{
+    char local[64];
+    char *buf = local;
+    double d;
+    if (numericText(value, local, sizeof local) < 0) {
+        int size = numericTextSize(value);
+        buf = malloc(size);
+        if (!buf) {
+            return 0;
+        }
+        numericText(value, buf, size);
+    }
+    d = strtod(buf, NULL);
+    if (buf != local) {
+        free(buf);
+    }
+    return d;
+}
+
+// Convert days since 1970-01-01 to a civil date.
+static void
+civilFromDays (int64_t z, int *year, int *month, int *day)
+{
+    z += 719468;
+    int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+    unsigned doe = (unsigned)(z - era * 146097);
+    unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    unsigned mp = (5 * doy + 2) / 153;
+    *day = doy - (153 * mp + 2) / 5 + 1;
+    *month = mp < 10 ? mp + 3 : mp - 9;
+    *year = (int)(yoe + era * 400) + (*month <= 2);
+}
+
+// Format a date in the ISO style used by the server, with a BC suffix for years before 1 AD.
+static int
+formatDate (char *buf, int64_t days)
+{
+    int year, month, day;
+    civilFromDays(days + PG_EPOCH_DAYS, &year, &month, &day);
+    if (year <= 0) {
+        return sprintf(buf, "%04d-%02d-%02d BC", 1 - year, month, day);
+    }
+    return sprintf(buf, "%04d-%02d-%02d", year, month, day);
+}
+
+// Push a timestamp as the text output would show it. A timestamp with time zone is shown in
+// UTC, as the binary value does not carry the session's time zone to convert it to.
+static void
+pushTimestamp (lua_State *L, const char *value, int withZone)
+{
+    char buf[64];
+    int64_t usec = readInt64(value);
+    if (usec == INT64_MAX) {
+        lua_pushliteral(L, "infinity");
+        return;
+    }
+    if (usec == INT64_MIN) {
+        lua_pushliteral(L, "-infinity");
+        return;
+    }
+    int64_t days = usec / USECS_PER_DAY;
+    int64_t time = usec % USECS_PER_DAY;
+    if (time < 0) {
+        time += USECS_PER_DAY;
+        days--;
+    }
+    int64_t secs = time / 1000000;
+    int fraction = (int)(time % 1000000);
+    int year, month, day;
+    civilFromDays(days + PG_EPOCH_DAYS, &year, &month, &day);
+    char *p = buf + sprintf(buf, "%04d-%02d-%02d %02d:%02d:%02d", year <= 0 ? 1 - year : year,
+        month, day, (int)(secs / 3600), (int)(secs / 60 % 60), (int)(secs % 60));
+    if (fraction) {
+        p += sprintf(p, ".%06d", fraction);
+        // Trailing zeros are trimmed as in the text output.
+        while (p[-1] == '0') {
+            p--;
+        }
+    }
+    if (withZone) {
+        p += sprintf(p, "+00");
+    }
+    if (year <= 0) {
+        p += sprintf(p, " BC");
+    }
+    lua_pushlstring(L, buf, p - buf);
+}
+
+static void
+pushUuid (lua_State *L, const char *value)
+{
+    static const char hex[] = "0123456789abcdef";
+    char buf[36];
+    char *p = buf;
+    for (int i = 0; i < 16; i++) {
+        if (i == 4 || i == 6 || i == 8 || i == 10) {
+            *p++ = '-';
+        }
+        *p++ = hex[(unsigned char)value[i] >> 4];
+        *p++ = hex[value[i] & 0x0f];
+    }
+    lua_pushlstring(L, buf, sizeof buf);
+}
+
+// Push a binary integer either as a Lua number or, if mapped to String, as its decimal text.
+static void
+pushInteger (lua_State *L, int64_t v, TypeMapping mapping)
+{
+    if (mapping == mapString) {
+        char buf[24];
+        lua_pushlstring(L, buf, sprintf(buf, "%lld", (long long)v));
+    }
+    else {
+        lua_pushnumber(L, (lua_Number)v);
+    }
+}
+
+// Parse one dimension of a binary array. *pos is advanced past the elements consumed.
+static void
+pushArrayDim (lua_State *L, const char **pos, const int32_t *dims, int level, int ndim, PGtype elemType)
+{
+    lua_createtable(L, dims[level], 0);
+    for (int i = 1; i <= dims[level]; i++) {
+        if (level < ndim - 1) {
+            pushArrayDim(L, pos, dims, level + 1, ndim, elemType);
+        }
+        else {
+            int32_t len = readInt32(*pos);
+            *pos += 4;
+            if (len < 0) {
+                // Leave a hole for a NULL element.
+                continue;
+            }
+            pushBinaryValue(L, *pos, len, elemType, mapDefault);
+            *pos += len;
+        }
+        lua_rawseti(L, -2, i);
+    }
+}
+
+// Array values are sent with a header of the dimension count, a null flag and the element
+// type, followed by a size and lower bound per dimension and then the elements.
+static void
+pushBinaryArray (lua_State *L, const char *value)
+{
+    int ndim = readInt32(value);
+    PGtype elemType = (PGtype)readInt32(value + 8);
+    const char *pos = value + 12;
+    if (ndim <= 0) {
+        lua_newtable(L);
+        return;
+    }
+    int32_t dims[ndim];
+    for (int i = 0; i < ndim; i++) {
+        dims[i] = readInt32(pos);
+        pos += 8;   // Lower bounds are not represented in the Lua table.
+    }
+    pushArrayDim(L, &pos, dims, 0, ndim, elemType);
+}
+
+// Push a value received in the binary format. Arrays and geometric values are always
+// decoded into tables, since their binary form has no use as a Lua string.
+void
+pushBinaryValue (lua_State *L, const char *value, int len, PGtype columnType, TypeMapping mapping)
+{
+    char buf[32];
+    switch (columnType) {
+        case boolOID:
+            lua_pushboolean(L, value[0]);
+            break;
+        case int2OID:
+            pushInteger(L, readInt16(value), mapping);
+            break;
+        case int4OID:
+            pushInteger(L, readInt32(value), mapping);
+            break;
+        case oidOID:
+            pushInteger(L, (uint32_t)readInt32(value), mapping);
+            break;
+        case int8OID:
+            pushInteger(L, readInt64(value), mapping);
+            break;
+        case float4OID:
+            if (mapping == mapString) {
+                lua_pushlstring(L, buf, sprintf(buf, "%.9g", readFloat4(value)));
+            }
+            else {
+                lua_pushnumber(L, readFloat4(value));
+            }
+            break;
+        case float8OID:
+            if (mapping == mapString) {
+                lua_pushlstring(L, buf, sprintf(buf, "%.17g", readFloat8(value)));
+            }
+            else {
+                lua_pushnumber(L, readFloat8(value));
+            }
+            break;
+        case numericOID:
+            pushNumeric(L, value, mapping);
+            break;
+        case dateOID:
+            lua_pushlstring(L, buf, formatDate(buf, readInt32(value)));
+            break;
+        case timestampOID:
+            pushTimestamp(L, value, 0);
+            break;
+        case timestamptzOID:
+            pushTimestamp(L, value, 1);
+            break;
+        case uuidOID:
+            pushUuid(L, value);
+            break;
+        case jsonbOID:
+            // Skip the jsonb format version byte.
+            lua_pushlstring(L, value + 1, len - 1);
+            break;
+        case pointOID:
+            pushGeoPointBinary(L, value);
+            break;
+        case lsegOID:
+            pushGeoLineBinary(L, value);
+            break;
+        case boxOID:
+            pushGeoBoxBinary(L, value);
+            break;
+        case pathOID:
+            pushGeoPathBinary(L, value);
+            break;
+        case polygonOID:
+            pushGeoPolygonBinary(L, value);
+            break;
+        case circleOID:
+            pushGeoCircleBinary(L, value);
+            break;
+        default:
+            if (isArrayType(columnType) || mapping == mapArray) {
+                pushBinaryArray(L, value);
+            }
+            // Text-like types and bytea are sent as their raw bytes.
+            else {
+                lua_pushlstring(L, value, len);
+            }
+    }
+}
+
+// Write the binary form of a number for a parameter of an integer or floating-point type.
+// Returns the length written, or 0 if the number can not be represented in that type.
+int
+numberBinary (lua_Number n, PGtype type, char *buf)
+{
+    // Integer types only take integral values within their range.
+    int integral = n >= -9223372036854775808.0 && n < 9223372036854775808.0 &&
+        (lua_Number)(int64_t)n == n;
+    switch (type) {
+        case int2OID:
+            if (!integral || n < INT16_MIN || n > INT16_MAX) {
+                return 0;
+            }
+            writeInt16(buf, (int16_t)n);
+            return 2;
+        case int4OID:
+            if (!integral || n < INT32_MIN || n > INT32_MAX) {
+                return 0;
+            }
+            writeInt32(buf, (int32_t)n);
+            return 4;
+        case int8OID:
+            if (!integral) {
+                return 0;
+            }
+            writeInt64(buf, (int64_t)n);
+            return 8;
+        case float4OID:
+            writeFloat4(buf, (float)n);
+            return 4;
+        case float8OID:
+            writeFloat8(buf, n);
+            return 8;
+        default:
+            return 0;
+    }
+}
+
+#define MAXDIM 6
+
+// Shape and element kinds of a Lua table to be sent as a binary array.
+typedef struct {
+    int ndim;
+    int32_t dims[MAXDIM];
+    int nelem;
+    int nnull;
+    int numbers;    // Count of number elements.
+    int integers;   // Count of integral number elements.
+    int booleans;   // Count of boolean elements.
+} ArrayShape;
+
+// Check that the table at index is rectangular to the dimensions of shape, while counting
+// its element kinds. Returns 0 for a ragged table or an element of another kind.
+static int
+scanArray (lua_State *L, int index, int level, ArrayShape *shape)
+{
+    char probe[8];
+    if ((int)lua_objlen(L, index) != shape->dims[level]) {
+        return 0;
+    }
+    for (int i = 1; i <= shape->dims[level]; i++) {
+        int ok = 1;
+        lua_rawgeti(L, index, i);
+        if (level < shape->ndim - 1) {
+            ok = lua_istable(L, -1) && scanArray(L, lua_gettop(L), level + 1, shape);
+        }
+        else {
+            shape->nelem++;
+            switch (lua_type(L, -1)) {
+                case LUA_TNIL:
+                    shape->nnull++;
+                    break;
+                case LUA_TBOOLEAN:
+                    shape->booleans++;
+                    break;
+                case LUA_TNUMBER:
+                    shape->numbers++;
+                    if (numberBinary(lua_tonumber(L, -1), int8OID, probe)) {
+                        shape->integers++;
+                    }
+                    break;
+                default:
+                    ok = 0;
+            }
+        }
+        lua_pop(L, 1);
+        if (!ok) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Write the elements of the table at index in the binary array element format.
+static char *
+writeArrayElements (lua_State *L, int index, int level, const ArrayShape *shape,
+    PGtype elemType, char *p)
+{
+    for (int i = 1; i <= shape->dims[level]; i++) {
+        lua_rawgeti(L, index, i);
+        if (level < shape->ndim - 1) {
+            p = writeArrayElements(L, lua_gettop(L), level + 1, shape, elemType, p);
+        }
+        else if (lua_isnil(L, -1)) {
+            writeInt32(p, -1);
+            p += 4;
+        }
+        else if (elemType == boolOID) {
+            writeInt32(p, 1);
+            p[4] = lua_toboolean(L, -1);
+            p += 5;
+        }
+        else {
+            int len = numberBinary(lua_tonumber(L, -1), elemType, p + 4);
+            writeInt32(p, len);
+            p += 4 + len;
+        }
+        lua_pop(L, 1);
+    }
+    return p;
+}
+
+// Push the binary array form of the table at index. The array type is taken from arrayType
+// if given, or else chosen from the elements, as boolean[] for booleans, bigint[] for
+// integers and double precision[] for other numbers.
+// Returns the array type pushed, or 0 with nothing pushed if the table has no binary form.
+PGtype
+arrayBinaryFromTable (lua_State *L, int index, PGtype arrayType)
+{
+    ArrayShape shape = {0};
+    PGtype elemType;
+    int width;
+
+    // The dimensions are taken from the first element at each level.
+    lua_pushvalue(L, index);
+    while (lua_istable(L, -1) && shape.ndim < MAXDIM) {
+        shape.dims[shape.ndim++] = lua_objlen(L, -1);
+        lua_rawgeti(L, -1, 1);
+    }
+    lua_pop(L, shape.ndim + 1);
+    if (shape.dims[shape.ndim - 1] == 0 || !scanArray(L, index, 0, &shape)) {
+        return 0;
+    }
+
+    // Choose the array type from the elements if not given.
+    if (arrayType == 0) {
+        if (shape.booleans + shape.nnull == shape.nelem) {
+            arrayType = boolAOID;
+        }
+        else if (shape.integers + shape.nnull == shape.nelem) {
+            arrayType = intA8OID;
+        }
+        else if (shape.numbers + shape.nnull == shape.nelem) {
+            arrayType = floatA8OID;
+        }
+    }
+    switch (arrayType) {
+        case boolAOID:
+            elemType = boolOID;
+            break;
+        case intA2OID:
+            elemType = int2OID;
+            break;
+        case intA4OID:
+            elemType = int4OID;
+            break;
+        case intA8OID:
+            elemType = int8OID;
+            break;
+        case floatA4OID:
+            elemType = float4OID;
+            break;
+        case floatA8OID:
+            elemType = float8OID;
+            break;
+        default:
+            return 0;
+    }
+    if (elemType == boolOID) {
+        width = 1;
+        if (shape.booleans + shape.nnull != shape.nelem) {
+            return 0;
+        }
+    }
+    else {
+        char probe[8];
+        width = numberBinary(0, elemType, probe);
+        if (shape.numbers + shape.nnull != shape.nelem) {
+            return 0;
+        }
+        // Integer elements must fit the element type; fall back to text so that the server
+        // reports any that do not.
+        if (elemType != float4OID && elemType != float8OID && shape.integers != shape.numbers) {
+            return 0;
+        }
+    }
+
+    size_t size = 12 + 8 * shape.ndim + 4 * shape.nelem + width * (shape.nelem - shape.nnull);
+    char *buf = malloc(size);
+    char *p = buf + 12;
+    writeInt32(buf, shape.ndim);
+    writeInt32(buf + 4, shape.nnull > 0);
+    writeInt32(buf + 8, elemType);
+    for (int i = 0; i < shape.ndim; i++) {
+        writeInt32(p, shape.dims[i]);
+        writeInt32(p + 4, 1);
+        p += 8;
+    }
+    p = writeArrayElements(L, index, 0, &shape, elemType, p);
+    // An integer out of range for a narrower element type leaves the array short.
+    if ((size_t)(p - buf) != size) {
+        free(buf);
+        return 0;
+    }
+    lua_pushlstring(L, buf, size);
+    free(buf);
+    return arrayType;
+}
@@ -0,0 +1,104 @@
+#ifndef _BINARY_H
+#define _BINARY_H
+
+#include <stdint.h>
+#include "session.h"
+
+// Read network byte order values from the binary wire format.
+static inline int16_t
+readInt16 (const char *p)
+{
+    const unsigned char *u = (const unsigned char *)p;
+    return (int16_t)((u[0] << 8) | u[1]);
+}
+
+static inline int32_t
+readInt32 (const char *p)
+{
+    const unsigned char *u = (const unsigned char *)p;
+    return (int32_t)(((uint32_t)u[0] << 24) | ((uint32_t)u[1] << 16) | ((uint32_t)u[2] << 8) | u[3]);
+}
+
+static inline int64_t
+readInt64 (const char *p)
+{
+    return (int64_t)(((uint64_t)(uint32_t)readInt32(p) << 32) | (uint32_t)readInt32(p + 4));
+}
+
+static inline float
+readFloat4 (const char *p)
+{
+    union { uint32_t i; float f; } u;
+    u.i = (uint32_t)readInt32(p);
+    return u.f;
+}
+
+static inline double
+readFloat8 (const char *p)
+{
+    union { uint64_t i; double f; } u;
+    u.i = (uint64_t)readInt64(p);
+    return u.f;
+}
+
+// Write values in network byte order for the binary wire format.
+static inline void
+writeInt16 (char *p, int16_t v)
+{
+    unsigned char *u = (unsigned char *)p;
+    u[0] = (uint16_t)v >> 8;
+    u[1] = (uint16_t)v;
+}
+
+static inline void
+writeInt32 (char *p, int32_t v)
+{
+    unsigned char *u = (unsigned char *)p;
+    u[0] = (uint32_t)v >> 24;
+    u[1] = (uint32_t)v >> 16;
+    u[2] = (uint32_t)v >> 8;
+    u[3] = (uint32_t)v;
+}
+
+static inline void
+writeInt64 (char *p, int64_t v)
+{
+    writeInt32(p, (int32_t)((uint64_t)v >> 32));
+    writeInt32(p + 4, (int32_t)(uint64_t)v);
+}
+
+static inline void
+writeFloat4 (char *p, float v)
+{
+    union { uint32_t i; float f; } u;
+    u.f = v;
+    writeInt32(p, (int32_t)u.i);
+}
+
+static inline void
+writeFloat8 (char *p, double v)
+{
+    union { uint64_t i; double f; } u;
+    u.f = v;
+    writeInt64(p, (int64_t)u.i);
+}
+
+int
+isArrayType (PGtype type);
+
+int
+numberBinary (lua_Number n, PGtype type, char *buf);
+
+PGtype
+arrayBinaryFromTable (lua_State *L, int index, PGtype arrayType);
+
+int
+numericText (const char *value, char *buf, int size);
+
+double
+numericDouble (const char *value);
+
+void
+pushBinaryValue (lua_State *L, const char *value, int len, PGtype columnType, TypeMapping mapping);
+
+#endif
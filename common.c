@@ -1,8 +1,10 @@
+#define _POSIX_C_SOURCE 200809L
+#include <time.h>
 #include "common.h"
 #include "ctype.h"
 
 int
-stringNamedNull (char *str)
+stringNamedNull (const char *str)
 {
     if (tolower(str[0]) == 'n' && tolower(str[1]) == 'u' &&
             tolower(str[2]) == 'l' && tolower(str[3]) == 'l') {
@@ -13,69 +15,173 @@ stringNamedNull (char *str)
     }
 }
  
-// Turn the table value at index into a PostgreSQL array value.
+// Seconds on a clock that only moves forward, for measuring intervals.
+double
+monotonicTime (void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Get the parameter converter of the value at index, or NULL if it is not an Array, as other
+// userdata are not converters.
+ParamConvert *
+toParamConvert (lua_State *L, int index)
+{
+    ParamConvert *pconv = lua_touserdata(L, index);
+    if (!pconv || !lua_getmetatable(L, index)) {
+        return NULL;
+    }
+    luaL_getmetatable(L, ARRAY_REGNAME);
+    int isArray = lua_rawequal(L, -1, -2);
+    lua_pop(L, 2);
+    return isArray ? pconv : NULL;
+}
+
+// FNV-1a hash of len bytes.
+uint32_t
+fnv1a (const char *s, size_t len)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)s[i]) * 16777619u;
+    }
+    return h;
+}
+
+// Whether the next draw is sampled, for a fraction of the draws, by a xorshift generator
+// advanced in state, which must not be 0.
+int
+sampleDraw (uint32_t *state, double fraction)
+{
+    if (fraction >= 1) {
+        return 1;
+    }
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state < fraction * 4294967296.0;
+}
+
+// Start an empty text buffer, held in a userdata pushed on the stack.
+void
+textBufferInit (lua_State *L, TextBuffer *tb)
+{
+    tb->size = 256;
+    tb->len = 0;
+    tb->data = lua_newuserdata(L, tb->size);
+    tb->slot = lua_gettop(L);
+}
+
+// Append len bytes of s. A larger userdata replaces the buffer in its stack slot as it
+// grows, and the old one is left to be collected.
 void
-arrayFromTable (lua_State *L, int index)
+textBufferAdd (lua_State *L, TextBuffer *tb, const char *s, size_t len)
+{
+    if (tb->len + len > tb->size) {
+        size_t size = MAX(tb->size * 2, tb->len + len);
+        char *data = lua_newuserdata(L, size);
+        memcpy(data, tb->data, tb->len);
+        lua_replace(L, tb->slot);
+        tb->data = data;
+        tb->size = size;
+    }
+    memcpy(tb->data + tb->len, s, len);
+    tb->len += len;
+}
+
+// Write the text of a number into buf, which holds at least 32 characters. Integers are
+// written without an exponent, so that integer columns take them, and other numbers in
+// the shortest form that reads back to the same number. Returns the length written.
+int
+numberText (lua_Number n, char *buf)
+{
+    int len;
+    if (n > -1e18 && n < 1e18 && n == (lua_Number)(long long)n) {
+        return sprintf(buf, "%lld", (long long)n);
+    }
+    len = sprintf(buf, "%.15g", n);
+    if (strtod(buf, NULL) != n) {
+        len = sprintf(buf, "%.17g", n);
+    }
+    return len;
+}
+
+// Append a string array element, quoted and escaped where the array syntax needs it.
+static void
+arrayElementText (lua_State *L, TextBuffer *tb, const char *s, size_t len)
+{
+    int quote = len == 0 || (len == 4 && stringNamedNull(s));
+    int escape = 0;
+    for (size_t i = 0; i < len; i++) {
+        switch (s[i]) {
+            case '"':
+            case '\\':
+                escape = 1;
+                break;
+            case '{':
+            case '}':
+            case ',':
+            case ';':
+            case ' ':
+            case '\t':
+            case '\n':
+            case '\r':
+                quote = 1;
+                break;
+        }
+    }
+    if (!quote && !escape) {
+        textBufferAdd(L, tb, s, len);
+        return;
+    }
+    textBufferAdd(L, tb, "\"", 1);
+    const char *run = s;
+    for (const char *p = s; escape && p < s + len; p++) {
+        if (*p == '"' || *p == '\\') {
+            textBufferAdd(L, tb, run, p - run);
+            textBufferAdd(L, tb, "\\", 1);
+            run = p;
+        }
+    }
+    textBufferAdd(L, tb, run, s + len - run);
+    textBufferAdd(L, tb, "\"", 1);
+}
+
+// Append the table at index as a PostgreSQL array value, with nested tables as the inner
+// arrays. Numbers and booleans are written directly, without the quoting checks of strings.
+void
+arrayText (lua_State *L, int index, TextBuffer *tb)
 {
     int tabLen = lua_objlen(L, index);
-    luaL_Buffer arrText;
-    luaL_buffinit(L, &arrText);
+    char num[32];
+    size_t len;
+    const char *s;
+    textBufferAdd(L, tb, "{", 1);
     for (int i = 1; i <= tabLen; i++) {
-        // Open brace on first iteration.
-        if (i == 1) {
-            luaL_addchar(&arrText, '{');
-        }
-        // A comma on all subsequent iterations.
-        else {
-            luaL_addchar(&arrText, ',');
+        if (i > 1) {
+            textBufferAdd(L, tb, ",", 1);
         }
         lua_rawgeti(L, index, i);
-        if (lua_istable(L, -1)) {
-            arrayFromTable(L, lua_gettop(L));
-            // Remove the processed table element off the stack.
-            lua_remove(L, -2);
-        }
-        else {
-            int escaped = 0, stringval = 0;
-            if (lua_isnil(L, -1)) {
-                lua_pushliteral(L, "NULL");
-                lua_remove(L, -2);
-            }
-            else {
-                stringval = 1;
-                char *nextValue = (char *)luaL_checkstring(L, -1);
-                // Escape double quote and backslash.
-                if (strpbrk(nextValue, "\"\\")) {
-                    luaL_Buffer itemText;
-                    char *brk, *last = nextValue;
-                    escaped = 1;
-                    luaL_buffinit(L, &itemText);
-                    while ((brk = strpbrk(last, "\"\\"))) {
-                        luaL_addlstring(&itemText, last, brk - last);
-                        luaL_addchar(&itemText, '\\');
-                        luaL_addchar(&itemText, *brk);
-                        last = brk + 1;
-                    }
-                    // Add the rest to the end.
-                    luaL_addstring(&itemText, last);
-                    luaL_pushresult(&itemText);
-                    lua_remove(L, -2);
-                }
-            }
-            // Surround in double quotes, if needed.
-            char *st = (char *)lua_tostring(L, -1);
-            if (strcmp(st, "") == 0 ||
-                    escaped || strpbrk(st, "{},; ") || (stringNamedNull(st) && stringval)) {
-                lua_pushliteral(L, "\"");
-                lua_insert(L, -2);
-                lua_pushliteral(L, "\"");
-                lua_concat(L, 3);
-            }
+        switch (lua_type(L, -1)) {
+            case LUA_TNUMBER:
+                textBufferAdd(L, tb, num, numberText(lua_tonumber(L, -1), num));
+                break;
+            case LUA_TBOOLEAN:
+                textBufferAdd(L, tb, lua_toboolean(L, -1) ? "t" : "f", 1);
+                break;
+            case LUA_TNIL:
+                textBufferAdd(L, tb, "NULL", 4);
+                break;
+            case LUA_TTABLE:
+                arrayText(L, lua_gettop(L), tb);
+                break;
+            default:
+                s = luaL_checklstring(L, -1, &len);
+                arrayElementText(L, tb, s, len);
         }
-        luaL_addvalue(&arrText);
+        lua_pop(L, 1);
     }
-    luaL_addchar(&arrText, '}');
-    // Push the array string on to the stack
-    luaL_pushresult(&arrText);
+    textBufferAdd(L, tb, "}", 1);
 }
-            
@@ -1,6 +1,7 @@
 #ifndef _COMMON_H
 #define _COMMON_H
 
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,20 +13,57 @@
 #include <libpq-fe.h>
 
 #define MAX(a,b) ((a) > (b) ? (a) : (b))
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
 
 int
-stringNamedNull (char *);
+stringNamedNull (const char *);
+
+double
+monotonicTime (void);
+
+uint32_t
+fnv1a (const char *s, size_t len);
+
+int
+sampleDraw (uint32_t *state, double fraction);
+
+// A growable text buffer, held in a userdata at stack position slot so that it is collected
+// even if an error is raised while it is being filled.
+typedef struct {
+    char *data;
+    size_t len;
+    size_t size;
+    int slot;
+} TextBuffer;
+
+void
+textBufferInit (lua_State *L, TextBuffer *tb);
 
 void
-arrayFromTable (lua_State *L, int index);
+textBufferAdd (lua_State *L, TextBuffer *tb, const char *s, size_t len);
+
+int
+numberText (lua_Number n, char *buf);
 
-// A userdata for converting a Lua table value to a
-// C string in the proper format of an SQL parameter.
+void
+arrayText (lua_State *L, int index, TextBuffer *tb);
+
+// A userdata for converting a Lua table value, kept as its environment, to a parameter.
+// convert appends the text format of the value to a text buffer, for a parameter.
+// encode pushes the binary format of the value for a parameter of the given type, or
+// of a type of its own choosing if 0, and returns that type. It returns 0 with nothing
+// pushed if the value has no binary format, leaving convert to be used instead.
+// Both take the stack position of the userdata.
 typedef struct {
-    int tref;
-    void (*convert) (lua_State *L, int ref);
+    void (*convert) (lua_State *L, int index, TextBuffer *tb);
+    Oid (*encode) (lua_State *L, int index, Oid type);
 } ParamConvert;
 
+#define ARRAY_REGNAME "moonpg.array"
+
+ParamConvert *
+toParamConvert (lua_State *L, int index);
+
 // Error string constants.
 #define ERROR_CONNECTION_FAILED   "Connection to database failed: %s"
 #define ERROR_DB_UNAVAILABLE        "Database not available"
@@ -0,0 +1,771 @@
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "copy.h"
+#include "binary.h"
+
+// Column type names accepted for a binary COPY.
+static const struct {
+    const char *name;
+    PGtype type;
+} copyTypeNames [] = {
+    {"bool", boolOID}, {"boolean", boolOID},
+    {"int2", int2OID}, {"smallint", int2OID},
+    {"int4", int4OID}, {"integer", int4OID}, {"int", int4OID},
+    {"int8", int8OID}, {"bigint", int8OID},
+    {"float4", float4OID}, {"real", float4OID},
+    {"float8", float8OID}, {"double precision", float8OID},
+    {"text", textOID}, {"varchar", textOID}, {"bytea", byteaOID},
+    {"bool[]", boolAOID}, {"boolean[]", boolAOID},
+    {"int2[]", intA2OID}, {"smallint[]", intA2OID},
+    {"int4[]", intA4OID}, {"integer[]", intA4OID}, {"int[]", intA4OID},
+    {"int8[]", intA8OID}, {"bigint[]", intA8OID},
+    {"float4[]", floatA4OID}, {"real[]", floatA4OID},
+    {"float8[]", floatA8OID}, {"double precision[]", floatA8OID},
+    {NULL, 0}
+};
+
+// Get the column types of the table at index, by name or OID.
+static Oid *
+checkCopyTypes (lua_State *L, int index, int *ntypes)
+{
+    int n = lua_objlen(L, index);
+    Oid *types = lua_newuserdata(L, MAX(n, 1) * sizeof *types);
+    for (int i = 0; i < n; i++) {
+        lua_rawgeti(L, index, i+1);
+        if (lua_type(L, -1) == LUA_TNUMBER) {
+            types[i] = lua_tointeger(L, -1);
+        }
+        else {
+            const char *name = lua_tostring(L, -1);
+            int t = 0;
+            while (name && copyTypeNames[t].name && strcmp(name, copyTypeNames[t].name) != 0) {
+                t++;
+            }
+            if (!name || !copyTypeNames[t].name) {
+                luaL_error(L, "Unsupported type for binary COPY at position %d", i+1);
+            }
+            types[i] = copyTypeNames[t].type;
+        }
+        lua_pop(L, 1);
+    }
+    *ntypes = n;
+    return types;
+}
+
+// Append len bytes to the buffer. Returns 0 if the buffer could not be grown.
+static int
+appendBytes (CopyIn *cp, const char *bytes, size_t len)
+{
+    if (cp->len + len > cp->size) {
+        size_t size = MAX(cp->size * 2, cp->len + len);
+        char *buf = realloc(cp->buf, size);
+        if (!buf) {
+            return 0;
+        }
+        cp->buf = buf;
+        cp->size = size;
+    }
+    memcpy(cp->buf + cp->len, bytes, len);
+    cp->len += len;
+    return 1;
+}
+
+// Append a string in the COPY text format, escaping the delimiter, line ends and backslash.
+static int
+appendEscaped (CopyIn *cp, const char *s, size_t len)
+{
+    const char *run = s;
+    for (const char *p = s; p < s + len; p++) {
+        char esc = 0;
+        switch (*p) {
+            case '\\': esc = '\\'; break;
+            case '\t': esc = 't'; break;
+            case '\n': esc = 'n'; break;
+            case '\r': esc = 'r'; break;
+        }
+        if (esc) {
+            char pair[2] = {'\\', esc};
+            if (!appendBytes(cp, run, p - run) || !appendBytes(cp, pair, 2)) {
+                return 0;
+            }
+            run = p + 1;
+        }
+    }
+    return appendBytes(cp, run, s + len - run);
+}
+
+// Append the value at index in the text format. Returns 0 if it has no text form.
+static int
+encodeText (lua_State *L, CopyIn *cp, int index)
+{
+    char num[32];
+    size_t len;
+    const char *s;
+    int ok;
+    switch (lua_type(L, index)) {
+        case LUA_TNIL:
+            return appendBytes(cp, "\\N", 2);
+        case LUA_TBOOLEAN:
+            return appendBytes(cp, lua_toboolean(L, index) ? "t" : "f", 1);
+        case LUA_TNUMBER:
+            return appendBytes(cp, num, numberText(lua_tonumber(L, index), num));
+        case LUA_TSTRING:
+            s = lua_tolstring(L, index, &len);
+            return appendEscaped(cp, s, len);
+        case LUA_TTABLE:
+        case LUA_TUSERDATA: {
+            ParamConvert *pconv = toParamConvert(L, index);
+            if (!lua_istable(L, index) && !pconv) {
+                return 0;
+            }
+            TextBuffer tb;
+            textBufferInit(L, &tb);
+            if (pconv) {
+                pconv->convert(L, index, &tb);
+            }
+            else {
+                arrayText(L, index, &tb);
+            }
+            ok = appendEscaped(cp, tb.data, tb.len);
+            lua_remove(L, tb.slot);
+            return ok;
+        }
+        default:
+            return 0;
+    }
+}
+
+// Whether the binary form of type is its text, as for a string sent as it is.
+static int
+isTextType (Oid type)
+{
+    switch (type) {
+        case textOID:
+        case varcharOID:
+        case bpcharOID:
+        case nameOID:
+        case jsonOID:
+        case byteaOID:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// Append the value at index as a binary field of type. Returns 0 if it has no binary form
+// for that type.
+static int
+encodeBinary (lua_State *L, CopyIn *cp, int index, Oid type)
+{
+    char head[4 + 8];
+    size_t len;
+    const char *s;
+    int ok;
+    switch (lua_type(L, index)) {
+        case LUA_TNIL:
+            writeInt32(head, -1);
+            return appendBytes(cp, head, 4);
+        case LUA_TBOOLEAN:
+            if (type != boolOID) {
+                return 0;
+            }
+            writeInt32(head, 1);
+            head[4] = lua_toboolean(L, index);
+            return appendBytes(cp, head, 5);
+        case LUA_TSTRING:
+            // Strings are sent as they are, which is the binary form of the text types, and
+            // converted for the number types.
+            if (isTextType(type)) {
+                s = lua_tolstring(L, index, &len);
+                writeInt32(head, len);
+                return appendBytes(cp, head, 4) && appendBytes(cp, s, len);
+            }
+            if (!lua_isnumber(L, index)) {
+                return 0;
+            }
+            // Fall through
+        case LUA_TNUMBER:
+            if (!(len = numberBinary(lua_tonumber(L, index), type, head + 4))) {
+                return 0;
+            }
+            writeInt32(head, len);
+            return appendBytes(cp, head, 4 + len);
+        case LUA_TTABLE:
+            if (!isArrayType(type) || !arrayBinaryFromTable(L, index, type)) {
+                return 0;
+            }
+            break;
+        case LUA_TUSERDATA: {
+            ParamConvert *pconv = toParamConvert(L, index);
+            if (!pconv || pconv->encode(L, index, type) != type) {
+                return 0;
+            }
+            break;
+        }
+        default:
+            return 0;
+    }
+    s = lua_tolstring(L, -1, &len);
+    writeInt32(head, len);
+    ok = appendBytes(cp, head, 4) && appendBytes(cp, s, len);
+    lua_pop(L, 1);
+    return ok;
+}
+
+// Encode the row table at index onto the buffer. Raises an error, leaving the buffer as it
+// was, for a value that can not be encoded.
+static void
+encodeRow (lua_State *L, CopyIn *cp, int index)
+{
+    size_t start = cp->len;
+    int ok = 1, i;
+    luaL_checktype(L, index, LUA_TTABLE);
+    if (cp->binary) {
+        char count[2];
+        writeInt16(count, cp->nfields);
+        ok = appendBytes(cp, count, 2);
+    }
+    for (i = 0; ok && i < cp->nfields; i++) {
+        lua_rawgeti(L, index, i+1);
+        if (cp->binary) {
+            ok = encodeBinary(L, cp, lua_gettop(L), cp->types[i]);
+        }
+        else {
+            ok = (i == 0 || appendBytes(cp, "\t", 1)) && encodeText(L, cp, lua_gettop(L));
+        }
+        lua_pop(L, 1);
+    }
+    if (ok && !cp->binary) {
+        ok = appendBytes(cp, "\n", 1);
+    }
+    if (!ok) {
+        cp->len = start;
+        luaL_error(L, "Can not encode the value of column %d for COPY", i);
+    }
+}
+
+// Hand the buffered data to libpq. Returns 1 when the buffer is emptied, 0 if libpq could
+// not take it yet on a non-blocking connection, or -1 on error.
+static int
+sendBuffer (CopyIn *cp)
+{
+    if (cp->len == 0) {
+        return 1;
+    }
+    int r = PQputCopyData(cp->sess->conn, cp->buf, cp->len);
+    if (r == 1) {
+        cp->len = 0;
+    }
+    return r;
+}
+
+static CopyIn *
+checkCopyIn (lua_State *L, int index)
+{
+    CopyIn *cp = luaL_checkudata(L, index, COPYIN_REGNAME);
+    if (cp->done || !cp->sess->conn) {
+        luaL_error(L, "COPY is already finished");
+    }
+    return cp;
+}
+
+// Push the return of a write, sending the buffer if it is full.
+static int
+writeReturn (lua_State *L, CopyIn *cp)
+{
+    if (cp->len >= COPY_CHUNK_SIZE && sendBuffer(cp) < 0) {
+        lua_pushboolean(L, 0);
+        lua_pushstring(L, PQerrorMessage(cp->sess->conn));
+        return 2;
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/* Write one row, given as an array of column values. */
+static int
+copyWrite (lua_State *L)
+{
+    CopyIn *cp = checkCopyIn(L, 1);
+    encodeRow(L, cp, 2);
+    return writeReturn(L, cp);
+}
+
+/* Write an array of rows. */
+static int
+copyWriteRows (lua_State *L)
+{
+    CopyIn *cp = checkCopyIn(L, 1);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    int n = lua_objlen(L, 2);
+    for (int i = 1; i <= n; i++) {
+        lua_rawgeti(L, 2, i);
+        encodeRow(L, cp, 3);
+        lua_pop(L, 1);
+        if (cp->len >= COPY_CHUNK_SIZE && sendBuffer(cp) < 0) {
+            break;
+        }
+    }
+    return writeReturn(L, cp);
+}
+
+/* Send the buffered rows. Returns true once all are sent, or false if the
+ * connection is non-blocking and they could not all be sent yet. */
+static int
+copyFlush (lua_State *L)
+{
+    CopyIn *cp = checkCopyIn(L, 1);
+    int r = sendBuffer(cp);
+    if (r == 1) {
+        int f = PQflush(cp->sess->conn);
+        r = f == 0 ? 1 : f < 0 ? -1 : 0;
+    }
+    if (r < 0) {
+        lua_pushboolean(L, 0);
+        lua_pushstring(L, PQerrorMessage(cp->sess->conn));
+        return 2;
+    }
+    lua_pushboolean(L, r);
+    return 1;
+}
+
+// Discard the results of the finished COPY.
+static void
+endCopy (CopyIn *cp)
+{
+    PGresult *result;
+    cp->done = 1;
+    while ((result = PQgetResult(cp->sess->conn))) {
+        PQclear(result);
+    }
+}
+
+/* End the COPY, returning the number of rows copied, or false and an error
+ * message. Given an error message, the COPY is aborted with it instead.
+ * On a non-blocking connection, returns false without a message if the
+ * rows could not all be sent yet, to be called again. */
+static int
+copyFinish (lua_State *L)
+{
+    CopyIn *cp = checkCopyIn(L, 1);
+    const char *abortMessage = luaL_optstring(L, 2, NULL);
+    int r;
+    if (abortMessage) {
+        cp->len = 0;
+    }
+    else if (!cp->ended) {
+        if (cp->binary) {
+            char trailer[2];
+            writeInt16(trailer, -1);
+            appendBytes(cp, trailer, 2);
+        }
+        cp->ended = 1;
+    }
+    if ((r = sendBuffer(cp)) == 1) {
+        r = PQputCopyEnd(cp->sess->conn, abortMessage);
+    }
+    if (r == 0) {
+        lua_pushboolean(L, 0);
+        return 1;
+    }
+    if (r < 0) {
+        lua_pushboolean(L, 0);
+        lua_pushstring(L, PQerrorMessage(cp->sess->conn));
+        endCopy(cp);
+        return 2;
+    }
+    PGresult *result = PQgetResult(cp->sess->conn);
+    if (PQresultStatus(result) == PGRES_COMMAND_OK) {
+        lua_pushnumber(L, atoi(PQcmdTuples(result)));
+        r = 1;
+    }
+    else {
+        lua_pushboolean(L, 0);
+        lua_pushstring(L, PQerrorMessage(cp->sess->conn));
+        r = 2;
+    }
+    PQclear(result);
+    endCopy(cp);
+    return r;
+}
+
+static int
+copyGC (lua_State *L)
+{
+    CopyIn *cp = luaL_checkudata(L, 1, COPYIN_REGNAME);
+    if (!cp->done && cp->sess->conn) {
+        PQputCopyEnd(cp->sess->conn, "COPY writer was not finished");
+        endCopy(cp);
+    }
+    free(cp->buf);
+    free(cp->types);
+    cp->buf = NULL;
+    cp->types = NULL;
+    return 0;
+}
+
+// Leave the connection ready for other commands after a command of status that was not
+// the COPY expected.
+static void
+discardCommand (PGconn *conn, ExecStatusType status)
+{
+    PGresult *result;
+    if (status == PGRES_COPY_OUT) {
+        char *row;
+        while (PQgetCopyData(conn, &row, 0) > 0) {
+            PQfreemem(row);
+        }
+    }
+    else if (status == PGRES_COPY_IN) {
+        PQputCopyEnd(conn, "Command is not a COPY TO STDOUT");
+    }
+    while ((result = PQgetResult(conn))) {
+        PQclear(result);
+    }
+}
+
+/* Run a COPY FROM STDIN command, returning a writer for its rows. For the
+ * binary format, types is an array of the column types, by name or OID. */
+static int
+copyIn (lua_State *L)
+{
+    DBSession *s = luaL_checkudata(L, 1, SES_REGNAME);
+    const char *command = luaL_checkstring(L, 2);
+    Oid *types = NULL;
+    int ntypes = 0;
+    if (!lua_isnoneornil(L, 3)) {
+        luaL_checktype(L, 3, LUA_TTABLE);
+        types = checkCopyTypes(L, 3, &ntypes);
+    }
+
+    PGresult *result = PQexec(s->conn, command);
+    ExecStatusType status = PQresultStatus(result);
+    if (status != PGRES_COPY_IN) {
+        lua_pushboolean(L, 0);
+        lua_pushstring(L, result && status != PGRES_FATAL_ERROR ?
+            "Command is not a COPY FROM STDIN" : PQerrorMessage(s->conn));
+        PQclear(result);
+        discardCommand(s->conn, status);
+        return 2;
+    }
+    int binary = PQbinaryTuples(result);
+    int nfields = PQnfields(result);
+    PQclear(result);
+
+    CopyIn *cp = lua_newuserdata(L, sizeof *cp);
+    cp->sess = s;
+    cp->binary = binary;
+    cp->nfields = nfields;
+    cp->types = NULL;
+    cp->buf = malloc(COPY_CHUNK_SIZE);
+    cp->len = 0;
+    cp->size = cp->buf ? COPY_CHUNK_SIZE : 0;
+    cp->ended = 0;
+    cp->done = 0;
+    luaL_getmetatable(L, COPYIN_REGNAME);
+    lua_setmetatable(L, -2);
+    lua_createtable(L, 0, 1);
+    lua_pushvalue(L, 1);
+    lua_setfield(L, -2, "session");
+    lua_setfenv(L, -2);
+
+    if (binary) {
+        if (ntypes != nfields) {
+            PQputCopyEnd(s->conn, "COPY binary format needs the column types");
+            endCopy(cp);
+            lua_pushboolean(L, 0);
+            lua_pushfstring(L, "COPY binary format needs the types of its %d columns", nfields);
+            return 2;
+        }
+        cp->types = malloc(MAX(nfields, 1) * sizeof *cp->types);
+        memcpy(cp->types, types, nfields * sizeof *types);
+        // The signature, flags and header extension length.
+        appendBytes(cp, "PGCOPY\n\377\r\n\0\0\0\0\0\0\0\0\0", 19);
+    }
+    return 1;
+}
+
+// Decode a field of the COPY text format, with a backslash escaped value. 
+static void
+pushTextField (lua_State *L, const char *p, const char *end)
+{
+    luaL_Buffer b;
+    if (end - p == 2 && p[0] == '\\' && p[1] == 'N') {
+        lua_pushnil(L);
+        return;
+    }
+    if (!memchr(p, '\\', end - p)) {
+        lua_pushlstring(L, p, end - p);
+        return;
+    }
+    luaL_buffinit(L, &b);
+    while (p < end) {
+        char c = *p++;
+        if (c == '\\' && p < end) {
+            c = *p++;
+            switch (c) {
+                case 'b': c = '\b'; break;
+                case 'f': c = '\f'; break;
+                case 'n': c = '\n'; break;
+                case 'r': c = '\r'; break;
+                case 't': c = '\t'; break;
+                case 'v': c = '\v'; break;
+                case 'x':
+                    if (p < end && isxdigit((unsigned char)*p)) {
+                        int v = 0;
+                        for (int i = 0; i < 2 && p < end && isxdigit((unsigned char)*p); i++, p++) {
+                            v = v * 16 + (isdigit((unsigned char)*p) ? *p - '0' :
+                                tolower((unsigned char)*p) - 'a' + 10);
+                        }
+                        c = v;
+                    }
+                    break;
+                default:
+                    if (c >= '0' && c <= '7') {
+                        int v = c - '0';
+                        for (int i = 0; i < 2 && p < end && *p >= '0' && *p <= '7'; i++, p++) {
+                            v = v * 8 + (*p - '0');
+                        }
+                        c = v;
+                    }
+            }
+        }
+        luaL_addchar(&b, c);
+    }
+    luaL_pushresult(&b);
+}
+
+// Push a row table of the values of a line of the COPY text format.
+static void
+pushTextRow (lua_State *L, const char *line, int len)
+{
+    const char *end = line + len;
+    int i = 0;
+    if (len > 0 && end[-1] == '\n') {
+        end--;
+    }
+    lua_newtable(L);
+    for (;;) {
+        const char *tab = memchr(line, '\t', end - line);
+        const char *fieldEnd = tab ? tab : end;
+        pushTextField(L, line, fieldEnd);
+        lua_rawseti(L, -2, ++i);
+        if (!tab) {
+            break;
+        }
+        line = tab + 1;
+    }
+}
+
+// Push a row table of the values of a tuple of the COPY binary format, decoded by types.
+// Returns 0 for the trailer.
+static int
+pushBinaryRow (lua_State *L, const char *p, int len, const Oid *types, int ntypes)
+{
+    const char *end = p + len;
+    if (len < 2 || readInt16(p) < 0) {
+        return 0;
+    }
+    int nf = readInt16(p);
+    p += 2;
+    lua_createtable(L, nf, 0);
+    for (int i = 0; i < nf && p + 4 <= end; i++) {
+        int flen = readInt32(p);
+        p += 4;
+        if (flen < 0) {
+            lua_pushnil(L);
+        }
+        else {
+            pushBinaryValue(L, p, flen, i < ntypes ? types[i] : 0, mapDefault);
+            p += flen;
+        }
+        lua_rawseti(L, -2, i+1);
+    }
+    return 1;
+}
+
+// Write all len bytes to fd. Returns 0 on error.
+static int
+writeAll (int fd, const char *buf, int len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 0;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 1;
+}
+
+static void
+cancelCommand (PGconn *conn)
+{
+    char errbuf[256];
+    PGcancel *c = PQgetCancel(conn);
+    if (c) {
+        PQcancel(c, errbuf, sizeof errbuf);
+        PQfreeCancel(c);
+    }
+}
+
+/* Run a COPY TO STDOUT command, passing the data to sink as it arrives. The
+ * sink is a file path or descriptor, written directly, or a function called
+ * with each chunk of data, or each row as a table if rows is given. Rows of
+ * the text format are arrays of strings; rows of the binary format are
+ * decoded by rows as an array of column types, or are raw values if rows is
+ * true. Returns the number of rows copied. */
+static int
+copyOut (lua_State *L)
+{
+    DBSession *s = luaL_checkudata(L, 1, SES_REGNAME);
+    const char *command = luaL_checkstring(L, 2);
+    int sinkType = lua_type(L, 3);
+    int fd = -1, opened = 0, decode = 0, ntypes = 0;
+    Oid *types = NULL;
+    luaL_argcheck(L, sinkType == LUA_TFUNCTION || sinkType == LUA_TNUMBER ||
+        sinkType == LUA_TSTRING, 3, "expected a function, file descriptor or path");
+    if (sinkType == LUA_TFUNCTION && !lua_isnoneornil(L, 4)) {
+        decode = 1;
+        if (lua_istable(L, 4)) {
+            types = checkCopyTypes(L, 4, &ntypes);
+        }
+    }
+    if (sinkType == LUA_TNUMBER) {
+        fd = lua_tointeger(L, 3);
+    }
+    else if (sinkType == LUA_TSTRING) {
+        fd = open(lua_tostring(L, 3), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (fd < 0) {
+            lua_pushboolean(L, 0);
+            lua_pushstring(L, strerror(errno));
+            return 2;
+        }
+        opened = 1;
+    }
+
+    PGresult *result = PQexec(s->conn, command);
+    ExecStatusType status = PQresultStatus(result);
+    if (status != PGRES_COPY_OUT) {
+        lua_pushboolean(L, 0);
+        lua_pushstring(L, result && status != PGRES_FATAL_ERROR ?
+            "Command is not a COPY TO STDOUT" : PQerrorMessage(s->conn));
+        PQclear(result);
+        discardCommand(s->conn, status);
+        if (opened) {
+            close(fd);
+        }
+        return 2;
+    }
+    int binary = PQbinaryTuples(result);
+    PQclear(result);
+
+    // After a failure of the sink, the rest of the data is cancelled and discarded.
+    int failed = 0, writeErrno = 0, headerLen = binary ? 19 : 0;
+    char *buf;
+    int len;
+    while ((len = PQgetCopyData(s->conn, &buf, 0)) > 0) {
+        if (!failed) {
+            if (fd >= 0) {
+                if (!writeAll(fd, buf, len)) {
+                    writeErrno = errno;
+                    failed = 1;
+                }
+            }
+            else if (!decode) {
+                lua_pushvalue(L, 3);
+                lua_pushlstring(L, buf, len);
+                failed = lua_pcall(L, 1, 0, 0);
+            }
+            else if (binary) {
+                // Skip the header, and its extension, before the first tuple.
+                const char *p = buf;
+                int plen = len;
+                if (headerLen == 19 && plen >= 19) {
+                    headerLen += readInt32(buf + 15);
+                }
+                int skip = headerLen < plen ? headerLen : plen;
+                p += skip;
+                plen -= skip;
+                headerLen -= skip;
+                if (plen > 0) {
+                    lua_pushvalue(L, 3);
+                    if (pushBinaryRow(L, p, plen, types, ntypes)) {
+                        failed = lua_pcall(L, 1, 0, 0);
+                    }
+                    else {
+                        lua_pop(L, 1);
+                    }
+                }
+            }
+            else {
+                lua_pushvalue(L, 3);
+                pushTextRow(L, buf, len);
+                failed = lua_pcall(L, 1, 0, 0);
+            }
+            if (failed) {
+                cancelCommand(s->conn);
+            }
+        }
+        PQfreemem(buf);
+    }
+    if (opened) {
+        close(fd);
+    }
+
+    int ret = 1;
+    result = PQgetResult(s->conn);
+    if (failed && fd < 0) {
+        // Raise the error from the sink function, which is on the top of the stack.
+        discardCommand(s->conn, PGRES_COMMAND_OK);
+        PQclear(result);
+        return lua_error(L);
+    }
+    else if (failed) {
+        lua_pushboolean(L, 0);
+        lua_pushstring(L, strerror(writeErrno));
+        ret = 2;
+    }
+    else if (PQresultStatus(result) == PGRES_COMMAND_OK) {
+        lua_pushnumber(L, atoi(PQcmdTuples(result)));
+    }
+    else {
+        lua_pushboolean(L, 0);
+        lua_pushstring(L, PQerrorMessage(s->conn));
+        ret = 2;
+    }
+    PQclear(result);
+    discardCommand(s->conn, PGRES_COMMAND_OK);
+    return ret;
+}
+
+static const struct luaL_Reg copyInMethods [] = {
+    {"write", copyWrite},
+    {"writeRows", copyWriteRows},
+    {"flush", copyFlush},
+    {"finish", copyFinish},
+    {"__gc", copyGC},
+    {NULL, NULL}
+};
+
+void
+registerCopy (lua_State *L)
+{
+    luaL_newmetatable(L, COPYIN_REGNAME);
+    luaL_register(L, NULL, copyInMethods);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+
+    luaL_getmetatable(L, SES_REGNAME);
+    lua_pushcfunction(L, copyIn);
+    lua_setfield(L, -2, "copyIn");
+    lua_pushcfunction(L, copyOut);
+    lua_setfield(L, -2, "copyOut");
+    lua_pop(L, 2);
+}
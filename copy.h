@@ -0,0 +1,27 @@
+#ifndef _COPY_H
+#define _COPY_H
+
+#include "session.h"
+
+#define COPYIN_REGNAME "moonpg.copyin"
+
+// Encoded rows are sent to the server once this much data is buffered.
+#define COPY_CHUNK_SIZE 65536
+
+// A writer of rows to a COPY FROM STDIN command.
+typedef struct {
+    DBSession *sess;
+    int binary;     // The COPY is in the binary format.
+    int nfields;
+    Oid *types;     // Column types, for the binary format.
+    char *buf;      // Encoded data not yet taken by PQputCopyData.
+    size_t len;
+    size_t size;
+    int ended;      // The trailer is written and only the end of the COPY remains.
+    int done;
+} CopyIn;
+
+void
+registerCopy (lua_State *L);
+
+#endif
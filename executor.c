@@ -0,0 +1,474 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "executor.h"
+
+#define EXECUTOR_THREADS 4
+
+static Executor *
+checkOpenExecutor (lua_State *L, int index)
+{
+    Executor *ex = luaL_checkudata(L, index, EXECUTOR_REGNAME);
+    if (ex->closed) {
+        luaL_error(L, "executor is closed");
+    }
+    return ex;
+}
+
+static void
+freeJob (Job *job)
+{
+    for (int i = 0; i < job->nparams; i++) {
+        free(job->values[i]);
+    }
+    free(job->values);
+    free(job->command);
+    PQclear(job->result);
+    free(job->cells);
+    free(job->error);
+    free(job);
+}
+
+static void
+freeJobs (Job *job)
+{
+    while (job) {
+        Job *next = job->next;
+        freeJob(job);
+        job = next;
+    }
+}
+
+static char *
+copyString (const char *s, size_t len)
+{
+    char *copy = malloc(len + 1);
+    if (copy) {
+        memcpy(copy, s, len);
+        copy[len] = '\0';
+    }
+    return copy;
+}
+
+// Decode the values of the result of job into its cells, on the worker thread, so that Lua
+// only has to push them.
+static int
+decodeCells (Job *job)
+{
+    PGresult *result = job->result;
+    int nt = PQntuples(result);
+    int nf = PQnfields(result);
+    CellKind kinds[MAX(nf, 1)];
+    job->cells = malloc(MAX(nt * nf, 1) * sizeof *job->cells);
+    if (!job->cells) {
+        return 0;
+    }
+    for (int j = 0; j < nf; j++) {
+        switch (PQftype(result, j)) {
+            case int2OID:
+            case int4OID:
+            case int8OID:
+            case float4OID:
+            case float8OID:
+            case numericOID:
+                kinds[j] = cellNumber;
+                break;
+            case boolOID:
+                kinds[j] = cellBool;
+                break;
+            default:
+                kinds[j] = cellText;
+        }
+    }
+    Cell *c = job->cells;
+    for (int i = 0; i < nt; i++) {
+        for (int j = 0; j < nf; j++, c++) {
+            const char *value = PQgetvalue(result, i, j);
+            c->kind = PQgetisnull(result, i, j) ? cellNull : kinds[j];
+            switch (c->kind) {
+                case cellNumber:
+                    c->number = strtod(value, NULL);
+                    break;
+                case cellBool:
+                    c->number = value[0] == 't';
+                    break;
+                case cellText:
+                    c->text = value;
+                    c->len = PQgetlength(result, i, j);
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+    return 1;
+}
+
+// Run the command of job on conn, keeping its result or error message.
+static void
+runJob (PGconn *conn, Job *job)
+{
+    PGresult *result;
+    if (PQstatus(conn) != CONNECTION_OK) {
+        PQreset(conn);
+    }
+    if (job->nparams > 0) {
+        result = PQexecParams(conn, job->command, job->nparams, NULL,
+            (const char * const *)job->values, NULL, NULL, 0);
+    }
+    else {
+        result = PQexec(conn, job->command);
+    }
+    ExecStatusType status = PQresultStatus(result);
+    if (status == PGRES_COMMAND_OK || status == PGRES_TUPLES_OK) {
+        job->result = result;
+        if (status == PGRES_TUPLES_OK && !decodeCells(job)) {
+            job->error = copyString("out of memory", 13);
+        }
+    }
+    else {
+        const char *message = result ? PQresultErrorMessage(result) : PQerrorMessage(conn);
+        job->error = copyString(message, strlen(message));
+        PQclear(result);
+    }
+}
+
+static void *
+workerMain (void *arg)
+{
+    Worker *w = arg;
+    Executor *ex = w->ex;
+    pthread_mutex_lock(&ex->lock);
+    for (;;) {
+        while (!ex->queue && !ex->shutdown) {
+            pthread_cond_wait(&ex->queued, &ex->lock);
+        }
+        if (ex->shutdown) {
+            break;
+        }
+        Job *job = ex->queue;
+        ex->queue = job->next;
+        if (!ex->queue) {
+            ex->queueTail = NULL;
+        }
+        pthread_mutex_unlock(&ex->lock);
+
+        runJob(w->conn, job);
+
+        pthread_mutex_lock(&ex->lock);
+        job->next = NULL;
+        if (ex->doneTail) {
+            ex->doneTail->next = job;
+        }
+        else {
+            ex->done = job;
+        }
+        ex->doneTail = job;
+        pthread_cond_broadcast(&ex->completed);
+        // The pipe does not block, so a full one only means it is readable already.
+        if (write(ex->notify[1], "", 1) < 0 && errno != EAGAIN) {
+            errno = 0;
+        }
+    }
+    pthread_mutex_unlock(&ex->lock);
+    return NULL;
+}
+
+// Stop the workers, close their connections and drop the jobs not collected.
+static void
+closeExecutor (Executor *ex)
+{
+    if (ex->closed) {
+        return;
+    }
+    ex->closed = 1;
+    pthread_mutex_lock(&ex->lock);
+    ex->shutdown = 1;
+    pthread_cond_broadcast(&ex->queued);
+    pthread_mutex_unlock(&ex->lock);
+    for (int i = 0; i < ex->nworkers; i++) {
+        if (ex->workers[i].started) {
+            pthread_join(ex->workers[i].thread, NULL);
+        }
+        PQfinish(ex->workers[i].conn);
+    }
+    free(ex->workers);
+    ex->workers = NULL;
+    freeJobs(ex->queue);
+    freeJobs(ex->done);
+    ex->queue = ex->queueTail = ex->done = ex->doneTail = NULL;
+    close(ex->notify[0]);
+    close(ex->notify[1]);
+    pthread_cond_destroy(&ex->queued);
+    pthread_cond_destroy(&ex->completed);
+    pthread_mutex_destroy(&ex->lock);
+}
+
+/* Returns an executor running commands on worker threads, from a table of
+ * options: conninfo, the connection string, and threads, the number of
+ * workers, each with its own connection. Returns nil and an error message if
+ * a connection fails. */
+int
+newExecutor (lua_State *L)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_getfield(L, 1, "conninfo");
+    lua_getfield(L, 1, "threads");
+    const char *conninfo = luaL_optstring(L, 2, "");
+    int nworkers = luaL_optint(L, 3, EXECUTOR_THREADS);
+    luaL_argcheck(L, nworkers >= 1, 1, "invalid number of threads");
+
+    Executor *ex = lua_newuserdata(L, sizeof *ex);
+    memset(ex, 0, sizeof *ex);
+    ex->nextId = 1;
+    if (pipe(ex->notify) < 0) {
+        ex->closed = 1;
+        return luaL_error(L, "can not create the executor pipe: %s", strerror(errno));
+    }
+    for (int i = 0; i < 2; i++) {
+        fcntl(ex->notify[i], F_SETFL, fcntl(ex->notify[i], F_GETFL) | O_NONBLOCK);
+    }
+    pthread_mutex_init(&ex->lock, NULL);
+    pthread_cond_init(&ex->queued, NULL);
+    pthread_cond_init(&ex->completed, NULL);
+    luaL_getmetatable(L, EXECUTOR_REGNAME);
+    lua_setmetatable(L, -2);
+
+    ex->workers = calloc(nworkers, sizeof *ex->workers);
+    if (!ex->workers) {
+        closeExecutor(ex);
+        return luaL_error(L, "out of memory");
+    }
+    ex->nworkers = nworkers;
+    for (int i = 0; i < nworkers; i++) {
+        Worker *w = ex->workers + i;
+        w->ex = ex;
+        w->conn = PQconnectdb(conninfo);
+        if (PQstatus(w->conn) != CONNECTION_OK) {
+            lua_pushnil(L);
+            lua_pushfstring(L, ERROR_CONNECTION_FAILED, PQerrorMessage(w->conn));
+            closeExecutor(ex);
+            return 2;
+        }
+    }
+    for (int i = 0; i < nworkers; i++) {
+        Worker *w = ex->workers + i;
+        if (pthread_create(&w->thread, NULL, workerMain, w) != 0) {
+            closeExecutor(ex);
+            return luaL_error(L, "can not start the executor threads");
+        }
+        w->started = 1;
+    }
+    return 1;
+}
+
+/* Queues a command with its parameter values, to be run by a worker.
+ * Returns the id of the job, by which collect returns its result. */
+static int
+executorSubmit (lua_State *L)
+{
+    Executor *ex = checkOpenExecutor(L, 1);
+    size_t len;
+    const char *command = luaL_checklstring(L, 2, &len);
+    int nparams = lua_gettop(L) - 2;
+
+    // Convert the parameters to strings on the stack first, as that may raise an error.
+    for (int i = 0; i < nparams; i++) {
+        int pos = 3 + i;
+        char num[32];
+        switch (lua_type(L, pos)) {
+            case LUA_TNIL:
+                lua_pushnil(L);
+                break;
+            case LUA_TBOOLEAN:
+                lua_pushstring(L, lua_toboolean(L, pos) ? "t" : "f");
+                break;
+            case LUA_TNUMBER:
+                lua_pushlstring(L, num, numberText(lua_tonumber(L, pos), num));
+                break;
+            case LUA_TSTRING:
+                lua_pushvalue(L, pos);
+                break;
+            case LUA_TUSERDATA: {
+                ParamConvert *pconv = toParamConvert(L, pos);
+                if (!pconv) {
+                    return luaL_error(L, "Not a valid parameter at position %d", i + 1);
+                }
+                TextBuffer tb;
+                textBufferInit(L, &tb);
+                pconv->convert(L, pos, &tb);
+                lua_pushlstring(L, tb.data, tb.len);
+                lua_remove(L, tb.slot);
+                break;
+            }
+            default:
+                return luaL_error(L, "Not a valid parameter at position %d", i + 1);
+        }
+    }
+
+    Job *job = calloc(1, sizeof *job);
+    int ok = job && (job->command = copyString(command, len)) &&
+        (job->values = calloc(MAX(nparams, 1), sizeof *job->values));
+    for (int i = 0; ok && i < nparams; i++) {
+        const char *value = lua_tolstring(L, 3 + nparams + i, &len);
+        job->nparams = i + 1;
+        ok = !value || (job->values[i] = copyString(value, len));
+    }
+    if (!ok) {
+        if (job) {
+            freeJob(job);
+        }
+        return luaL_error(L, "out of memory");
+    }
+    job->id = ex->nextId++;
+
+    pthread_mutex_lock(&ex->lock);
+    if (ex->queueTail) {
+        ex->queueTail->next = job;
+    }
+    else {
+        ex->queue = job;
+    }
+    ex->queueTail = job;
+    pthread_cond_signal(&ex->queued);
+    pthread_mutex_unlock(&ex->lock);
+    ex->pending++;
+    lua_pushinteger(L, job->id);
+    return 1;
+}
+
+// Push the result of a completed job as run would return it: a table of rows by field name
+// for a query, or else the number of rows affected.
+static void
+pushJobResult (lua_State *L, Job *job)
+{
+    PGresult *result = job->result;
+    if (PQresultStatus(result) != PGRES_TUPLES_OK) {
+        lua_pushnumber(L, atoi(PQcmdTuples(result)));
+        return;
+    }
+    int nt = PQntuples(result);
+    int nf = PQnfields(result);
+    lua_createtable(L, nt, 1);
+    lua_createtable(L, nf, 0);
+    for (int j = 0; j < nf; j++) {
+        lua_pushstring(L, PQfname(result, j));
+        lua_rawseti(L, -2, j+1);
+    }
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -3, "fields");
+    int names = lua_gettop(L);
+    const Cell *c = job->cells;
+    for (int i = 0; i < nt; i++) {
+        lua_createtable(L, 0, nf);
+        for (int j = 0; j < nf; j++, c++) {
+            lua_rawgeti(L, names, j+1);
+            switch (c->kind) {
+                case cellNumber:
+                    lua_pushnumber(L, c->number);
+                    break;
+                case cellBool:
+                    lua_pushboolean(L, c->number != 0);
+                    break;
+                case cellText:
+                    lua_pushlstring(L, c->text, c->len);
+                    break;
+                default:
+                    lua_pushnil(L);
+            }
+            lua_rawset(L, -3);
+        }
+        lua_rawseti(L, names - 1, i+1);
+    }
+    lua_pop(L, 1);
+}
+
+/* Returns a table of the results of the jobs completed since the last call,
+ * by job id, and a table of the error messages of those that failed, by job
+ * id. If wait is true, first waits until a job is completed, if any is
+ * pending. */
+static int
+executorCollect (lua_State *L)
+{
+    Executor *ex = checkOpenExecutor(L, 1);
+    int wait = lua_toboolean(L, 2);
+    char drain[64];
+
+    pthread_mutex_lock(&ex->lock);
+    while (wait && !ex->done && ex->pending > 0) {
+        pthread_cond_wait(&ex->completed, &ex->lock);
+    }
+    Job *jobs = ex->done;
+    ex->done = ex->doneTail = NULL;
+    while (read(ex->notify[0], drain, sizeof drain) > 0) {
+    }
+    pthread_mutex_unlock(&ex->lock);
+
+    lua_newtable(L);
+    lua_newtable(L);
+    for (Job *job = jobs; job; job = job->next) {
+        ex->pending--;
+        if (job->error) {
+            lua_pushboolean(L, 0);
+            lua_rawseti(L, -3, job->id);
+            lua_pushstring(L, job->error);
+            lua_rawseti(L, -2, job->id);
+        }
+        else {
+            pushJobResult(L, job);
+            lua_rawseti(L, -3, job->id);
+        }
+    }
+    freeJobs(jobs);
+    return 2;
+}
+
+/* Returns the number of jobs submitted and not yet collected. */
+static int
+executorPending (lua_State *L)
+{
+    Executor *ex = luaL_checkudata(L, 1, EXECUTOR_REGNAME);
+    lua_pushinteger(L, ex->pending);
+    return 1;
+}
+
+/* Returns a file descriptor that is readable while completed jobs are waiting
+ * to be collected, for waiting on along with other descriptors. */
+static int
+executorFd (lua_State *L)
+{
+    Executor *ex = checkOpenExecutor(L, 1);
+    lua_pushinteger(L, ex->notify[0]);
+    return 1;
+}
+
+/* Stops the workers, after the jobs they are running, and closes their
+ * connections. Jobs not yet run or collected are dropped. */
+static int
+executorClose (lua_State *L)
+{
+    Executor *ex = luaL_checkudata(L, 1, EXECUTOR_REGNAME);
+    closeExecutor(ex);
+    return 0;
+}
+
+static const struct luaL_Reg executorMethods [] = {
+    {"submit", executorSubmit},
+    {"collect", executorCollect},
+    {"pending", executorPending},
+    {"fd", executorFd},
+    {"close", executorClose},
+    {"__gc", executorClose},
+    {NULL, NULL}
+};
+
+void
+registerExecutor (lua_State *L)
+{
+    luaL_newmetatable(L, EXECUTOR_REGNAME);
+    luaL_register(L, NULL, executorMethods);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+}
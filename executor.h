@@ -0,0 +1,69 @@
+#ifndef _EXECUTOR_H
+#define _EXECUTOR_H
+
+#include <pthread.h>
+#include "session.h"
+
+#define EXECUTOR_REGNAME "moonpg.executor"
+
+typedef enum {
+    cellNull,
+    cellNumber,
+    cellBool,
+    cellText
+} CellKind;
+
+// A value of a result, decoded by a worker, ready to be pushed as a Lua value.
+typedef struct {
+    CellKind kind;
+    double number;      // Of a number or boolean.
+    const char *text;   // Of text, in the result.
+    int len;
+} Cell;
+
+// A command submitted to an executor, with its parameters as text, and once run, its result.
+typedef struct Job {
+    struct Job *next;
+    int id;
+    char *command;
+    int nparams;
+    char **values;      // NULL for a null parameter.
+    PGresult *result;
+    Cell *cells;        // The decoded values of the result, by row.
+    char *error;
+} Job;
+
+typedef struct Executor Executor;
+
+// A worker thread and its connection.
+typedef struct {
+    Executor *ex;
+    pthread_t thread;
+    PGconn *conn;
+    int started;
+} Worker;
+
+// Worker threads, each with its own connection, running the jobs queued by Lua. Completed
+// jobs are collected from the done queue, the notify pipe being readable while any is there.
+struct Executor {
+    int nworkers;
+    Worker *workers;
+    pthread_mutex_t lock;
+    pthread_cond_t queued;
+    pthread_cond_t completed;
+    Job *queue, *queueTail;
+    Job *done, *doneTail;
+    int pending;        // Jobs submitted and not yet collected.
+    int nextId;
+    int shutdown;
+    int closed;
+    int notify[2];      // Pipe read from to wait for completed jobs.
+};
+
+int
+newExecutor (lua_State *L);
+
+void
+registerExecutor (lua_State *L);
+
+#endif
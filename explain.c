@@ -0,0 +1,250 @@
+#define _POSIX_C_SOURCE 200809L
+#include <ctype.h>
+#include <strings.h>
+#include <time.h>
+#include "explain.h"
+
+#define EXPLAIN_PREFIX "EXPLAIN (FORMAT JSON) "
+
+static const char *const explainable[] = {
+    "select", "with", "insert", "update", "delete", "values", "table", "merge", NULL
+};
+
+// Whether command is a statement EXPLAIN takes, by its first word.
+static int
+isExplainable (const char *command)
+{
+    while (isspace((unsigned char)*command) || *command == '(') {
+        command++;
+    }
+    size_t len = 0;
+    while (isalpha((unsigned char)command[len])) {
+        len++;
+    }
+    for (int i = 0; explainable[i]; i++) {
+        if (strlen(explainable[i]) == len && strncasecmp(command, explainable[i], len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Get the side connection, opened with the options of conn when first needed. Returns NULL
+// if it cannot be opened.
+static PGconn *
+sideConnection (ExplainStore *x, PGconn *conn)
+{
+    if (x->side && PQstatus(x->side) == CONNECTION_OK) {
+        return x->side;
+    }
+    PQfinish(x->side);
+    x->side = NULL;
+    PQconninfoOption *options = PQconninfo(conn);
+    if (!options) {
+        return NULL;
+    }
+    int n = 0;
+    for (PQconninfoOption *o = options; o->keyword; o++) {
+        n += o->val != NULL;
+    }
+    const char **keywords = malloc((n + 1) * sizeof *keywords);
+    const char **values = malloc((n + 1) * sizeof *values);
+    if (keywords && values) {
+        n = 0;
+        for (PQconninfoOption *o = options; o->keyword; o++) {
+            if (o->val) {
+                keywords[n] = o->keyword;
+                values[n++] = o->val;
+            }
+        }
+        keywords[n] = values[n] = NULL;
+        x->side = PQconnectdbParams(keywords, values, 0);
+    }
+    free(keywords);
+    free(values);
+    PQconninfoFree(options);
+    if (x->side && PQstatus(x->side) != CONNECTION_OK) {
+        PQfinish(x->side);
+        x->side = NULL;
+    }
+    return x->side;
+}
+
+// Get the entry to keep the plan of fingerprint in: its own, or else a new one, or once
+// there are max, that explained the longest ago.
+static ExplainedPlan *
+planEntry (ExplainStore *x, const char *fingerprint)
+{
+    ExplainedPlan *oldest = NULL;
+    for (int n = 0; n < x->size; n++) {
+        ExplainedPlan *p = x->plans + n;
+        if (strcmp(p->fingerprint, fingerprint) == 0) {
+            return p;
+        }
+        if (!oldest || p->captured < oldest->captured) {
+            oldest = p;
+        }
+    }
+    if (x->size < x->max) {
+        ExplainedPlan *p = x->plans + x->size++;
+        memset(p, 0, sizeof *p);
+        return p;
+    }
+    free(oldest->fingerprint);
+    free(oldest->plan);
+    memset(oldest, 0, sizeof *oldest);
+    return oldest;
+}
+
+// Keep the plan of command, run on conn with its parameters ps in latency seconds, if it is
+// slow, sampled and not explained within the interval. Plans that cannot be had go unkept.
+void
+explainSlow (ExplainStore *x, PGconn *conn, const char *command, int nparams,
+    const ParamSet *ps, double latency)
+{
+    if (latency < x->threshold || !isExplainable(command)) {
+        return;
+    }
+    char *fingerprint = malloc(strlen(command) + 1);
+    if (!fingerprint) {
+        return;
+    }
+    fingerprint[fingerprintCommand(command, fingerprint)] = '\0';
+    double now = monotonicTime();
+    for (int n = 0; n < x->size; n++) {
+        if (strcmp(x->plans[n].fingerprint, fingerprint) == 0 &&
+                now - x->plans[n].captured < x->interval) {
+            free(fingerprint);
+            return;
+        }
+    }
+    char *explain = malloc(strlen(EXPLAIN_PREFIX) + strlen(command) + 1);
+    PGconn *side = sampleDraw(&x->random, x->sample) && explain ? sideConnection(x, conn) : NULL;
+    PGresult *result = NULL;
+    if (side) {
+        strcat(strcpy(explain, EXPLAIN_PREFIX), command);
+        result = PQexecParams(side, explain, nparams, ps ? ps->types : NULL,
+            ps ? ps->values : NULL, ps ? ps->lengths : NULL, ps ? ps->formats : NULL, 0);
+    }
+    char *plan = NULL;
+    if (PQresultStatus(result) == PGRES_TUPLES_OK && PQntuples(result) > 0 &&
+            (plan = malloc(PQgetlength(result, 0, 0) + 1))) {
+        strcpy(plan, PQgetvalue(result, 0, 0));
+    }
+    PQclear(result);
+    free(explain);
+    if (!plan) {
+        free(fingerprint);
+        return;
+    }
+    ExplainedPlan *p = planEntry(x, fingerprint);
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    if (p->fingerprint) {
+        free(fingerprint);
+        free(p->plan);
+    }
+    else {
+        p->fingerprint = fingerprint;
+    }
+    p->plan = plan;
+    p->latency = latency;
+    p->time = ts.tv_sec + ts.tv_nsec / 1e9;
+    p->captured = now;
+    p->captures++;
+}
+
+void
+freeExplainStore (ExplainStore *x)
+{
+    if (x) {
+        for (int n = 0; n < x->size; n++) {
+            free(x->plans[n].fingerprint);
+            free(x->plans[n].plan);
+        }
+        free(x->plans);
+        PQfinish(x->side);
+        free(x);
+    }
+}
+
+/* Captures the plans of the commands run by run, of the connection and its
+ * prepared objects, that take longer than a threshold, from a table of
+ * options: threshold, the seconds over which a command is slow, sample, the
+ * fraction of the slow commands explained, interval, the seconds before a
+ * statement is explained again, and max, the number of plans kept. With
+ * false, stops capturing and drops the plans. */
+static int
+explainSlowStatements (lua_State *L)
+{
+    DBSession *s = luaL_checkudata(L, 1, SES_REGNAME);
+    if (lua_isboolean(L, 2) && !lua_toboolean(L, 2)) {
+        freeExplainStore(s->explain);
+        s->explain = NULL;
+        return 0;
+    }
+    double threshold = 1, sample = 0.1, interval = 60;
+    int max = EXPLAIN_MAX_PLANS;
+    if (!lua_isnoneornil(L, 2)) {
+        luaL_checktype(L, 2, LUA_TTABLE);
+        lua_getfield(L, 2, "threshold");
+        lua_getfield(L, 2, "sample");
+        lua_getfield(L, 2, "interval");
+        lua_getfield(L, 2, "max");
+        threshold = luaL_optnumber(L, 3, threshold);
+        sample = luaL_optnumber(L, 4, sample);
+        interval = luaL_optnumber(L, 5, interval);
+        max = luaL_optint(L, 6, max);
+        luaL_argcheck(L, max > 0, 2, "max must be positive");
+    }
+    ExplainStore *x = calloc(1, sizeof *x);
+    if (x) {
+        x->plans = malloc(max * sizeof *x->plans);
+    }
+    if (!x || !x->plans) {
+        freeExplainStore(x);
+        return luaL_error(L, "out of memory");
+    }
+    x->threshold = threshold;
+    x->sample = sample;
+    x->interval = interval;
+    x->max = max;
+    x->random = 2463534242u ^ (uint32_t)(size_t)s;
+    freeExplainStore(s->explain);
+    s->explain = x;
+    return 0;
+}
+
+/* Returns a table of the plans captured, keyed by statement fingerprint. */
+static int
+plans (lua_State *L)
+{
+    DBSession *s = luaL_checkudata(L, 1, SES_REGNAME);
+    ExplainStore *x = s->explain;
+    lua_createtable(L, 0, x ? x->size : 0);
+    for (int n = 0; x && n < x->size; n++) {
+        const ExplainedPlan *p = x->plans + n;
+        lua_createtable(L, 0, 4);
+        lua_pushstring(L, p->plan);
+        lua_setfield(L, -2, "plan");
+        lua_pushnumber(L, p->latency);
+        lua_setfield(L, -2, "latency");
+        lua_pushnumber(L, p->time);
+        lua_setfield(L, -2, "time");
+        lua_pushnumber(L, p->captures);
+        lua_setfield(L, -2, "captures");
+        lua_setfield(L, -2, p->fingerprint);
+    }
+    return 1;
+}
+
+void
+registerExplain (lua_State *L)
+{
+    luaL_getmetatable(L, SES_REGNAME);
+    lua_pushcfunction(L, explainSlowStatements);
+    lua_setfield(L, -2, "explainSlow");
+    lua_pushcfunction(L, plans);
+    lua_setfield(L, -2, "plans");
+    lua_pop(L, 1);
+}
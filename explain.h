@@ -0,0 +1,43 @@
+#ifndef _EXPLAIN_H
+#define _EXPLAIN_H
+
+#include <stdint.h>
+#include "stats.h"
+
+// Plans kept by default.
+#define EXPLAIN_MAX_PLANS 32
+
+// The plan of a slow statement, by fingerprint.
+typedef struct {
+    char *fingerprint;
+    char *plan;             // As returned by EXPLAIN (FORMAT JSON).
+    double latency;         // Seconds taken by the command explained.
+    double time;            // When it was explained, in seconds since the epoch.
+    double captured;        // The same, by the monotonic clock.
+    unsigned long captures;
+} ExplainedPlan;
+
+// The plans captured for a session, explained on a connection of their own so that the
+// transaction of the session is left alone.
+struct ExplainStore {
+    double threshold;       // Seconds over which a command is slow.
+    double sample;          // The fraction of the slow commands explained.
+    double interval;        // Seconds before a statement is explained again.
+    int max;
+    int size;
+    ExplainedPlan *plans;
+    PGconn *side;
+    uint32_t random;
+};
+
+void
+explainSlow (ExplainStore *x, PGconn *conn, const char *command, int nparams,
+    const ParamSet *ps, double latency);
+
+void
+freeExplainStore (ExplainStore *x);
+
+void
+registerExplain (lua_State *L);
+
+#endif
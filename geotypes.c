@@ -1,9 +1,42 @@
 #include "geotypes.h"
+#include "binary.h"
+
+// Longest text of a coordinate in a value, as in "-1.2345678901234567e-308".
+#define COORD_LEN 24
+
+// Format a coordinate with the fewest digits that read back as the same number.
+static int
+formatCoord (char *buf, lua_Number v)
+{
+    int len = sprintf(buf, "%.15g", v);
+    if (strtod(buf, NULL) != v) {
+        len = sprintf(buf, "%.17g", v);
+    }
+    return len;
+}
+
+// Push the text of a geometric value, with each '#' in shape replaced by the next of coords.
+static void
+pushGeoText (lua_State *L, const char *shape, const lua_Number *coords)
+{
+    char buf[64 + 4 * COORD_LEN];
+    char *p = buf;
+    for (; *shape; shape++) {
+        if (*shape == '#') {
+            p += formatCoord(p, *coords++);
+        }
+        else {
+            *p++ = *shape;
+        }
+    }
+    lua_pushlstring(L, buf, p - buf);
+}
 
 int
 makePoint (lua_State *L)
 {
-    lua_pushfstring(L, "(%f,%f)", luaL_checknumber(L, 1), luaL_checknumber(L, 2));
+    lua_Number coords[] = {luaL_checknumber(L, 1), luaL_checknumber(L, 2)};
+    pushGeoText(L, "(#,#)", coords);
     return 1;
 }
  
@@ -20,8 +53,9 @@ makeSegment (lua_State *L, const char *geotype)
             lua_rawgeti(L, 3, 2);
             if (lua_isnumber(L, -4) && lua_isnumber(L, -3) &&
                     lua_isnumber(L, -2) && lua_isnumber(L, -1)) {
-                lua_pushfstring(L, "((%f,%f),(%f,%f))", lua_tonumber(L, -4), lua_tonumber(L, -3),
-                    lua_tonumber(L, -2), lua_tonumber(L, -1));
+                lua_Number coords[] = {lua_tonumber(L, -4), lua_tonumber(L, -3),
+                    lua_tonumber(L, -2), lua_tonumber(L, -1)};
+                pushGeoText(L, "((#,#),(#,#))", coords);
             }
             else {
                 return luaL_error(L, "Element of %s is not a number.", geotype);
@@ -32,8 +66,9 @@ makeSegment (lua_State *L, const char *geotype)
         }
     }
     else {
-        lua_pushfstring(L, "((%f,%f),(%f,%f))", luaL_checknumber(L, 1), luaL_checknumber(L, 2),
-            luaL_checknumber(L, 3), luaL_checknumber(L, 4));
+        lua_Number coords[] = {luaL_checknumber(L, 1), luaL_checknumber(L, 2),
+            luaL_checknumber(L, 3), luaL_checknumber(L, 4)};
+        pushGeoText(L, "((#,#),(#,#))", coords);
     }
     return 1;
 }
@@ -53,8 +88,9 @@ makeBox (lua_State *L)
 int
 makeCircle (lua_State *L)
 {
-    lua_pushfstring(L, "<(%f,%f),%f>", luaL_checknumber(L, 1), luaL_checknumber(L, 2),
-        luaL_checknumber(L, 3));
+    lua_Number coords[] = {luaL_checknumber(L, 1), luaL_checknumber(L, 2),
+        luaL_checknumber(L, 3)};
+    pushGeoText(L, "<(#,#),#>", coords);
     return 1;
 }
 
@@ -75,7 +111,8 @@ pushPathTable (lua_State *L)
                 lua_rawgeti(L, -1, 1);
                 lua_rawgeti(L, -2, 2);
                 if (lua_isnumber(L, -2) && lua_isnumber(L, -1)) {
-                    lua_pushfstring(L, "(%f,%f)", lua_tonumber(L, -2), lua_tonumber(L, -1));
+                    lua_Number coords[] = {lua_tonumber(L, -2), lua_tonumber(L, -1)};
+                    pushGeoText(L, "(#,#)", coords);
                 }
                 else {
                     return luaL_error(L, "An element of a table value is not a number.");
@@ -156,7 +193,7 @@ nextPoint (char *value, char *buf) {
 static void
 pointIntoTable (lua_State *L, char *value)
 {
-    char buf[20];
+    char buf[COORD_LEN + 1];
     lua_createtable(L, 0, 2);
     value++;
     char *sep = strchr(value, ',');
@@ -176,7 +213,7 @@ pointIntoTable (lua_State *L, char *value)
 void
 pushGeoLine (lua_State *L, char *value)
 {
-    char buf[43];
+    char buf[2 * COORD_LEN + 4];
     lua_createtable(L, 0, 2);
     char *sep = nextPoint(value + 1, buf);
     pointIntoTable(L, buf);
@@ -189,7 +226,7 @@ pushGeoLine (lua_State *L, char *value)
 void
 pushGeoBox (lua_State *L, char *value)
 {
-    char buf[43];
+    char buf[2 * COORD_LEN + 4];
     lua_createtable(L, 0, 2);
     char *sep = nextPoint(value, buf);
     pointIntoTable(L, buf);
@@ -202,7 +239,7 @@ pushGeoBox (lua_State *L, char *value)
 void
 pushGeoPolygon (lua_State *L, char *value)
 {
-    char buf[43];
+    char buf[2 * COORD_LEN + 4];
     lua_newtable(L);
     char *sep = value + 1;
     int n = 1;
@@ -228,7 +265,7 @@ pushGeoPath (lua_State *L, char *value)
 void
 pushGeoCircle (lua_State *L, char *value)
 {
-    char buf[43];
+    char buf[2 * COORD_LEN + 4];
     lua_createtable(L, 0, 2);
     char *sep = nextPoint(value + 1, buf);
     pointIntoTable(L, buf);
@@ -246,3 +283,76 @@ pushGeoPoint (lua_State *L, char *value)
     pointIntoTable(L, value);
 }
 
+// The binary forms of the geometric types are sequences of float8 coordinates, with a
+// closed flag and a point count leading a path and a point count leading a polygon.
+
+// Returns with a table on the stack with x and y fields, from the two float8 values at value.
+static void
+pointBinaryIntoTable (lua_State *L, const char *value)
+{
+    lua_createtable(L, 0, 2);
+    lua_pushnumber(L, readFloat8(value));
+    lua_setfield(L, -2, "x");
+    lua_pushnumber(L, readFloat8(value + 8));
+    lua_setfield(L, -2, "y");
+}
+
+void
+pushGeoPointBinary (lua_State *L, const char *value)
+{
+    pointBinaryIntoTable(L, value);
+}
+
+void
+pushGeoLineBinary (lua_State *L, const char *value)
+{
+    lua_createtable(L, 0, 2);
+    pointBinaryIntoTable(L, value);
+    lua_setfield(L, -2, "a");
+    pointBinaryIntoTable(L, value + 16);
+    lua_setfield(L, -2, "b");
+}
+
+void
+pushGeoBoxBinary (lua_State *L, const char *value)
+{
+    lua_createtable(L, 0, 2);
+    pointBinaryIntoTable(L, value);
+    lua_setfield(L, -2, "ur");
+    pointBinaryIntoTable(L, value + 16);
+    lua_setfield(L, -2, "ll");
+}
+
+static void
+pointsBinaryIntoTable (lua_State *L, const char *value, int npts)
+{
+    lua_createtable(L, npts, 1);
+    for (int i = 0; i < npts; i++) {
+        pointBinaryIntoTable(L, value + i * 16);
+        lua_rawseti(L, -2, i + 1);
+    }
+}
+
+void
+pushGeoPathBinary (lua_State *L, const char *value)
+{
+    pointsBinaryIntoTable(L, value + 5, readInt32(value + 1));
+    lua_pushboolean(L, value[0]);
+    lua_setfield(L, -2, "closed");
+}
+
+void
+pushGeoPolygonBinary (lua_State *L, const char *value)
+{
+    pointsBinaryIntoTable(L, value + 4, readInt32(value));
+}
+
+void
+pushGeoCircleBinary (lua_State *L, const char *value)
+{
+    lua_createtable(L, 0, 2);
+    pointBinaryIntoTable(L, value);
+    lua_setfield(L, -2, "center");
+    lua_pushnumber(L, readFloat8(value + 16));
+    lua_setfield(L, -2, "radius");
+}
@@ -39,4 +39,22 @@ pushGeoPolygon (lua_State *L, char *value);
 void
 pushGeoCircle (lua_State *L, char *value);
 
+void
+pushGeoPointBinary (lua_State *L, const char *value);
+
+void
+pushGeoLineBinary (lua_State *L, const char *value);
+
+void
+pushGeoBoxBinary (lua_State *L, const char *value);
+
+void
+pushGeoPathBinary (lua_State *L, const char *value);
+
+void
+pushGeoPolygonBinary (lua_State *L, const char *value);
+
+void
+pushGeoCircleBinary (lua_State *L, const char *value);
+
 #endif
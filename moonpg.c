@@ -1,47 +1,72 @@
 #include "common.h"
 #include "session.h"
 #include "geotypes.h"
+#include "binary.h"
+#include "stream.h"
+#include "result.h"
+#include "copy.h"
+#include "pipeline.h"
+#include "stmtcache.h"
+#include "vector.h"
+#include "scheduler.h"
+#include "pool.h"
+#include "executor.h"
+#include "parallel.h"
+#include "scatter.h"
+#include "router.h"
+#include "stats.h"
+#include "trace.h"
+#include "explain.h"
 
 static int
 connect (lua_State *L)
 {
-    const char *cinfo = luaL_checkstring(L, 1);
-    DBSession *sess = lua_newuserdata(L, sizeof(DBSession));
-    sess->conn = PQconnectdb(cinfo);
-    sess->sid = 1;
-    sess->getbyarray = 0;
-    sess->typeMapString = NULL;
-
-    if (PQstatus(sess->conn) != CONNECTION_OK) {
-        lua_pushnil(L);
-        lua_pushfstring(L, ERROR_CONNECTION_FAILED, PQerrorMessage(sess->conn));
-        PQfinish(sess->conn);
-        sess->conn = NULL;
-        return 2;
-    }
+    return connectSession(L, luaL_checkstring(L, 1));
+}
 
-    // Set the metatable of this user data.
-    luaL_getmetatable(L, SES_REGNAME);
-    lua_setmetatable(L, -2);
+/* Returns the seconds on a clock that only moves forward, for measuring
+ * intervals. */
+static int
+monotonicClock (lua_State *L)
+{
+    lua_pushnumber(L, monotonicTime());
     return 1;
 }
 
 static void
-arrayFunc (lua_State *L, int ref)
+arrayFunc (lua_State *L, int index, TextBuffer *tb)
 {
-    lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
-    arrayFromTable(L, -1);
-    luaL_unref(L, LUA_REGISTRYINDEX, ref);
+    lua_getfenv(L, index);
+    arrayText(L, lua_gettop(L), tb);
+    lua_pop(L, 1);
+}
+
+static Oid
+arrayBinaryFunc (lua_State *L, int index, Oid type)
+{
+    lua_getfenv(L, index);
+    Oid arrayType = arrayBinaryFromTable(L, lua_gettop(L), type);
+    if (arrayType) {
+        lua_remove(L, -2);
+    }
+    else {
+        lua_pop(L, 1);
+    }
+    return arrayType;
 }
 
 static int
 makeArray (lua_State *L)
 {
     if (lua_istable(L, 1)) {
-        int ref = luaL_ref(L, LUA_REGISTRYINDEX);
         ParamConvert *pc = lua_newuserdata(L, sizeof *pc);
-        pc->tref = ref;
         pc->convert = arrayFunc;
+        pc->encode = arrayBinaryFunc;
+        luaL_getmetatable(L, ARRAY_REGNAME);
+        lua_setmetatable(L, -2);
+        // The table is kept as the environment of the userdata.
+        lua_pushvalue(L, 1);
+        lua_setfenv(L, -2);
         return 1;
     }
     else {
@@ -59,6 +84,13 @@ static const struct luaL_Reg funcs [] =
     {"Polygon", makePolygon},
     {"Circle", makeCircle},
     {"Array", makeArray},
+    {"scheduler", newScheduler},
+    {"pool", newPool},
+    {"executor", newExecutor},
+    {"scatter", scatterQuery},
+    {"shard", shardFor},
+    {"router", newRouter},
+    {"clock", monotonicClock},
     {NULL, NULL}
 };
 
@@ -67,7 +99,23 @@ luaopen_moonpg (lua_State *L)
 {
     void registerSession (lua_State *L);
 
+    luaL_newmetatable(L, ARRAY_REGNAME);
+    lua_pop(L, 1);
     registerSession(L);
+    registerStream(L);
+    registerResult(L);
+    registerCopy(L);
+    registerPipeline(L);
+    registerStatementCache(L);
+    registerVector(L);
+    registerScheduler(L);
+    registerPool(L);
+    registerExecutor(L);
+    registerParallelDecode(L);
+    registerRouter(L);
+    registerStats(L);
+    registerTrace(L);
+    registerExplain(L);
     luaL_register(L, "moonpg", funcs);
     return 1;
 }
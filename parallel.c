@@ -0,0 +1,164 @@
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <unistd.h>
+#include "parallel.h"
+
+// A range of tuples of a result decoded by one thread.
+typedef struct {
+    PGresult *result;
+    ColumnDecoder *columns;
+    int *fields;        // The fields decoded ahead.
+    int nfields;
+    int first, last;
+} DecodeRange;
+
+// Whether the values of column are numbers or booleans in the text format, to be decoded
+// ahead without the Lua state.
+static int
+decodedAhead (PGresult *result, int field, const ColumnDecoder *column)
+{
+    if (PQfformat(result, field) != 0 || column->mapping != mapDefault) {
+        return 0;
+    }
+    switch (column->type) {
+        case int2OID:
+        case int4OID:
+        case int8OID:
+        case float4OID:
+        case float8OID:
+        case numericOID:
+        case boolOID:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static void *
+decodeRange (void *arg)
+{
+    DecodeRange *r = arg;
+    for (int f = 0; f < r->nfields; f++) {
+        int j = r->fields[f];
+        double *values = (double *)r->columns[j].decoded;
+        PGtype type = r->columns[j].type;
+        for (int i = r->first; i < r->last; i++) {
+            const char *value = PQgetvalue(r->result, i, j);
+            if (PQgetisnull(r->result, i, j)) {
+                values[i] = 0;
+            }
+            else if (type == boolOID) {
+                values[i] = value[0] == 't';
+            }
+            else if (type == float4OID || type == float8OID || type == numericOID) {
+                values[i] = strtod(value, NULL);
+            }
+            else {
+                values[i] = (double)strtoll(value, NULL, 10);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Decode the numeric and boolean values of a large result on the decoding threads of the
+// session, into its buffer, setting the decoded values of their columns. The values of other
+// columns are left to be decoded as they are pushed, as is the whole result if it is small or
+// the buffer can not be had.
+void
+decodeParallel (PGresult *result, ColumnDecoder *columns, DBSession *s)
+{
+    int nt = PQntuples(result);
+    int nf = PQnfields(result);
+    int nthreads = MIN(s->decodeThreads, nt / PARALLEL_DECODE_ROWS);
+    if (nthreads < 2) {
+        return;
+    }
+    int fields[nf];
+    int nfields = 0;
+    for (int j = 0; j < nf; j++) {
+        if (decodedAhead(result, j, columns + j)) {
+            fields[nfields++] = j;
+        }
+    }
+    if (nfields == 0) {
+        return;
+    }
+    size_t size = (size_t)nfields * nt;
+    if (size > s->ndecoded) {
+        double *decoded = realloc(s->decoded, size * sizeof *decoded);
+        if (!decoded) {
+            return;
+        }
+        s->decoded = decoded;
+        s->ndecoded = size;
+    }
+    for (int f = 0; f < nfields; f++) {
+        columns[fields[f]].decoded = s->decoded + (size_t)f * nt;
+    }
+
+    DecodeRange ranges[nthreads];
+    pthread_t threads[nthreads];
+    int started[nthreads];
+    for (int t = 0; t < nthreads; t++) {
+        DecodeRange *r = ranges + t;
+        r->result = result;
+        r->columns = columns;
+        r->fields = fields;
+        r->nfields = nfields;
+        r->first = (int)((long long)nt * t / nthreads);
+        r->last = (int)((long long)nt * (t + 1) / nthreads);
+        // The first range is decoded by this thread, as is any range a thread can not start for.
+        started[t] = t > 0 && pthread_create(threads + t, NULL, decodeRange, r) == 0;
+    }
+    for (int t = 0; t < nthreads; t++) {
+        if (!started[t]) {
+            decodeRange(ranges + t);
+        }
+    }
+    for (int t = 1; t < nthreads; t++) {
+        if (started[t]) {
+            pthread_join(threads[t], NULL);
+        }
+    }
+}
+
+void
+freeDecoded (DBSession *s)
+{
+    free(s->decoded);
+    s->decoded = NULL;
+    s->ndecoded = 0;
+}
+
+/* Decode the numbers and booleans of large query results on threads, the
+ * number given, or as many as there are processors. Only results of many
+ * rows are split between threads, and a value of 1 turns this off. */
+static int
+parallelDecode (lua_State *L)
+{
+    DBSession *s = checkSessionOrPrep(L, 1, NULL);
+    long n;
+    if (lua_isnoneornil(L, 2)) {
+        n = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    else {
+        n = luaL_checkint(L, 2);
+        luaL_argcheck(L, n >= 1, 2, "invalid number of threads");
+    }
+    s->decodeThreads = n > 1 ? (int)MIN(n, PARALLEL_DECODE_THREADS) : 0;
+    return 0;
+}
+
+void
+registerParallelDecode (lua_State *L)
+{
+    luaL_getmetatable(L, SES_REGNAME);
+    lua_pushcfunction(L, parallelDecode);
+    lua_setfield(L, -2, "parallelDecode");
+    lua_pop(L, 1);
+    luaL_getmetatable(L, SESPREP_REGNAME);
+    lua_pushcfunction(L, parallelDecode);
+    lua_setfield(L, -2, "parallelDecode");
+    lua_pop(L, 1);
+}
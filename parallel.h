@@ -0,0 +1,19 @@
+#ifndef _PARALLEL_H
+#define _PARALLEL_H
+
+#include "session.h"
+
+// Tuples decoded by each thread at least, below which a result is decoded as it is pushed.
+#define PARALLEL_DECODE_ROWS 8192
+#define PARALLEL_DECODE_THREADS 64
+
+void
+decodeParallel (PGresult *result, ColumnDecoder *columns, DBSession *s);
+
+void
+freeDecoded (DBSession *s);
+
+void
+registerParallelDecode (lua_State *L);
+
+#endif
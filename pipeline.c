@@ -0,0 +1,287 @@
+#include "pipeline.h"
+
+#ifdef LIBPQ_HAS_PIPELINING
+
+static Pipeline *
+checkPipeline (lua_State *L, int index)
+{
+    Pipeline *p = luaL_checkudata(L, index, PIPELINE_REGNAME);
+    if (p->closed || !p->sess->conn) {
+        luaL_error(L, "pipeline is closed");
+    }
+    return p;
+}
+
+// Start a new environment for the pipeline at index, holding its session and, in order,
+// the session or prepared object of each command sent.
+static void
+resetCommands (lua_State *L, int index, DBSession *s)
+{
+    lua_createtable(L, 0, 1);
+    lua_getfenv(L, index);
+    lua_getfield(L, -1, "session");
+    lua_setfield(L, -3, "session");
+    lua_pop(L, 1);
+    lua_setfenv(L, index);
+}
+
+static int
+sendSync (Pipeline *p)
+{
+    if (!PQpipelineSync(p->sess->conn)) {
+        return 0;
+    }
+    p->syncs++;
+    p->unsynced = 0;
+    return 1;
+}
+
+/* Queue a command, given as a command string or a prepared statement object,
+ * with its parameters. Returns true once it is sent. */
+static int
+pipelineRun (lua_State *L)
+{
+    Pipeline *p = checkPipeline(L, 1);
+    PGconn *conn = p->sess->conn;
+    int pc = lua_gettop(L) - 2;
+    ParamSet ps;
+    int sent;
+
+    if (lua_type(L, 2) == LUA_TSTRING) {
+        DBSession *s = p->sess;
+        parametersFromStack(L, pc, 3, s->binaryParams, NULL, 0, &ps);
+        sent = PQsendQueryParams(conn, lua_tostring(L, 2), pc, ps.types, ps.values, ps.lengths,
+            ps.formats, s->binary);
+        // The session object is the environment's.
+        lua_getfenv(L, 1);
+        lua_getfield(L, -1, "session");
+        lua_replace(L, 2);
+        lua_pop(L, 1);
+    }
+    else {
+        DBSession *s = luaL_checkudata(L, 2, SESPREP_REGNAME);
+        if (s->conn != conn) {
+            return luaL_argerror(L, 2, "prepared on another connection");
+        }
+        parametersFromStack(L, pc, 3, s->binaryParams && s->paramTypes, s->paramTypes,
+            s->nparams, &ps);
+        // Convert the sid to a string
+        lua_pushnumber(L, s->sid);
+        sent = PQsendQueryPrepared(conn, lua_tostring(L, -1), pc, ps.values, ps.lengths,
+            ps.formats, s->binary);
+    }
+    if (!sent) {
+        lua_pushboolean(L, 0);
+        lua_pushstring(L, PQerrorMessage(conn));
+        return 2;
+    }
+    // Keep the object whose settings apply to the result.
+    lua_getfenv(L, 1);
+    lua_pushvalue(L, 2);
+    lua_rawseti(L, -2, ++p->queued);
+    p->unsynced++;
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/* Mark a sync point. An error in a command makes the server skip the rest of
+ * the commands up to the next sync point, each of which ends a transaction. */
+static int
+pipelineSync (lua_State *L)
+{
+    Pipeline *p = checkPipeline(L, 1);
+    if (!sendSync(p)) {
+        lua_pushboolean(L, 0);
+        lua_pushstring(L, PQerrorMessage(p->sess->conn));
+        return 2;
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+// Read the results of all commands sent. With the results table at index, each command's
+// result is set in it, and the error message of each command that failed in the table at
+// index + 1. Without, the results are discarded.
+static void
+readResults (lua_State *L, int pindex, Pipeline *p, int index)
+{
+    PGconn *conn = p->sess->conn;
+    int n = 0, nulls = 0;
+    if (index) {
+        lua_getfenv(L, pindex);
+    }
+    while (p->syncs > 0) {
+        PGresult *result = PQgetResult(conn);
+        if (!result) {
+            // The end of a command's results, or of the connection if it repeats.
+            if (++nulls > 1) {
+                break;
+            }
+            continue;
+        }
+        nulls = 0;
+        ExecStatusType status = PQresultStatus(result);
+        if (status == PGRES_PIPELINE_SYNC) {
+            p->syncs--;
+            PQclear(result);
+            continue;
+        }
+        n++;
+        if (!index) {
+            PQclear(result);
+            continue;
+        }
+        if (status == PGRES_PIPELINE_ABORTED || status == PGRES_FATAL_ERROR) {
+            lua_pushboolean(L, 0);
+            lua_pushstring(L, status == PGRES_FATAL_ERROR ? PQresultErrorMessage(result) :
+                "Command skipped after an error earlier in the pipeline");
+            PQclear(result);
+        }
+        else {
+            lua_rawgeti(L, -1, n);
+            DBSession *s = lua_touserdata(L, -1);
+            lua_pop(L, 1);
+            if (processResultStatus(L, result, status, s) == 1) {
+                lua_pushnil(L);
+            }
+        }
+        if (!lua_isnil(L, -1)) {
+            lua_rawseti(L, index + 1, n);
+        }
+        else {
+            lua_pop(L, 1);
+        }
+        lua_rawseti(L, index, n);
+    }
+    if (index) {
+        lua_pop(L, 1);
+    }
+    p->queued = 0;
+    resetCommands(L, pindex, p->sess);
+}
+
+/* Send the queued commands and read their results, returning an array of the
+ * command results, in order, and an array of the error messages of the
+ * commands that failed, by the same positions. */
+static int
+pipelineExecute (lua_State *L)
+{
+    Pipeline *p = checkPipeline(L, 1);
+    if (p->unsynced && !sendSync(p)) {
+        lua_pushnil(L);
+        lua_pushstring(L, PQerrorMessage(p->sess->conn));
+        return 2;
+    }
+    if (PQflush(p->sess->conn) < 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, PQerrorMessage(p->sess->conn));
+        return 2;
+    }
+    int index = lua_gettop(L) + 1;
+    lua_createtable(L, p->queued, 0);
+    lua_createtable(L, 0, 0);
+    readResults(L, 1, p, index);
+    return 2;
+}
+
+// Discard any results not read, and leave pipeline mode.
+static int
+closePipeline (lua_State *L, Pipeline *p)
+{
+    if (p->unsynced) {
+        sendSync(p);
+    }
+    readResults(L, 1, p, 0);
+    p->closed = 1;
+    return PQexitPipelineMode(p->sess->conn);
+}
+
+/* Leave pipeline mode, discarding the results of any commands not executed. */
+static int
+pipelineClose (lua_State *L)
+{
+    Pipeline *p = checkPipeline(L, 1);
+    if (!closePipeline(L, p)) {
+        lua_pushboolean(L, 0);
+        lua_pushstring(L, PQerrorMessage(p->sess->conn));
+        return 2;
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+static int
+pipelineGC (lua_State *L)
+{
+    Pipeline *p = luaL_checkudata(L, 1, PIPELINE_REGNAME);
+    if (!p->closed && p->sess->conn) {
+        closePipeline(L, p);
+    }
+    return 0;
+}
+
+/* Put the connection in pipeline mode, returning a pipeline object to queue
+ * commands on, or nil and an error message. */
+static int
+pipeline (lua_State *L)
+{
+    DBSession *s = luaL_checkudata(L, 1, SES_REGNAME);
+    // libpq leaves the row mode of a stream only when a command is sent outside of pipeline
+    // mode, so an empty one is sent first, lest the first command of the pipeline return its
+    // rows one by one.
+    if (s->rowMode) {
+        PQclear(PQexec(s->conn, ""));
+        s->rowMode = 0;
+    }
+    if (!PQenterPipelineMode(s->conn)) {
+        lua_pushnil(L);
+        lua_pushstring(L, PQerrorMessage(s->conn));
+        return 2;
+    }
+    Pipeline *p = lua_newuserdata(L, sizeof *p);
+    p->sess = s;
+    p->queued = 0;
+    p->unsynced = 0;
+    p->syncs = 0;
+    p->closed = 0;
+    luaL_getmetatable(L, PIPELINE_REGNAME);
+    lua_setmetatable(L, -2);
+    lua_createtable(L, 0, 1);
+    lua_pushvalue(L, 1);
+    lua_setfield(L, -2, "session");
+    lua_setfenv(L, -2);
+    return 1;
+}
+
+static const struct luaL_Reg pipelineMethods [] = {
+    {"run", pipelineRun},
+    {"sync", pipelineSync},
+    {"execute", pipelineExecute},
+    {"close", pipelineClose},
+    {"__gc", pipelineGC},
+    {NULL, NULL}
+};
+
+void
+registerPipeline (lua_State *L)
+{
+    luaL_newmetatable(L, PIPELINE_REGNAME);
+    luaL_register(L, NULL, pipelineMethods);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+
+    luaL_getmetatable(L, SES_REGNAME);
+    lua_pushcfunction(L, pipeline);
+    lua_setfield(L, -2, "pipeline");
+    lua_pop(L, 2);
+}
+
+#else
+
+// Pipeline mode needs libpq 14 or later.
+void
+registerPipeline (lua_State *L)
+{
+}
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef _PIPELINE_H
+#define _PIPELINE_H
+
+#include "session.h"
+
+#define PIPELINE_REGNAME "moonpg.pipeline"
+
+// Commands sent on a connection in pipeline mode, with their results read back together.
+typedef struct {
+    DBSession *sess;
+    int queued;     // Commands sent since the results were last read.
+    int unsynced;   // Commands sent since the last sync point.
+    int syncs;      // Sync points whose results are not read yet.
+    int closed;
+} Pipeline;
+
+void
+registerPipeline (lua_State *L);
+
+#endif
@@ -0,0 +1,422 @@
+#define _POSIX_C_SOURCE 200809L
+#include <poll.h>
+#include "pool.h"
+#include "stats.h"
+#include "stmtcache.h"
+
+#define ERROR_POOL_EXHAUSTED "No connection available in the pool"
+
+static Pool *
+checkOpenPool (lua_State *L, int index)
+{
+    Pool *p = luaL_checkudata(L, index, POOL_REGNAME);
+    if (p->closed) {
+        luaL_error(L, "pool is closed");
+    }
+    return p;
+}
+
+// Push the table name of the environment of the pool at index: the idle sessions, as an
+// array, or the set of checked out sessions.
+static void
+pushPoolTable (lua_State *L, int index, const char *name)
+{
+    lua_getfenv(L, index);
+    lua_getfield(L, -1, name);
+    lua_remove(L, -2);
+}
+
+// Close the session at index with its close method.
+static void
+closeSession (lua_State *L, int index)
+{
+    luaL_getmetatable(L, SES_REGNAME);
+    lua_getfield(L, -1, "close");
+    lua_pushvalue(L, index);
+    lua_call(L, 1, 0);
+    lua_pop(L, 1);
+}
+
+// Whether an idle session is still connected. Input waiting on an idle connection can only
+// be a notice, a notification or the server closing it, so it is read to find out which.
+static int
+idleHealthy (DBSession *s)
+{
+    struct pollfd pfd;
+    if (!s->conn || PQstatus(s->conn) != CONNECTION_OK) {
+        return 0;
+    }
+    pfd.fd = PQsocket(s->conn);
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, 0) > 0 && !PQconsumeInput(s->conn)) {
+        return 0;
+    }
+    return PQstatus(s->conn) == CONNECTION_OK &&
+        PQtransactionStatus(s->conn) == PQTRANS_IDLE;
+}
+
+// Bring a returned session back to an idle connection, with no command in progress and no
+// open transaction. Returns 0 if it can not be reused.
+static int
+recycleSession (DBSession *s, Pool *p)
+{
+    PGresult *result;
+    if (!s->conn) {
+        return 0;
+    }
+#ifdef LIBPQ_HAS_PIPELINING
+    if (PQpipelineStatus(s->conn) != PQ_PIPELINE_OFF) {
+        return 0;
+    }
+#endif
+    if (PQstatus(s->conn) != CONNECTION_OK) {
+        PQreset(s->conn);
+        resetStatementCache(s);
+        if (PQstatus(s->conn) != CONNECTION_OK) {
+            return 0;
+        }
+        p->resets++;
+    }
+    if (PQtransactionStatus(s->conn) == PQTRANS_ACTIVE) {
+        // A command sent without its results read.
+        PGcancel *cancel = PQgetCancel(s->conn);
+        char err[256];
+        if (cancel) {
+            PQcancel(cancel, err, sizeof err);
+            PQfreeCancel(cancel);
+        }
+        while ((result = PQgetResult(s->conn))) {
+            ExecStatusType status = PQresultStatus(result);
+            PQclear(result);
+            if (status == PGRES_COPY_IN || status == PGRES_COPY_OUT || status == PGRES_COPY_BOTH) {
+                return 0;
+            }
+        }
+    }
+    switch (PQtransactionStatus(s->conn)) {
+        case PQTRANS_IDLE:
+            return 1;
+        case PQTRANS_INTRANS:
+        case PQTRANS_INERROR:
+            result = PQexec(s->conn, "ROLLBACK");
+            if (PQresultStatus(result) != PGRES_COMMAND_OK) {
+                PQclear(result);
+                return 0;
+            }
+            PQclear(result);
+            return PQtransactionStatus(s->conn) == PQTRANS_IDLE;
+        default:
+            return 0;
+    }
+}
+
+// Push a new session connected for the pool, or nil and an error message.
+static int
+openSession (lua_State *L, Pool *p)
+{
+    int ret = connectSession(L, p->conninfo);
+    if (ret == 1 && p->trackStats && !sessionStats(lua_touserdata(L, -1))) {
+        return luaL_error(L, "out of memory");
+    }
+    return ret;
+}
+
+// Open sessions until the pool at index has its minimum. Returns 0, with nil and the error
+// message pushed, if a session could not be opened.
+static int
+fillPool (lua_State *L, int index, Pool *p)
+{
+    pushPoolTable(L, index, "idle");
+    while (p->open < p->min) {
+        if (openSession(L, p) != 1) {
+            lua_remove(L, -4);  // The idle table.
+            lua_remove(L, -3);  // The unconnected session.
+            return 0;
+        }
+        lua_rawseti(L, -2, lua_objlen(L, -2) + 1);
+        p->open++;
+        p->opened++;
+    }
+    lua_pop(L, 1);
+    return 1;
+}
+
+/* Returns a new pool of sessions from a table of options: conninfo, the
+ * connection string of the sessions, min, the number kept open, max, the
+ * number open at most, and trackStats, whether the sessions count their
+ * statements. Returns nil and an error message if the sessions kept open could
+ * not be connected. */
+int
+newPool (lua_State *L)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_getfield(L, 1, "conninfo");
+    lua_getfield(L, 1, "min");
+    lua_getfield(L, 1, "max");
+    lua_getfield(L, 1, "trackStats");
+    const char *conninfo = luaL_optstring(L, 2, "");
+    int min = luaL_optint(L, 3, 0);
+    int max = luaL_optint(L, 4, MAX(min, 10));
+    luaL_argcheck(L, min >= 0 && max >= 1 && min <= max, 1, "invalid pool size");
+
+    Pool *p = lua_newuserdata(L, sizeof *p);
+    memset(p, 0, sizeof *p);
+    p->min = min;
+    p->max = max;
+    p->trackStats = lua_toboolean(L, 5);
+    p->conninfo = malloc(strlen(conninfo) + 1);
+    if (!p->conninfo) {
+        return luaL_error(L, "out of memory");
+    }
+    strcpy(p->conninfo, conninfo);
+    luaL_getmetatable(L, POOL_REGNAME);
+    lua_setmetatable(L, -2);
+    lua_createtable(L, 0, 2);
+    lua_createtable(L, max, 0);
+    lua_setfield(L, -2, "idle");
+    lua_newtable(L);
+    lua_setfield(L, -2, "out");
+    lua_setfenv(L, -2);
+
+    if (!fillPool(L, lua_gettop(L), p)) {
+        return 2;
+    }
+    return 1;
+}
+
+// Push a healthy idle session of the pool at index, reconnecting or dropping broken ones.
+// Returns 0, with nothing pushed, if no idle session is left.
+static int
+takeIdle (lua_State *L, int index, Pool *p)
+{
+    pushPoolTable(L, index, "idle");
+    for (int n = lua_objlen(L, -1); n > 0; n--) {
+        lua_rawgeti(L, -1, n);
+        lua_pushnil(L);
+        lua_rawseti(L, -3, n);
+        DBSession *s = lua_touserdata(L, -1);
+        if (idleHealthy(s)) {
+            lua_remove(L, -2);
+            return 1;
+        }
+        if (s->conn) {
+            PQreset(s->conn);
+            resetStatementCache(s);
+            if (PQstatus(s->conn) == CONNECTION_OK) {
+                p->resets++;
+                lua_remove(L, -2);
+                return 1;
+            }
+        }
+        closeSession(L, lua_gettop(L));
+        lua_pop(L, 1);
+        p->open--;
+        p->discarded++;
+    }
+    lua_pop(L, 1);
+    return 0;
+}
+
+/* Returns a session of the pool, idle or newly connected, to be checked in
+ * when done with. Returns nil and an error message if all the sessions the
+ * pool may open are in use, or a session could not be connected. */
+static int
+poolCheckout (lua_State *L)
+{
+    Pool *p = checkOpenPool(L, 1);
+    double start = monotonicTime();
+    lua_settop(L, 1);
+    if (takeIdle(L, 1, p)) {
+        p->reused++;
+    }
+    else if (p->open >= p->max) {
+        p->exhausted++;
+        p->waitTime += monotonicTime() - start;
+        lua_pushnil(L);
+        lua_pushliteral(L, ERROR_POOL_EXHAUSTED);
+        return 2;
+    }
+    else if (openSession(L, p) == 1) {
+        p->open++;
+        p->opened++;
+    }
+    else {
+        p->waitTime += monotonicTime() - start;
+        return 2;
+    }
+    pushPoolTable(L, 1, "out");
+    lua_pushvalue(L, -2);
+    lua_pushboolean(L, 1);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+    p->checkouts++;
+    p->inUse++;
+    if (p->inUse > p->peakInUse) {
+        p->peakInUse = p->inUse;
+    }
+    p->waitTime += monotonicTime() - start;
+    return 1;
+}
+
+/* Returns a checked out session to the pool. A transaction left open is
+ * rolled back, a command left running is canceled, and the session options
+ * are set back to their defaults. A session that can not be brought back to
+ * an idle connection is closed. */
+static int
+poolCheckin (lua_State *L)
+{
+    Pool *p = luaL_checkudata(L, 1, POOL_REGNAME);
+    DBSession *s = luaL_checkudata(L, 2, SES_REGNAME);
+    lua_settop(L, 2);
+    pushPoolTable(L, 1, "out");
+    lua_pushvalue(L, 2);
+    lua_rawget(L, -2);
+    if (!lua_toboolean(L, -1)) {
+        return luaL_error(L, "session is not checked out of this pool");
+    }
+    lua_pop(L, 1);
+    lua_pushvalue(L, 2);
+    lua_pushnil(L);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+    p->inUse--;
+
+    if (!p->closed && recycleSession(s, p)) {
+        resetSessionOptions(s);
+        pushPoolTable(L, 1, "idle");
+        lua_pushvalue(L, 2);
+        lua_rawseti(L, -2, lua_objlen(L, -2) + 1);
+        lua_pop(L, 1);
+        return 0;
+    }
+    closeSession(L, 2);
+    p->open--;
+    if (!p->closed) {
+        p->discarded++;
+        if (!fillPool(L, 1, p)) {
+            lua_pop(L, 2);
+        }
+    }
+    return 0;
+}
+
+// Add the statement counts of the sessions of the table at the top of the stack, its values
+// for an array or its keys for a set, to st.
+static void
+mergeSessionStats (lua_State *L, SessionStats *st, int isSet)
+{
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+        DBSession *s = lua_touserdata(L, isSet ? -2 : -1);
+        if (s && s->stats) {
+            mergeStats(st, s->stats);
+        }
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+}
+
+/* Returns a table of the counts of the pool. */
+static int
+poolStats (lua_State *L)
+{
+    Pool *p = luaL_checkudata(L, 1, POOL_REGNAME);
+    lua_settop(L, 1);
+    lua_createtable(L, 0, 16);
+    if (p->trackStats) {
+        // The statements of the open sessions, in a temporary set of counts.
+        SessionStats *st = lua_newuserdata(L, sizeof *st);
+        memset(st, 0, sizeof *st);
+        pushPoolTable(L, 1, "idle");
+        mergeSessionStats(L, st, 0);
+        pushPoolTable(L, 1, "out");
+        mergeSessionStats(L, st, 1);
+        pushStats(L, st);
+        clearSessionStats(st);
+        lua_setfield(L, 2, "statements");
+        lua_pop(L, 1);
+    }
+    lua_pushinteger(L, p->open);
+    lua_setfield(L, -2, "open");
+    lua_pushinteger(L, p->open - p->inUse);
+    lua_setfield(L, -2, "idle");
+    lua_pushinteger(L, p->inUse);
+    lua_setfield(L, -2, "inUse");
+    lua_pushinteger(L, p->peakInUse);
+    lua_setfield(L, -2, "peakInUse");
+    lua_pushinteger(L, p->min);
+    lua_setfield(L, -2, "min");
+    lua_pushinteger(L, p->max);
+    lua_setfield(L, -2, "max");
+    lua_pushnumber(L, (lua_Number)p->inUse / p->max);
+    lua_setfield(L, -2, "utilization");
+    lua_pushnumber(L, p->checkouts);
+    lua_setfield(L, -2, "checkouts");
+    lua_pushnumber(L, p->reused);
+    lua_setfield(L, -2, "reused");
+    lua_pushnumber(L, p->opened);
+    lua_setfield(L, -2, "opened");
+    lua_pushnumber(L, p->resets);
+    lua_setfield(L, -2, "resets");
+    lua_pushnumber(L, p->discarded);
+    lua_setfield(L, -2, "discarded");
+    lua_pushnumber(L, p->exhausted);
+    lua_setfield(L, -2, "exhausted");
+    lua_pushnumber(L, p->waitTime);
+    lua_setfield(L, -2, "waitTime");
+    return 1;
+}
+
+/* Closes the idle sessions. Sessions still checked out are closed when they
+ * are checked in. */
+static int
+poolClose (lua_State *L)
+{
+    Pool *p = luaL_checkudata(L, 1, POOL_REGNAME);
+    if (p->closed) {
+        return 0;
+    }
+    p->closed = 1;
+    lua_settop(L, 1);
+    pushPoolTable(L, 1, "idle");
+    for (int n = lua_objlen(L, 2); n > 0; n--) {
+        lua_rawgeti(L, 2, n);
+        closeSession(L, 3);
+        lua_pop(L, 1);
+        lua_pushnil(L);
+        lua_rawseti(L, 2, n);
+        p->open--;
+    }
+    return 0;
+}
+
+static int
+poolGC (lua_State *L)
+{
+    Pool *p = luaL_checkudata(L, 1, POOL_REGNAME);
+    // The idle sessions are closed by their own collection.
+    free(p->conninfo);
+    p->conninfo = NULL;
+    p->closed = 1;
+    return 0;
+}
+
+static const struct luaL_Reg poolMethods [] = {
+    {"checkout", poolCheckout},
+    {"checkin", poolCheckin},
+    {"stats", poolStats},
+    {"close", poolClose},
+    {"__gc", poolGC},
+    {NULL, NULL}
+};
+
+void
+registerPool (lua_State *L)
+{
+    luaL_newmetatable(L, POOL_REGNAME);
+    luaL_register(L, NULL, poolMethods);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+}
@@ -0,0 +1,33 @@
+#ifndef _POOL_H
+#define _POOL_H
+
+#include "session.h"
+
+#define POOL_REGNAME "moonpg.pool"
+
+// Sessions connected by the same connection string, checked out and back in for reuse.
+typedef struct {
+    char *conninfo;
+    int min;            // Sessions kept open, idle or not.
+    int max;            // Sessions open at most.
+    int open;
+    int inUse;
+    int closed;
+    int trackStats;     // Sessions count their statements.
+    unsigned long checkouts;
+    unsigned long reused;       // Checkouts served by an idle session.
+    unsigned long opened;
+    unsigned long resets;
+    unsigned long discarded;
+    unsigned long exhausted;    // Checkouts refused with all sessions in use.
+    int peakInUse;
+    double waitTime;            // Seconds spent in checkout.
+} Pool;
+
+int
+newPool (lua_State *L);
+
+void
+registerPool (lua_State *L);
+
+#endif
@@ -0,0 +1,173 @@
+#include "result.h"
+
+// Push a result object for result, which takes ownership of it. The type map of the session
+// is applied to the values as they are read.
+void
+pushLazyResult (lua_State *L, PGresult *result, DBSession *s)
+{
+    int nf = PQnfields(result);
+    LazyResult *r = lua_newuserdata(L, sizeof *r);
+    r->result = result;
+    r->ntuples = PQntuples(result);
+    r->nfields = nf;
+    r->getbyarray = s->getbyarray;
+    r->columns = malloc(MAX(nf, 1) * sizeof *r->columns);
+    if (!r->columns) {
+        PQclear(result);
+        luaL_error(L, "out of memory");
+    }
+    resolveColumns(result, s->typeMap, r->columns);
+    luaL_getmetatable(L, RESULT_REGNAME);
+    lua_setmetatable(L, -2);
+
+    // The environment holds the field names table, shared by all rows.
+    lua_createtable(L, 0, 1);
+    lua_createtable(L, nf, 0);
+    for (int i = 0; i < nf; i++) {
+        lua_pushstring(L, PQfname(result, i));
+        lua_rawseti(L, -2, i+1);
+    }
+    lua_setfield(L, -2, "fields");
+    lua_setfenv(L, -2);
+}
+
+static LazyResult *
+checkOpenResult (lua_State *L, int index)
+{
+    LazyResult *r = luaL_checkudata(L, index, RESULT_REGNAME);
+    if (!r->result) {
+        luaL_error(L, "result is closed");
+    }
+    return r;
+}
+
+// Push row tuple (from 0) of the result at index.
+static void
+pushLazyRow (lua_State *L, int index, LazyResult *r, int tuple)
+{
+    lua_getfenv(L, index);
+    lua_getfield(L, -1, "fields");
+    lua_remove(L, -2);
+    pushRow(L, r->result, tuple, r->nfields, r->columns, lua_gettop(L), r->getbyarray);
+    lua_remove(L, -2);
+}
+
+// Indexed by a number, returns that row. Otherwise a method, or the field names table.
+static int
+resultIndex (lua_State *L)
+{
+    LazyResult *r = luaL_checkudata(L, 1, RESULT_REGNAME);
+    if (lua_type(L, 2) == LUA_TNUMBER) {
+        int tuple = lua_tointeger(L, 2);
+        checkOpenResult(L, 1);
+        if (tuple >= 1 && tuple <= r->ntuples) {
+            pushLazyRow(L, 1, r, tuple - 1);
+        }
+        else {
+            lua_pushnil(L);
+        }
+    }
+    else if (lua_isstring(L, 2) && strcmp(lua_tostring(L, 2), "fields") == 0) {
+        lua_getfenv(L, 1);
+        lua_getfield(L, -1, "fields");
+    }
+    else {
+        lua_getmetatable(L, 1);
+        lua_pushvalue(L, 2);
+        lua_rawget(L, -2);
+    }
+    return 1;
+}
+
+static int
+resultLen (lua_State *L)
+{
+    LazyResult *r = luaL_checkudata(L, 1, RESULT_REGNAME);
+    lua_pushinteger(L, r->ntuples);
+    return 1;
+}
+
+/* Returns the single value of row and field, where field is a field name or
+ * position, without decoding the rest of the row. */
+static int
+resultValue (lua_State *L)
+{
+    LazyResult *r = checkOpenResult(L, 1);
+    int tuple = luaL_checkint(L, 2) - 1;
+    int field = -1;
+    if (lua_type(L, 3) == LUA_TNUMBER) {
+        field = lua_tointeger(L, 3) - 1;
+    }
+    else {
+        const char *name = luaL_checkstring(L, 3);
+        for (int i = 0; i < r->nfields; i++) {
+            if (strcmp(name, PQfname(r->result, i)) == 0) {
+                field = i;
+                break;
+            }
+        }
+    }
+    if (tuple < 0 || tuple >= r->ntuples || field < 0 || field >= r->nfields) {
+        lua_pushnil(L);
+    }
+    else {
+        pushValue(L, r->result, tuple, field, r->columns + field);
+    }
+    return 1;
+}
+
+static int
+rowsNext (lua_State *L)
+{
+    LazyResult *r = checkOpenResult(L, 1);
+    int tuple = luaL_checkint(L, 2);
+    if (tuple < r->ntuples) {
+        lua_pushinteger(L, tuple + 1);
+        pushLazyRow(L, 1, r, tuple);
+        return 2;
+    }
+    return 0;
+}
+
+/* Returns an iterator over the row positions and rows, in the manner of ipairs. */
+static int
+resultRows (lua_State *L)
+{
+    checkOpenResult(L, 1);
+    lua_pushcfunction(L, rowsNext);
+    lua_pushvalue(L, 1);
+    lua_pushinteger(L, 0);
+    return 3;
+}
+
+/* Releases the result. It may not be read afterwards. */
+static int
+resultClose (lua_State *L)
+{
+    LazyResult *r = luaL_checkudata(L, 1, RESULT_REGNAME);
+    if (r->result) {
+        PQclear(r->result);
+        r->result = NULL;
+        free(r->columns);
+        r->ntuples = 0;
+    }
+    return 0;
+}
+
+static const struct luaL_Reg resultMethods [] = {
+    {"value", resultValue},
+    {"rows", resultRows},
+    {"close", resultClose},
+    {"__index", resultIndex},
+    {"__len", resultLen},
+    {"__gc", resultClose},
+    {NULL, NULL}
+};
+
+void
+registerResult (lua_State *L)
+{
+    luaL_newmetatable(L, RESULT_REGNAME);
+    luaL_register(L, NULL, resultMethods);
+    lua_pop(L, 1);
+}
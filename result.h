@@ -0,0 +1,23 @@
+#ifndef _RESULT_H
+#define _RESULT_H
+
+#include "session.h"
+
+#define RESULT_REGNAME "moonpg.result"
+
+// A query result kept as the PGresult, with values decoded as they are read.
+typedef struct {
+    PGresult *result;
+    int ntuples;
+    int nfields;
+    int getbyarray;
+    ColumnDecoder *columns;
+} LazyResult;
+
+void
+pushLazyResult (lua_State *L, PGresult *result, DBSession *s);
+
+void
+registerResult (lua_State *L);
+
+#endif
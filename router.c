@@ -0,0 +1,484 @@
+#define _POSIX_C_SOURCE 200809L
+#include <ctype.h>
+#include <strings.h>
+#include "router.h"
+#include "stmtcache.h"
+
+#define LAG_QUERY "select pg_is_in_recovery(), " \
+    "extract(epoch from now() - pg_last_xact_replay_timestamp())"
+
+// Weight of the latest command in the moving average of the latency of a replica.
+#define LATENCY_WEIGHT 0.2
+
+typedef enum {
+    routeAuto,
+    routeRead,
+    routeWrite
+} RouteMode;
+
+static Router *
+checkOpenRouter (lua_State *L, int index)
+{
+    Router *r = luaL_checkudata(L, index, ROUTER_REGNAME);
+    if (r->closed) {
+        luaL_error(L, "router is closed");
+    }
+    return r;
+}
+
+// Push the session of the router at index at position i: the primary for 0, or else a replica.
+static DBSession *
+pushRouted (lua_State *L, int index, int i)
+{
+    lua_getfenv(L, index);
+    if (i == 0) {
+        lua_getfield(L, -1, "primary");
+    }
+    else {
+        lua_getfield(L, -1, "replicas");
+        lua_rawgeti(L, -1, i);
+        lua_remove(L, -2);
+    }
+    lua_remove(L, -2);
+    return lua_touserdata(L, -1);
+}
+
+// Connect a session of the router by conninfo, asking libpq for a server in the role given,
+// unless the connection string sets one itself or is a URI.
+static int
+connectRouted (lua_State *L, const char *conninfo, const char *attrs)
+{
+    if (strstr(conninfo, "target_session_attrs") || strstr(conninfo, "://")) {
+        lua_pushstring(L, conninfo);
+    }
+    else {
+        lua_pushfstring(L, "%s target_session_attrs=%s", conninfo, attrs);
+    }
+    int ret = connectSession(L, lua_tostring(L, -1));
+    lua_remove(L, -1 - ret);
+    return ret;
+}
+
+// Skip white space and comments.
+static const char *
+skipSpace (const char *p)
+{
+    for (;;) {
+        while (isspace((unsigned char)*p)) {
+            p++;
+        }
+        if (p[0] == '-' && p[1] == '-') {
+            while (*p != '\n' && *p != '\0') {
+                p++;
+            }
+        }
+        else if (p[0] == '/' && p[1] == '*') {
+            const char *end = strstr(p + 2, "*/");
+            p = end ? end + 2 : p + strlen(p);
+        }
+        else {
+            return p;
+        }
+    }
+}
+
+static int
+isWordChar (char c)
+{
+    return isalnum((unsigned char)c) || c == '_';
+}
+
+// Whether the word at p, of len characters, is word.
+static int
+wordIs (const char *p, size_t len, const char *word)
+{
+    return len == strlen(word) && strncasecmp(p, word, len) == 0;
+}
+
+// Whether command is a single SELECT that only reads: without a locking clause, such as FOR
+// UPDATE, or an INTO clause.
+static int
+readOnlyCommand (const char *command)
+{
+    const char *p = skipSpace(command);
+    if (strncasecmp(p, "select", 6) != 0 || isWordChar(p[6])) {
+        return 0;
+    }
+    const char *prev = NULL;
+    size_t prevLen = 0;
+    while (*p != '\0') {
+        if (*p == '\'' || *p == '"') {
+            char quote = *p++;
+            while (*p != '\0' && *p++ != quote) {
+            }
+        }
+        else if (*p == ';') {
+            if (*skipSpace(p + 1) != '\0') {
+                return 0;
+            }
+            p++;
+        }
+        else if (isWordChar(*p)) {
+            const char *word = p;
+            while (isWordChar(*p)) {
+                p++;
+            }
+            size_t len = p - word;
+            if (wordIs(word, len, "into") || (prev && wordIs(prev, prevLen, "for") &&
+                    (wordIs(word, len, "update") || wordIs(word, len, "share") ||
+                    wordIs(word, len, "no") || wordIs(word, len, "key")))) {
+                return 0;
+            }
+            prev = word;
+            prevLen = len;
+        }
+        else if (p[0] == '-' && p[1] == '-') {
+            p = skipSpace(p);
+        }
+        else {
+            p++;
+        }
+    }
+    return 1;
+}
+
+// Measure the replication lag of the replicas of the router at index, reconnecting any that
+// has lost its connection. Replicas running a command are left for the next check.
+static void
+checkLag (lua_State *L, int index, Router *r)
+{
+    for (int i = 0; i < r->nreplicas; i++) {
+        Replica *rep = r->replicas + i;
+        DBSession *s = pushRouted(L, index, i + 1);
+        lua_pop(L, 1);
+        if (!s->conn) {
+            rep->healthy = 0;
+            continue;
+        }
+        if (PQstatus(s->conn) != CONNECTION_OK) {
+            PQreset(s->conn);
+            resetStatementCache(s);
+        }
+        if (PQstatus(s->conn) != CONNECTION_OK) {
+            rep->healthy = 0;
+            continue;
+        }
+        if (PQtransactionStatus(s->conn) != PQTRANS_IDLE) {
+            continue;
+        }
+        PGresult *result = PQexec(s->conn, LAG_QUERY);
+        rep->healthy = PQresultStatus(result) == PGRES_TUPLES_OK && PQntuples(result) == 1;
+        if (rep->healthy) {
+            // A server that is not in recovery, or has not replayed anything yet, is not behind.
+            int recovery = PQgetvalue(result, 0, 0)[0] == 't';
+            rep->lag = recovery && !PQgetisnull(result, 0, 1) ?
+                strtod(PQgetvalue(result, 0, 1), NULL) : 0;
+        }
+        PQclear(result);
+    }
+    r->lagChecked = monotonicTime();
+}
+
+// Whether replica i, of session s, can take a read: healthy, not too far behind, and not
+// running a command already.
+static int
+replicaAvailable (Router *r, int i, DBSession *s)
+{
+    Replica *rep = r->replicas + i;
+    return rep->healthy && s->conn && PQstatus(s->conn) == CONNECTION_OK &&
+        PQtransactionStatus(s->conn) != PQTRANS_ACTIVE &&
+        (r->maxLag <= 0 || rep->lag <= r->maxLag);
+}
+
+// Choose the session of the router at index for command, and push it. Returns its position:
+// 0 for the primary, or else the replica.
+static int
+routeCommand (lua_State *L, int index, Router *r, const char *command, RouteMode mode)
+{
+    DBSession *primary = pushRouted(L, index, 0);
+    if (mode == routeWrite || r->nreplicas == 0 || (mode == routeAuto &&
+            (!command || PQtransactionStatus(primary->conn) != PQTRANS_IDLE ||
+            !readOnlyCommand(command)))) {
+        return 0;
+    }
+    lua_pop(L, 1);
+    if (monotonicTime() - r->lagChecked >= r->lagInterval) {
+        checkLag(L, index, r);
+    }
+    int chosen = -1;
+    for (int n = 0; n < r->nreplicas; n++) {
+        int i = (r->next + n) % r->nreplicas;
+        DBSession *s = pushRouted(L, index, i + 1);
+        lua_pop(L, 1);
+        if (!replicaAvailable(r, i, s)) {
+            continue;
+        }
+        if (chosen < 0) {
+            chosen = i;
+            if (r->balance == balanceRoundRobin) {
+                break;
+            }
+        }
+        else if (r->replicas[i].latency < r->replicas[chosen].latency) {
+            chosen = i;
+        }
+    }
+    if (chosen < 0) {
+        r->fallbacks++;
+        pushRouted(L, index, 0);
+        return 0;
+    }
+    r->next = (chosen + 1) % r->nreplicas;
+    pushRouted(L, index, chosen + 1);
+    return chosen + 1;
+}
+
+/* Returns a router sending commands that only read to replicas and all the
+ * others to a primary, from a table of options: primary, the connection string
+ * of the primary, replicas, an array of connection strings of the replicas,
+ * balance, "roundrobin" or "least", maxLag, the seconds a replica may be
+ * behind to be sent reads, and lagInterval, the seconds between checks of the
+ * lag. Returns nil and an error message if a connection fails. */
+int
+newRouter (lua_State *L)
+{
+    static const char *const balances[] = {"roundrobin", "least", NULL};
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_settop(L, 1);
+    lua_getfield(L, 1, "primary");
+    lua_getfield(L, 1, "replicas");
+    lua_getfield(L, 1, "balance");
+    lua_getfield(L, 1, "maxLag");
+    lua_getfield(L, 1, "lagInterval");
+    const char *primary = luaL_optstring(L, 2, "");
+    if (!lua_isnil(L, 3)) {
+        luaL_checktype(L, 3, LUA_TTABLE);
+    }
+    Balance balance = luaL_checkoption(L, 4, "roundrobin", balances);
+    lua_Number maxLag = luaL_optnumber(L, 5, 0);
+    lua_Number lagInterval = luaL_optnumber(L, 6, ROUTER_LAG_INTERVAL);
+    int nreplicas = lua_istable(L, 3) ? lua_objlen(L, 3) : 0;
+
+    Router *r = lua_newuserdata(L, sizeof *r);
+    memset(r, 0, sizeof *r);
+    r->balance = balance;
+    r->maxLag = maxLag;
+    r->lagInterval = lagInterval;
+    r->replicas = calloc(MAX(nreplicas, 1), sizeof *r->replicas);
+    if (!r->replicas) {
+        return luaL_error(L, "out of memory");
+    }
+    r->nreplicas = nreplicas;
+    luaL_getmetatable(L, ROUTER_REGNAME);
+    lua_setmetatable(L, -2);
+    int index = lua_gettop(L);
+    lua_createtable(L, 0, 2);
+    lua_setfenv(L, index);
+
+    lua_getfenv(L, index);
+    if (connectRouted(L, primary, "read-write") != 1) {
+        return 2;
+    }
+    lua_setfield(L, -2, "primary");
+    lua_createtable(L, nreplicas, 0);
+    for (int i = 0; i < nreplicas; i++) {
+        lua_rawgeti(L, 3, i + 1);
+        const char *conninfo = lua_tostring(L, -1);
+        if (!conninfo) {
+            return luaL_error(L, "connection string of replica %d is not a string", i + 1);
+        }
+        if (connectRouted(L, conninfo, "prefer-standby") != 1) {
+            return 2;
+        }
+        lua_rawseti(L, -3, i + 1);
+        lua_pop(L, 1);
+        r->replicas[i].healthy = 1;
+    }
+    lua_setfield(L, -2, "replicas");
+    lua_pop(L, 1);
+    return 1;
+}
+
+// Run the command at index 2, with its parameters after it, on the session chosen for it by
+// mode, as the run method of the session. A read that fails on a replica that has lost its
+// connection is run again on the primary.
+static int
+routerRunMode (lua_State *L, RouteMode mode)
+{
+    Router *r = checkOpenRouter(L, 1);
+    const char *command = luaL_checkstring(L, 2);
+    int nargs = lua_gettop(L) - 1;
+    int target = routeCommand(L, 1, r, command, mode);
+    for (;;) {
+        int base = lua_gettop(L);
+        DBSession *s = lua_touserdata(L, base);
+        double start = monotonicTime();
+        lua_getfield(L, base, "run");
+        lua_pushvalue(L, base);
+        for (int i = 2; i <= nargs + 1; i++) {
+            lua_pushvalue(L, i);
+        }
+        lua_call(L, nargs + 1, LUA_MULTRET);
+        if (target == 0) {
+            r->primaryCommands++;
+            return lua_gettop(L) - base;
+        }
+        Replica *rep = r->replicas + target - 1;
+        rep->commands++;
+        if (!lua_isboolean(L, base + 1) || lua_toboolean(L, base + 1) ||
+                (s->conn && PQstatus(s->conn) == CONNECTION_OK)) {
+            double latency = monotonicTime() - start;
+            rep->latency = rep->commands == 1 ? latency :
+                rep->latency + LATENCY_WEIGHT * (latency - rep->latency);
+            return lua_gettop(L) - base;
+        }
+        rep->healthy = 0;
+        r->fallbacks++;
+        lua_settop(L, nargs + 1);
+        pushRouted(L, 1, 0);
+        target = 0;
+    }
+}
+
+/* Runs a command, with any parameter values, as run of a connection would. A
+ * single SELECT that does not lock rows is sent to a replica, unless the
+ * primary is in a transaction, and any other command to the primary. */
+static int
+routerRun (lua_State *L)
+{
+    return routerRunMode(L, routeAuto);
+}
+
+/* Runs a command on a replica, as marked to only read. */
+static int
+routerRead (lua_State *L)
+{
+    return routerRunMode(L, routeRead);
+}
+
+/* Runs a command on the primary. */
+static int
+routerWrite (lua_State *L)
+{
+    return routerRunMode(L, routeWrite);
+}
+
+/* Returns the connection that run would send command to, and its position:
+ * 0 for the primary, or else the position of the replica. Without a command,
+ * returns the primary. */
+static int
+routerRoute (lua_State *L)
+{
+    Router *r = checkOpenRouter(L, 1);
+    const char *command = luaL_optstring(L, 2, NULL);
+    lua_settop(L, 2);
+    lua_pushinteger(L, routeCommand(L, 1, r, command, routeAuto));
+    return 2;
+}
+
+/* Measures the replication lag of the replicas at once, and returns an array
+ * of the seconds each is behind, with false for a replica that is down. */
+static int
+routerCheckLag (lua_State *L)
+{
+    Router *r = checkOpenRouter(L, 1);
+    lua_settop(L, 1);
+    checkLag(L, 1, r);
+    lua_createtable(L, r->nreplicas, 0);
+    for (int i = 0; i < r->nreplicas; i++) {
+        if (r->replicas[i].healthy) {
+            lua_pushnumber(L, r->replicas[i].lag);
+        }
+        else {
+            lua_pushboolean(L, 0);
+        }
+        lua_rawseti(L, -2, i + 1);
+    }
+    return 1;
+}
+
+/* Returns a table of the counts of the router, with a table per replica. */
+static int
+routerStats (lua_State *L)
+{
+    Router *r = luaL_checkudata(L, 1, ROUTER_REGNAME);
+    lua_createtable(L, 0, 3);
+    lua_pushnumber(L, r->primaryCommands);
+    lua_setfield(L, -2, "primary");
+    lua_pushnumber(L, r->fallbacks);
+    lua_setfield(L, -2, "fallbacks");
+    lua_createtable(L, r->nreplicas, 0);
+    for (int i = 0; i < r->nreplicas; i++) {
+        Replica *rep = r->replicas + i;
+        lua_createtable(L, 0, 4);
+        lua_pushnumber(L, rep->commands);
+        lua_setfield(L, -2, "commands");
+        lua_pushnumber(L, rep->lag);
+        lua_setfield(L, -2, "lag");
+        lua_pushnumber(L, rep->latency);
+        lua_setfield(L, -2, "latency");
+        lua_pushboolean(L, rep->healthy);
+        lua_setfield(L, -2, "healthy");
+        lua_rawseti(L, -2, i + 1);
+    }
+    lua_setfield(L, -2, "replicas");
+    return 1;
+}
+
+/* Closes the connections of the primary and the replicas. */
+static int
+routerClose (lua_State *L)
+{
+    Router *r = luaL_checkudata(L, 1, ROUTER_REGNAME);
+    if (r->closed) {
+        return 0;
+    }
+    r->closed = 1;
+    lua_settop(L, 1);
+    for (int i = 0; i <= r->nreplicas; i++) {
+        pushRouted(L, 1, i);
+        if (lua_isuserdata(L, -1)) {
+            lua_getfield(L, -1, "close");
+            lua_insert(L, -2);
+            lua_call(L, 1, 0);
+        }
+        else {
+            lua_pop(L, 1);
+        }
+    }
+    return 0;
+}
+
+static int
+routerGC (lua_State *L)
+{
+    Router *r = luaL_checkudata(L, 1, ROUTER_REGNAME);
+    // The sessions are closed by their own collection.
+    free(r->replicas);
+    r->replicas = NULL;
+    r->nreplicas = 0;
+    r->closed = 1;
+    return 0;
+}
+
+static const struct luaL_Reg routerMethods [] = {
+    {"run", routerRun},
+    {"read", routerRead},
+    {"write", routerWrite},
+    {"route", routerRoute},
+    {"checkLag", routerCheckLag},
+    {"stats", routerStats},
+    {"close", routerClose},
+    {"__gc", routerGC},
+    {NULL, NULL}
+};
+
+void
+registerRouter (lua_State *L)
+{
+    luaL_newmetatable(L, ROUTER_REGNAME);
+    luaL_register(L, NULL, routerMethods);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+}
@@ -0,0 +1,44 @@
+#ifndef _ROUTER_H
+#define _ROUTER_H
+
+#include "session.h"
+
+#define ROUTER_REGNAME "moonpg.router"
+
+// Seconds between checks of the replication lag of the replicas, by default.
+#define ROUTER_LAG_INTERVAL 5
+
+typedef enum {
+    balanceRoundRobin,
+    balanceLeastBusy
+} Balance;
+
+// The state of a replica of a router, as last measured.
+typedef struct {
+    double lag;         // Seconds behind the primary.
+    double latency;     // Moving average of the seconds taken by its commands.
+    int healthy;
+    unsigned long commands;
+} Replica;
+
+// A primary session and its replicas, that commands are routed to by whether they only read.
+typedef struct {
+    int nreplicas;
+    Replica *replicas;
+    int next;           // The next replica in turn.
+    Balance balance;
+    double maxLag;      // Replicas further behind are left out, if set.
+    double lagInterval;
+    double lagChecked;  // Time of the last check of the lag.
+    unsigned long primaryCommands;
+    unsigned long fallbacks;    // Reads sent to the primary for want of a replica.
+    int closed;
+} Router;
+
+int
+newRouter (lua_State *L);
+
+void
+registerRouter (lua_State *L);
+
+#endif
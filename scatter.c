@@ -0,0 +1,230 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include "scatter.h"
+
+// Get the session at position i of the sessions table at index.
+static DBSession *
+shardSession (lua_State *L, int index, int i)
+{
+    lua_rawgeti(L, index, i);
+    DBSession *s = lua_touserdata(L, -1);
+    if (!s || !lua_getmetatable(L, -1)) {
+        luaL_error(L, "shard %d is not a connection", i);
+    }
+    luaL_getmetatable(L, SES_REGNAME);
+    if (!lua_rawequal(L, -1, -2)) {
+        luaL_error(L, "shard %d is not a connection", i);
+    }
+    lua_pop(L, 3);
+    if (!s->conn) {
+        luaL_error(L, "shard %d is closed", i);
+    }
+    return s;
+}
+
+// Read what has arrived for the command of shard.
+static void
+readShard (Shard *sh)
+{
+    if (readCommandResults(sh->sess->conn, &sh->result)) {
+        sh->busy = 0;
+    }
+}
+
+// Wait on the sockets of all the shards until they have all returned their results.
+static void
+gatherShards (lua_State *L, Shard *shards, int nshards)
+{
+    struct pollfd fds[nshards];
+    int owners[nshards];
+    for (;;) {
+        int nfds = 0;
+        for (int i = 0; i < nshards; i++) {
+            Shard *sh = shards + i;
+            if (sh->busy && pollCommand(sh->sess->conn, fds + nfds)) {
+                owners[nfds++] = i;
+            }
+            else if (sh->busy) {
+                readShard(sh);
+            }
+        }
+        if (nfds == 0) {
+            return;
+        }
+        if (poll(fds, nfds, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            for (int i = 0; i < nshards; i++) {
+                PQclear(shards[i].result);
+            }
+            luaL_error(L, "poll failed: %s", strerror(errno));
+        }
+        for (int f = 0; f < nfds; f++) {
+            if (fds[f].revents) {
+                readShard(shards + owners[f]);
+            }
+        }
+    }
+}
+
+// Push the rows of the query results of the shards as one result table, in shard order.
+// Returns 0, with nothing pushed, if the results do not have the same number of fields.
+static int
+mergeRows (lua_State *L, Shard *shards, int nshards)
+{
+    PGresult *first = NULL;
+    int total = 0;
+    for (int i = 0; i < nshards; i++) {
+        PGresult *result = shards[i].result;
+        if (PQresultStatus(result) != PGRES_TUPLES_OK) {
+            continue;
+        }
+        if (!first) {
+            first = result;
+        }
+        else if (PQnfields(result) != PQnfields(first)) {
+            return 0;
+        }
+        total += PQntuples(result);
+    }
+    int nf = PQnfields(first);
+    ColumnDecoder columns[MAX(nf, 1)];
+
+    lua_createtable(L, total, 1); // Result table
+    lua_createtable(L, nf, 0); // Field names table
+    for (int j = 0; j < nf; j++) {
+        lua_pushstring(L, PQfname(first, j));
+        lua_rawseti(L, -2, j+1);
+    }
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -3, "fields");
+    int namesIndex = lua_gettop(L);
+    int n = 0;
+    for (int i = 0; i < nshards; i++) {
+        PGresult *result = shards[i].result;
+        if (PQresultStatus(result) != PGRES_TUPLES_OK) {
+            continue;
+        }
+        // Each shard decodes its values by its own session options.
+        resolveColumns(result, shards[i].sess->typeMap, columns);
+        for (int t = 0, nt = PQntuples(result); t < nt; t++) {
+            pushRow(L, result, t, nf, columns, namesIndex, shards[0].sess->getbyarray);
+            lua_rawseti(L, namesIndex - 1, ++n);
+        }
+    }
+    lua_pop(L, 1);
+    return 1;
+}
+
+/* Sends a command to all the connections of the sessions array at once, and
+ * waits for all of them. The parameters are either the values given after the
+ * command, sent to every connection, or a single table of an array of values
+ * per connection. Returns the rows of all the connections merged into one
+ * result table, in the order of the sessions, or for a command returning no
+ * rows, the number of rows affected on all of them. Returns false and an
+ * error message if the command failed on any connection. */
+int
+scatterQuery (lua_State *L)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+    const char *command = luaL_checkstring(L, 2);
+    int nshards = lua_objlen(L, 1);
+    luaL_argcheck(L, nshards > 0, 1, "no connections given");
+    int nargs = lua_gettop(L) - 2;
+    int perShard = nargs == 1 && lua_istable(L, 3);
+    Shard shards[nshards];
+    ParamSet params[nshards];
+    int counts[nshards];
+
+    // Gather the parameters of all the shards before sending, as that may raise an error.
+    for (int i = 0; i < nshards; i++) {
+        Shard *sh = shards + i;
+        sh->sess = shardSession(L, 1, i + 1);
+        sh->result = NULL;
+        sh->busy = 0;
+        int offset = 3;
+        counts[i] = nargs;
+        if (perShard) {
+            lua_rawgeti(L, 3, i + 1);
+            if (!lua_istable(L, -1) && !lua_isnil(L, -1)) {
+                return luaL_error(L, "parameters of shard %d are not a table", i + 1);
+            }
+            offset = lua_gettop(L) + 1;
+            counts[i] = lua_istable(L, -1) ? lua_objlen(L, -1) : 0;
+            luaL_checkstack(L, counts[i] + 4, "too many parameters");
+            for (int p = 1; p <= counts[i]; p++) {
+                lua_rawgeti(L, offset - 1, p);
+            }
+        }
+        parametersFromStack(L, counts[i], offset, sh->sess->binaryParams, NULL, 0, params + i);
+    }
+    for (int i = 0; i < nshards; i++) {
+        Shard *sh = shards + i;
+        ParamSet *ps = params + i;
+        sh->busy = PQsendQueryParams(sh->sess->conn, command, counts[i], ps->types, ps->values,
+            ps->lengths, ps->formats, sh->sess->binary);
+    }
+    gatherShards(L, shards, nshards);
+
+    int failed = -1, rows = 0;
+    double affected = 0;
+    for (int i = nshards - 1; i >= 0; i--) {
+        ExecStatusType status = PQresultStatus(shards[i].result);
+        if (status == PGRES_TUPLES_OK) {
+            rows = 1;
+        }
+        else if (status == PGRES_COMMAND_OK) {
+            affected += atoi(PQcmdTuples(shards[i].result));
+        }
+        else {
+            failed = i;
+        }
+    }
+    int ret = 1;
+    if (failed >= 0) {
+        PGresult *result = shards[failed].result;
+        lua_pushboolean(L, 0);
+        lua_pushfstring(L, "shard %d: %s", failed + 1,
+            result ? PQresultErrorMessage(result) : PQerrorMessage(shards[failed].sess->conn));
+        ret = 2;
+    }
+    else if (!rows) {
+        lua_pushnumber(L, affected);
+    }
+    else if (!mergeRows(L, shards, nshards)) {
+        lua_pushboolean(L, 0);
+        lua_pushliteral(L, "shards returned different fields");
+        ret = 2;
+    }
+    for (int i = 0; i < nshards; i++) {
+        PQclear(shards[i].result);
+    }
+    return ret;
+}
+
+/* Returns the session of the sessions array that a key belongs to, by a hash
+ * of the key, and its position. A number key belongs where its text does. */
+int
+shardFor (lua_State *L)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+    int nshards = lua_objlen(L, 1);
+    luaL_argcheck(L, nshards > 0, 1, "no connections given");
+    char num[32];
+    size_t len;
+    const char *key;
+    if (lua_type(L, 2) == LUA_TNUMBER) {
+        len = numberText(lua_tonumber(L, 2), num);
+        key = num;
+    }
+    else {
+        key = luaL_checklstring(L, 2, &len);
+    }
+    int i = fnv1a(key, len) % nshards + 1;
+    lua_rawgeti(L, 1, i);
+    lua_pushinteger(L, i);
+    return 2;
+}
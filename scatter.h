@@ -0,0 +1,19 @@
+#ifndef _SCATTER_H
+#define _SCATTER_H
+
+#include "session.h"
+
+// A session a scattered command is sent to, and the result it returned.
+typedef struct {
+    DBSession *sess;
+    PGresult *result;   // The last result, or the first error.
+    int busy;           // Results are still to be read.
+} Shard;
+
+int
+scatterQuery (lua_State *L);
+
+int
+shardFor (lua_State *L);
+
+#endif
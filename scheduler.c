@@ -0,0 +1,336 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <poll.h>
+#include "scheduler.h"
+
+#define ERROR_TIMED_OUT "Command timed out"
+
+static Scheduler *
+checkScheduler (lua_State *L, int index)
+{
+    return luaL_checkudata(L, index, SCHEDULER_REGNAME);
+}
+
+/* Returns a scheduler for running commands from coroutines concurrently. A
+ * command that takes longer than timeout seconds, if given, is canceled. */
+int
+newScheduler (lua_State *L)
+{
+    lua_Number timeout = luaL_optnumber(L, 1, 0);
+    Scheduler *sc = lua_newuserdata(L, sizeof *sc);
+    sc->tasks = NULL;
+    sc->ntasks = 0;
+    sc->size = 0;
+    sc->timeout = timeout;
+    sc->looping = 0;
+    luaL_getmetatable(L, SCHEDULER_REGNAME);
+    lua_setmetatable(L, -2);
+    // The environment keeps the coroutines of the tasks, keyed by their states.
+    lua_newtable(L);
+    lua_setfenv(L, -2);
+    return 1;
+}
+
+// Get the task of the coroutine L, which must be the one being run by the scheduler.
+static Task *
+currentTask (lua_State *L, Scheduler *sc)
+{
+    for (int i = 0; i < sc->ntasks; i++) {
+        if (sc->tasks[i].co == L && sc->tasks[i].state == taskRunning) {
+            return sc->tasks + i;
+        }
+    }
+    luaL_error(L, "not called from a task of the scheduler");
+    return NULL;
+}
+
+// Drop the finished task i, releasing its coroutine. The scheduler is at index.
+static void
+endTask (lua_State *L, int index, Scheduler *sc, int i)
+{
+    Task *t = sc->tasks + i;
+    PQclear(t->result);
+    t->result = NULL;
+    t->state = taskDone;
+    lua_getfenv(L, index);
+    lua_pushlightuserdata(L, t->co);
+    lua_pushnil(L);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+}
+
+static void
+compactTasks (Scheduler *sc)
+{
+    int n = 0;
+    for (int i = 0; i < sc->ntasks; i++) {
+        if (sc->tasks[i].state != taskDone) {
+            sc->tasks[n++] = sc->tasks[i];
+        }
+    }
+    sc->ntasks = n;
+}
+
+// Make task t ready, to be resumed with the return values of its command.
+static void
+completeCommand (Task *t)
+{
+    PGresult *result = t->result;
+    t->result = NULL;
+    t->nargs = processResultStatus(t->co, result,
+        result ? PQresultStatus(result) : PGRES_FATAL_ERROR, t->sess);
+    t->state = taskReady;
+    t->deadline = 0;
+}
+
+// Read what has arrived for the command of task t, completing it once all its results are in.
+static void
+readResults (Task *t)
+{
+    if (readCommandResults(t->sess->conn, &t->result)) {
+        completeCommand(t);
+    }
+}
+
+// Cancel the command of task t, which has run out of time, and discard its results.
+static void
+cancelCommand (Task *t)
+{
+    PGconn *conn = t->sess->conn;
+    PGcancel *cancel = PQgetCancel(conn);
+    PGresult *result;
+    char err[256];
+    if (cancel) {
+        PQcancel(cancel, err, sizeof err);
+        PQfreeCancel(cancel);
+    }
+    while ((result = PQgetResult(conn))) {
+        PQclear(result);
+    }
+    PQclear(t->result);
+    t->result = NULL;
+    lua_pushboolean(t->co, 0);
+    lua_pushliteral(t->co, ERROR_TIMED_OUT);
+    t->nargs = 2;
+    t->state = taskReady;
+    t->deadline = 0;
+}
+
+// Resume the ready task i. Returns 0, with the error message pushed, if the task raised an
+// error.
+static int
+resumeTask (lua_State *L, Scheduler *sc, int i)
+{
+    lua_State *co = sc->tasks[i].co;
+    sc->tasks[i].state = taskRunning;
+    int status = lua_resume(co, sc->tasks[i].nargs);
+    // New tasks may have moved the array.
+    Task *t = sc->tasks + i;
+    if (status == LUA_YIELD) {
+        // A yield not made by the scheduler only passes the turn to the other tasks.
+        if (t->state == taskRunning) {
+            lua_settop(co, 0);
+            t->state = taskReady;
+            t->nargs = 0;
+        }
+        return 1;
+    }
+    if (status != 0) {
+        lua_xmove(co, L, 1);
+        endTask(L, 1, sc, i);
+        return 0;
+    }
+    endTask(L, 1, sc, i);
+    return 1;
+}
+
+// Wait for the sockets of the commands and the deadlines of the tasks, and make the tasks
+// whose commands are complete, or whose time is up, ready.
+static void
+waitTasks (lua_State *L, Scheduler *sc)
+{
+    struct pollfd fds[sc->ntasks];
+    int owners[sc->ntasks];
+    int nfds = 0, wait = -1;
+    double now = monotonicTime();
+
+    for (int i = 0; i < sc->ntasks; i++) {
+        Task *t = sc->tasks + i;
+        if (t->state == taskReady) {
+            wait = 0;
+        }
+        if (t->deadline > 0) {
+            int ms = t->deadline > now ? (int)((t->deadline - now) * 1000) + 1 : 0;
+            wait = wait < 0 ? ms : (ms < wait ? ms : wait);
+        }
+        if (t->state == taskQuery && pollCommand(t->sess->conn, fds + nfds)) {
+            owners[nfds++] = i;
+        }
+        else if (t->state == taskQuery) {
+            // The connection is gone, which completes the command with its error.
+            readResults(t);
+            wait = 0;
+        }
+    }
+    if (nfds == 0 && wait < 0) {
+        return;
+    }
+    if (poll(fds, nfds, wait) < 0 && errno != EINTR) {
+        sc->looping = 0;
+        luaL_error(L, "poll failed: %s", strerror(errno));
+    }
+    for (int f = 0; f < nfds; f++) {
+        if (fds[f].revents) {
+            readResults(sc->tasks + owners[f]);
+        }
+    }
+    now = monotonicTime();
+    for (int i = 0; i < sc->ntasks; i++) {
+        Task *t = sc->tasks + i;
+        if (t->deadline > 0 && t->deadline <= now) {
+            if (t->state == taskQuery) {
+                cancelCommand(t);
+            }
+            else if (t->state == taskSleep) {
+                t->state = taskReady;
+                t->nargs = 0;
+                t->deadline = 0;
+            }
+        }
+    }
+}
+
+/* Adds a task running the function fn with the arguments given, once loop is
+ * called, or at once if the scheduler is running. */
+static int
+schedulerSpawn (lua_State *L)
+{
+    Scheduler *sc = checkScheduler(L, 1);
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+    int nargs = lua_gettop(L) - 2;
+    if (sc->ntasks == sc->size) {
+        int size = MAX(sc->size * 2, 8);
+        Task *tasks = realloc(sc->tasks, size * sizeof *tasks);
+        if (!tasks) {
+            return luaL_error(L, "out of memory");
+        }
+        sc->tasks = tasks;
+        sc->size = size;
+    }
+    lua_State *co = lua_newthread(L);
+    lua_getfenv(L, 1);
+    lua_pushlightuserdata(L, co);
+    lua_pushvalue(L, -3);
+    lua_rawset(L, -3);
+    lua_pop(L, 2);
+    lua_xmove(L, co, nargs + 1);
+
+    Task *t = sc->tasks + sc->ntasks++;
+    t->co = co;
+    t->state = taskReady;
+    t->nargs = nargs;
+    t->sess = NULL;
+    t->result = NULL;
+    t->deadline = 0;
+    return 0;
+}
+
+/* Runs the tasks until they have all returned. An error raised by a task is
+ * raised again here, leaving the other tasks to be continued by calling loop
+ * again. */
+static int
+schedulerLoop (lua_State *L)
+{
+    Scheduler *sc = checkScheduler(L, 1);
+    if (sc->looping) {
+        return luaL_error(L, "scheduler is already running");
+    }
+    sc->looping = 1;
+    while (sc->ntasks > 0) {
+        for (int i = 0; i < sc->ntasks; i++) {
+            if (sc->tasks[i].state == taskReady && !resumeTask(L, sc, i)) {
+                compactTasks(sc);
+                sc->looping = 0;
+                return lua_error(L);
+            }
+        }
+        compactTasks(sc);
+        if (sc->ntasks > 0) {
+            waitTasks(L, sc);
+        }
+    }
+    sc->looping = 0;
+    return 0;
+}
+
+/* Called from a task, sends the command to a connection or prepared object as
+ * its asyncRun method would, and suspends the task until the command is
+ * complete. Returns what run would return. */
+static int
+schedulerRun (lua_State *L)
+{
+    Scheduler *sc = checkScheduler(L, 1);
+    Task *t = currentTask(L, sc);
+    DBSession *s = checkSessionOrPrep(L, 2, NULL);
+    for (int i = 0; i < sc->ntasks; i++) {
+        if (sc->tasks[i].state == taskQuery && sc->tasks[i].sess->conn == s->conn) {
+            return luaL_error(L, "connection is busy with a command of another task");
+        }
+    }
+    lua_getfield(L, 2, "asyncRun");
+    lua_insert(L, 2);
+    lua_call(L, lua_gettop(L) - 2, 2);
+    if (!lua_toboolean(L, -2)) {
+        return 2;
+    }
+    t->state = taskQuery;
+    t->sess = s;
+    t->result = NULL;
+    t->deadline = sc->timeout > 0 ? monotonicTime() + sc->timeout : 0;
+    return lua_yield(L, 0);
+}
+
+/* Called from a task, suspends it for the seconds given, letting the other
+ * tasks run. */
+static int
+schedulerSleep (lua_State *L)
+{
+    Scheduler *sc = checkScheduler(L, 1);
+    lua_Number seconds = luaL_checknumber(L, 2);
+    Task *t = currentTask(L, sc);
+    t->state = taskSleep;
+    t->deadline = monotonicTime() + (seconds > 0 ? seconds : 0);
+    return lua_yield(L, 0);
+}
+
+static int
+schedulerGC (lua_State *L)
+{
+    Scheduler *sc = checkScheduler(L, 1);
+    for (int i = 0; i < sc->ntasks; i++) {
+        PQclear(sc->tasks[i].result);
+    }
+    free(sc->tasks);
+    sc->tasks = NULL;
+    sc->ntasks = 0;
+    return 0;
+}
+
+static const struct luaL_Reg schedulerMethods [] = {
+    {"spawn", schedulerSpawn},
+    {"loop", schedulerLoop},
+    {"run", schedulerRun},
+    {"sleep", schedulerSleep},
+    {"__gc", schedulerGC},
+    {NULL, NULL}
+};
+
+void
+registerScheduler (lua_State *L)
+{
+    luaL_newmetatable(L, SCHEDULER_REGNAME);
+    luaL_register(L, NULL, schedulerMethods);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+}
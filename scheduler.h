@@ -0,0 +1,41 @@
+#ifndef _SCHEDULER_H
+#define _SCHEDULER_H
+
+#include "session.h"
+
+#define SCHEDULER_REGNAME "moonpg.scheduler"
+
+typedef enum {
+    taskReady,      // To be resumed with the values on its stack.
+    taskRunning,
+    taskQuery,      // Waiting for the result of a command.
+    taskSleep,
+    taskDone
+} TaskState;
+
+// A coroutine run by a scheduler.
+typedef struct {
+    lua_State *co;
+    TaskState state;
+    int nargs;          // Values on the stack of a ready task, to resume it with.
+    DBSession *sess;    // The session or prepared object of a command being waited for.
+    PGresult *result;   // The result kept so far, of the last command or the first error.
+    double deadline;    // When a sleep ends or a command times out, or 0 for never.
+} Task;
+
+// Coroutines whose commands are multiplexed over the sockets of their connections.
+typedef struct {
+    Task *tasks;
+    int ntasks;
+    int size;
+    double timeout;     // Seconds a command may take, or 0 for no limit.
+    int looping;
+} Scheduler;
+
+int
+newScheduler (lua_State *L);
+
+void
+registerScheduler (lua_State *L);
+
+#endif
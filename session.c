@@ -1,5 +1,65 @@
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
 #include "session.h"
 #include "geotypes.h"
+#include "binary.h"
+#include "result.h"
+#include "stmtcache.h"
+#include "vector.h"
+#include "parallel.h"
+#include "stats.h"
+#include "trace.h"
+#include "explain.h"
+
+// Set the options of a session back to their defaults.
+void
+resetSessionOptions (DBSession *s)
+{
+    s->getbyarray = 0;
+    s->binary = 0;
+    s->binaryParams = 0;
+    s->lazy = 0;
+    s->columnar = 0;
+    s->decodeThreads = 0;
+    freeTypeMap(s->typeMap);
+    s->typeMap = NULL;
+}
+
+// Push a new session connected by the connection string cinfo, or nil and an error message.
+int
+connectSession (lua_State *L, const char *cinfo)
+{
+    DBSession *sess = lua_newuserdata(L, sizeof(DBSession));
+    sess->conn = PQconnectdb(cinfo);
+    sess->sid = 1;
+    sess->paramTypes = NULL;
+    sess->nparams = 0;
+    sess->cache = NULL;
+    sess->typeMap = NULL;
+    sess->columns = NULL;
+    sess->ncolumns = 0;
+    sess->decoded = NULL;
+    sess->ndecoded = 0;
+    sess->stats = NULL;
+    sess->trace = NULL;
+    sess->explain = NULL;
+    sess->rowMode = 0;
+    resetSessionOptions(sess);
+
+    if (PQstatus(sess->conn) != CONNECTION_OK) {
+        lua_pushnil(L);
+        lua_pushfstring(L, ERROR_CONNECTION_FAILED, PQerrorMessage(sess->conn));
+        PQfinish(sess->conn);
+        sess->conn = NULL;
+        return 2;
+    }
+
+    // Set the metatable of this user data.
+    luaL_getmetatable(L, SES_REGNAME);
+    lua_setmetatable(L, -2);
+    return 1;
+}
 
 static int
 close (lua_State *L)
@@ -9,9 +69,19 @@ close (lua_State *L)
         PQfinish(s->conn);
         s->conn = NULL;
     }
-    if (s->typeMapString) {
-        free(s->typeMapString);
-    }
+    freeTypeMap(s->typeMap);
+    s->typeMap = NULL;
+    free(s->columns);
+    s->columns = NULL;
+    s->ncolumns = 0;
+    freeDecoded(s);
+    freeSessionStats(s->stats);
+    s->stats = NULL;
+    freeTrace(s->trace);
+    s->trace = NULL;
+    freeExplainStore(s->explain);
+    s->explain = NULL;
+    freeStatementCache(s);
     return 0;
 }
 
@@ -38,86 +108,130 @@ toString (lua_State *L)
     return 1;
 }
 
-// Parse the array value items. The string position is initially on the opening brace.
-// Return a pointer to the current character position in value. (for recursive calls)
-static char *
-pushArray (lua_State *L, int typeOID, char *value)
+// Push an element of a text array from its text, of len characters, as a value of the
+// element type of the array.
+static void
+pushArrayElement (lua_State *L, int typeOID, const char *text, size_t len)
+{
+    switch (typeOID) {
+        case intA2OID:
+        case intA4OID:
+        case intA8OID:
+            lua_pushnumber(L, (lua_Number)strtoll(text, NULL, 10));
+            break;
+        case floatA4OID:
+        case floatA8OID:
+            lua_pushnumber(L, strtod(text, NULL));
+            break;
+        case boolAOID:
+            lua_pushboolean(L, text[0] == 't');
+            break;
+        default:
+            lua_pushlstring(L, text, len);
+    }
+}
+
+// Parse the array value items in a single pass, without changing the value. The position
+// is initially on the opening brace. Returns the position past the closing brace.
+static const char *
+pushArrayItems (lua_State *L, int typeOID, const char *p)
 {
-    char *point; // Beginning of element value.
-    int inQuote = 0;
     int index = 1;
-    int itemLen;
-    
-    point = ++value; // Scoot past the initial open brace.
     lua_newtable(L);
-    while (*value != '\0') {
-        // Item end check
-        if (((*value == ',' || *value == '}') && !inQuote) || (*value == '"' && inQuote)) {
-            itemLen = value - point;
-            // Convert a true NULL value to Lua nil
-            if (!inQuote && itemLen == 4 && stringNamedNull(point)) {
-                lua_pushnil(L);
+    if (*++p == '}') {
+        return p + 1;
+    }
+    while (*p != '\0') {
+        if (*p == '{') {    // An inner array.
+            p = pushArrayItems(L, typeOID, p);
+        }
+        else if (*p == '"') {
+            const char *start = ++p;
+            while (*p != '"' && *p != '\\' && *p != '\0') {
+                p++;
             }
-            else { 
-                lua_pushlstring(L, point, itemLen);
-                const char *v = lua_tostring(L, -1);
-                switch (typeOID) {
-                    case intA2OID:
-                    case intA4OID:
-                    case intA8OID:  
-                        lua_pushnumber(L, atoi(v));
-                        break;
-                    case floatA4OID:
-                    case floatA8OID:
-                        lua_pushnumber(L, strtod(v, NULL));
-                        break;
-                    case boolAOID:
-                        lua_pushboolean(L, strcmp(v, "t") == 0 ? 1 : 0);
-                        break;
+            if (*p != '\\') {
+                pushArrayElement(L, typeOID, start, p - start);
+            }
+            else {
+                // Gather the unescaped element, from the first escape.
+                luaL_Buffer b;
+                luaL_buffinit(L, &b);
+                luaL_addlstring(&b, start, p - start);
+                while (*p != '"' && *p != '\0') {
+                    if (*p == '\\' && p[1] != '\0') {
+                        p++;
+                    }
+                    luaL_addchar(&b, *p++);
                 }
-                // If an accurate typed value was pushed, replace the string value.
-                if (lua_type(L, -1) != LUA_TSTRING) {
-                    lua_replace(L, -2);
+                luaL_pushresult(&b);
+                if (typeOID == boolAOID || typeOID == intA2OID || typeOID == intA4OID ||
+                        typeOID == intA8OID || typeOID == floatA4OID || typeOID == floatA8OID) {
+                    size_t len;
+                    const char *text = lua_tolstring(L, -1, &len);
+                    pushArrayElement(L, typeOID, text, len);
+                    lua_remove(L, -2);
                 }
             }
-            lua_rawseti(L, -2, index++);
-            if (inQuote) {  // Move past the ending double quote.
-                inQuote = 0;
-                value++;
+            if (*p == '"') {
+                p++;
             }
-            if (*value == '}') {
-                return value;
-            }
-            point = ++value;
         }
-        else if (inQuote) {
-            // Handle the escapes
-            if (*value == '\\') {
-                memmove(value, value + 1, strlen(value));
+        else {
+            const char *start = p;
+            while (*p != ',' && *p != '}' && *p != '\0') {
+                p++;
             }
-            value++;
-        }
-        else if (*value == '{') {   // An inner array.
-            value = pushArray(L, typeOID, value);
-            lua_rawseti(L, -2, index++);
-            value++;
-            if (*value == ',') {
-                point = ++value;
+            // Convert a true NULL value to Lua nil
+            if (p - start == 4 && stringNamedNull(start)) {
+                lua_pushnil(L);
             }
-            else if (*value == '}') {
-                return value;
+            else {
+                pushArrayElement(L, typeOID, start, p - start);
             }
         }
-        // Beginning quote, reset point.
-        else if (*value == '"') {
-            inQuote = 1;
-            point = ++value;
+        lua_rawseti(L, -2, index++);
+        if (*p != ',') {
+            return *p == '}' ? p + 1 : p;
         }
-        else {
-            value++;
+        p++;
+    }
+    return p;
+}
+
+// Push an array value as a table. Any dimension decoration, given for lower bounds other
+// than 1, is skipped since the Lua table is indexed from 1.
+static void
+pushArray (lua_State *L, int typeOID, const char *value)
+{
+    if (*value == '[') {
+        const char *brace = strchr(value, '{');
+        value = brace ? brace : value + strlen(value);
+    }
+    if (*value == '{') {
+        pushArrayItems(L, typeOID, value);
+    }
+    else {
+        lua_newtable(L);
+    }
+}
+
+// Get the parameter types of the prepared statement, needed for binary parameters.
+// The types are left unknown if the statement can not be described.
+static void
+describeParams (lua_State *L, DBSession *s)
+{
+    lua_pushnumber(L, s->sid);
+    PGresult *result = PQdescribePrepared(s->conn, lua_tostring(L, -1));
+    lua_pop(L, 1);
+    if (PQresultStatus(result) == PGRES_COMMAND_OK) {
+        s->nparams = PQnparams(result);
+        s->paramTypes = malloc(MAX(s->nparams, 1) * sizeof *s->paramTypes);
+        for (int i = 0; i < s->nparams; i++) {
+            s->paramTypes[i] = PQparamtype(result, i);
         }
     }
-    return value;
+    PQclear(result);
 }
 
 // Returns a new prepare object on success.
@@ -130,9 +244,30 @@ processPrepareStatus (lua_State *L, ExecStatusType status, DBSession *sess)
         preps->conn = sess->conn;
         preps->sid = sess->sid++;
         preps->getbyarray = 0;
-        preps->typeMapString = NULL;
+        preps->binary = sess->binary;
+        preps->binaryParams = sess->binaryParams;
+        preps->lazy = sess->lazy;
+        preps->columnar = sess->columnar;
+        preps->paramTypes = NULL;
+        preps->nparams = 0;
+        preps->cache = NULL;
+        preps->typeMap = NULL;
+        preps->columns = NULL;
+        preps->ncolumns = 0;
+        preps->decodeThreads = sess->decodeThreads;
+        preps->decoded = NULL;
+        preps->ndecoded = 0;
+        preps->stats = NULL;
+        preps->trace = NULL;
+        preps->explain = NULL;
+        preps->rowMode = 0;
         luaL_getmetatable(L, SESPREP_REGNAME);
         lua_setmetatable(L, -2);
+        // Keep the session, for deallocating the statement when the object is collected.
+        lua_createtable(L, 0, 1);
+        lua_pushvalue(L, 1);
+        lua_setfield(L, -2, "session");
+        lua_setfenv(L, -2);
     }
     else {
         // Else an error condition
@@ -151,6 +286,7 @@ prepare (lua_State *L)
     ExecStatusType status = 0;
     PGresult *result;
 
+    flushDeallocations(s, 0);
     // Convert the sid to a string 
     lua_pushnumber(L, s->sid);
     const char *sname = lua_tostring(L, -1);
@@ -161,7 +297,18 @@ prepare (lua_State *L)
         status = PQresultStatus(result);
         PQclear(result);
     }
-    return processPrepareStatus(L, status, s);
+    int ret = processPrepareStatus(L, status, s);
+    if (status == PGRES_COMMAND_OK) {
+        // Keep the command, by which the statement is counted in the session statistics.
+        lua_getfenv(L, -1);
+        lua_pushvalue(L, 2);
+        lua_setfield(L, -2, "command");
+        lua_pop(L, 1);
+    }
+    if (status == PGRES_COMMAND_OK && s->binaryParams) {
+        describeParams(L, lua_touserdata(L, -1));
+    }
+    return ret;
 }
 
 static int
@@ -184,136 +331,377 @@ getPrepared (lua_State *L)
     }
 }
 
-static int
-setTypeMap (lua_State *L)
+void
+freeTypeMap (TypeMap *map)
 {
-    DBSession *s = luaL_checkudata(L, 1, SES_REGNAME);
-    const char *str = luaL_checkstring(L, 2);
-    s->typeMapString = malloc(strlen(str));
-    strcpy(s->typeMapString, str);
-    return 0;
+    if (map) {
+        for (int i = 0; i < map->count; i++) {
+            free(map->fields[i]);
+        }
+        free(map->fields);
+        free(map->mappings);
+        free(map);
+    }
 }
 
-// Push the value of tuple, field.
-static void
-pushValue (lua_State *L, PGresult *result, int tuple, int field, PGtype columnType, char *paramType)
+static const struct {
+    const char *name;
+    TypeMapping mapping;
+} mappingNames [] = {
+    {"String", mapString},
+    {"Array", mapArray},
+    {"Point", mapPoint},
+    {"Line", mapLine},
+    {"Box", mapBox},
+    {"Path", mapPath},
+    {"Polygon", mapPolygon},
+    {"Circle", mapCircle},
+    {"Vector", mapVector},
+    {NULL, mapDefault}
+};
+
+// Compile a type map string of comma separated fieldName:Type options.
+// Raises an error for an option that is malformed or names an unknown type.
+static TypeMap *
+compileTypeMap (lua_State *L, const char *str)
 {
-    char *value;
-    if (PQgetisnull(result, tuple, field)) {
-        lua_pushnil(L);
+    int count = 1;
+    for (const char *p = str; *p; p++) {
+        if (*p == ',') {
+            count++;
+        }
     }
-    else {
-        value = PQgetvalue(result, tuple, field);
-        if (paramType) {
-            // To explicitly keep as a string, numeric values that may overflow.
-            if (strcmp(paramType, "String") == 0) {
-                lua_pushstring(L, value);
-            }
-            // A special type is designated for this column.
-            else if (strcmp(paramType, "Array") == 0) {
-                pushArray(L, columnType, value);
-            }
-            // Geometric types
-            else if (strcmp(paramType, "Point") == 0) {
-                pushGeoPoint(L, value);
-            }
-            else if (strcmp(paramType, "Line") == 0) {
-                pushGeoLine(L, value);
-            }
-            else if (strcmp(paramType, "Box") == 0) {
-                pushGeoBox(L, value);
-            }
-            else if (strcmp(paramType, "Path") == 0) {
-                pushGeoPath(L, value);
+    TypeMap *map = malloc(sizeof *map);
+    if (map) {
+        map->count = 0;
+        map->fields = malloc(count * sizeof *map->fields);
+        map->mappings = malloc(count * sizeof *map->mappings);
+    }
+    if (!map || !map->fields || !map->mappings) {
+        freeTypeMap(map);
+        luaL_error(L, "out of memory");
+    }
+    for (const char *option = str; option; ) {
+        const char *end = strchr(option, ',');
+        size_t len = end ? (size_t)(end - option) : strlen(option);
+        const char *sep = memchr(option, ':', len);
+        if (len > 0) {
+            int m = 0;
+            while (sep && mappingNames[m].name && (strlen(mappingNames[m].name) !=
+                    (size_t)(option + len - sep - 1) ||
+                    strncmp(sep + 1, mappingNames[m].name, option + len - sep - 1) != 0)) {
+                m++;
             }
-            else if (strcmp(paramType, "Polygon") == 0) {
-                pushGeoPolygon(L, value);
+            if (!sep || !mappingNames[m].name) {
+                freeTypeMap(map);
+                lua_pushlstring(L, option, len);
+                luaL_error(L, "Invalid type map option '%s'", lua_tostring(L, -1));
             }
-            else if (strcmp(paramType, "Circle") == 0) {
-                pushGeoCircle(L, value);
+            char *field = malloc(sep - option + 1);
+            if (!field) {
+                freeTypeMap(map);
+                luaL_error(L, "out of memory");
             }
-            else {
-                lua_pushstring(L, value);
+            memcpy(field, option, sep - option);
+            field[sep - option] = '\0';
+            map->fields[map->count] = field;
+            map->mappings[map->count++] = mappingNames[m].mapping;
+        }
+        option = end ? end + 1 : NULL;
+    }
+    return map;
+}
+
+/* Set the special Lua representations of the values of named fields, for all
+ * the results of the session or prepared statement until it is set again.
+ * Without a map string, values are returned by default again. */
+static int
+setTypeMap (lua_State *L)
+{
+    DBSession *s = checkSessionOrPrep(L, 1, NULL);
+    const char *str = luaL_optstring(L, 2, NULL);
+    TypeMap *map = str ? compileTypeMap(L, str) : NULL;
+    freeTypeMap(s->typeMap);
+    s->typeMap = map;
+    return 0;
+}
+
+// The decoders of values in the text format, by representation.
+
+static void
+decodeString (lua_State *L, char *value, int len, PGtype type, TypeMapping mapping)
+{
+    lua_pushlstring(L, value, len);
+}
+
+static void
+decodeInteger (lua_State *L, char *value, int len, PGtype type, TypeMapping mapping)
+{
+    lua_pushnumber(L, (lua_Number)strtoll(value, NULL, 10));
+}
+
+static void
+decodeFloat (lua_State *L, char *value, int len, PGtype type, TypeMapping mapping)
+{
+    lua_pushnumber(L, strtod(value, NULL));
+}
+
+static void
+decodeBool (lua_State *L, char *value, int len, PGtype type, TypeMapping mapping)
+{
+    lua_pushboolean(L, value[0] == 't');
+}
+
+static void
+decodeArray (lua_State *L, char *value, int len, PGtype type, TypeMapping mapping)
+{
+    pushArray(L, type, value);
+}
+
+static void
+decodePoint (lua_State *L, char *value, int len, PGtype type, TypeMapping mapping)
+{
+    pushGeoPoint(L, value);
+}
+
+static void
+decodeLine (lua_State *L, char *value, int len, PGtype type, TypeMapping mapping)
+{
+    pushGeoLine(L, value);
+}
+
+static void
+decodeBox (lua_State *L, char *value, int len, PGtype type, TypeMapping mapping)
+{
+    pushGeoBox(L, value);
+}
+
+static void
+decodePath (lua_State *L, char *value, int len, PGtype type, TypeMapping mapping)
+{
+    pushGeoPath(L, value);
+}
+
+static void
+decodePolygon (lua_State *L, char *value, int len, PGtype type, TypeMapping mapping)
+{
+    pushGeoPolygon(L, value);
+}
+
+static void
+decodeCircle (lua_State *L, char *value, int len, PGtype type, TypeMapping mapping)
+{
+    pushGeoCircle(L, value);
+}
+
+static void
+decodeBinary (lua_State *L, char *value, int len, PGtype type, TypeMapping mapping)
+{
+    pushBinaryValue(L, value, len, type, mapping);
+}
+
+// Choose the decoders of the columns of result, by their format, type and any mapping of
+// their names in map.
+void
+resolveColumns (PGresult *result, const TypeMap *map, ColumnDecoder *columns)
+{
+    static const ValueDecoder mapped[] = {
+        [mapString] = decodeString,
+        [mapArray] = decodeArray,
+        [mapPoint] = decodePoint,
+        [mapLine] = decodeLine,
+        [mapBox] = decodeBox,
+        [mapPath] = decodePath,
+        [mapPolygon] = decodePolygon,
+        [mapCircle] = decodeCircle
+    };
+    int nf = PQnfields(result);
+    for (int i = 0; i < nf; i++) {
+        ColumnDecoder *c = columns + i;
+        c->type = PQftype(result, i);
+        c->mapping = mapDefault;
+        c->decoded = NULL;
+        if (map) {
+            const char *fname = PQfname(result, i);
+            for (int m = 0; m < map->count; m++) {
+                if (strcmp(fname, map->fields[m]) == 0) {
+                    c->mapping = map->mappings[m];
+                    break;
+                }
             }
         }
+        if (PQfformat(result, i) == 1) {
+            c->decode = decodeBinary;
+        }
+        else if (c->mapping != mapDefault && c->mapping != mapVector) {
+            c->decode = mapped[c->mapping];
+        }
         else {
-            switch (columnType) {
+            switch (c->type) {
                 case int2OID:
                 case int4OID:
                 case int8OID:
-                    lua_pushnumber(L, atoi(value));
+                    c->decode = decodeInteger;
                     break;
                 case float4OID:
                 case float8OID:
                 case numericOID:
-                    lua_pushnumber(L, strtod(value, NULL));
+                    c->decode = decodeFloat;
                     break;
                 case boolOID:
-                    lua_pushboolean(L, strcmp(value, "t") == 0 ? 1 : 0);
+                    c->decode = decodeBool;
                     break;
                 default:
-                    lua_pushstring(L, value);
+                    c->decode = decodeString;
             }
         }
     }
 }
 
-static void
-clearTypeMap (char **ptypes, int length)
+// Get the session's buffer for the decoders of nf columns.
+static ColumnDecoder *
+sessionColumns (lua_State *L, DBSession *s, int nf)
+{
+    if (nf > s->ncolumns) {
+        ColumnDecoder *columns = realloc(s->columns, nf * sizeof *columns);
+        if (!columns) {
+            luaL_error(L, "out of memory");
+        }
+        s->columns = columns;
+        s->ncolumns = nf;
+    }
+    return s->columns;
+}
+
+// Push the value of tuple, field.
+void
+pushValue (lua_State *L, PGresult *result, int tuple, int field, const ColumnDecoder *column)
+{
+    if (PQgetisnull(result, tuple, field)) {
+        lua_pushnil(L);
+    }
+    else if (column->decoded && column->type == boolOID) {
+        lua_pushboolean(L, column->decoded[tuple] != 0);
+    }
+    else if (column->decoded) {
+        lua_pushnumber(L, column->decoded[tuple]);
+    }
+    else {
+        column->decode(L, PQgetvalue(result, tuple, field), PQgetlength(result, tuple, field),
+            column->type, column->mapping);
+    }
+}
+
+// Push a table of the values of tuple. The values are keyed by the field names in the table at
+// namesIndex, or by field position if byArray is set.
+void
+pushRow (lua_State *L, PGresult *result, int tuple, int nf, const ColumnDecoder *columns,
+    int namesIndex, int byArray)
 {
-    char *t;
-    for (int i = 0; i < length; i++) {
-        t = ptypes[i];
-        if (t) {
-            free(t);
+    if (!byArray) {
+        lua_createtable(L, 0, nf);
+        for (int j = 0; j < nf; j++) {
+            lua_rawgeti(L, namesIndex, j+1);
+            pushValue(L, result, tuple, j, columns + j);
+            lua_rawset(L, -3);
+        }
+    }
+    else {
+        lua_createtable(L, nf, 0);
+        for (int j = 0; j < nf; j++) {
+            pushValue(L, result, tuple, j, columns + j);
+            lua_rawseti(L, -2, j+1);
         }
     }
 }
 
-// Helper function to parse the option between the inner separator into field_name/Type option.
+// Push the values of result as a table of column arrays, in field order and by field name
+// in its columns table. A null value is left as a hole in its column. A numeric column
+// mapped to a Vector is pushed as a native vector instead.
 static void
-innerOption (const char *b, int nfields, char **cnames, char **ptypes)
-{
-    char *sep = strchr(b, ':');
-    if (sep) {
-        // If the field name matches a results field, then the results field position in the array
-        // gets the type option value.
-        for (int i = 0; i < nfields; i++) {
-            if (strncmp(b, cnames[i], sep - b) == 0) {
-                char **spadd = ptypes + i;
-                *spadd = malloc(strlen(sep));
-                strcpy(*spadd, sep + 1);
+pushColumns (lua_State *L, PGresult *result, DBSession *s)
+{
+    int nt = PQntuples(result);
+    int nf = PQnfields(result);
+    ColumnDecoder *columns = sessionColumns(L, s, nf);
+    resolveColumns(result, s->typeMap, columns);
+    decodeParallel(result, columns, s);
+
+    lua_createtable(L, nf, 3); // Result table
+    lua_createtable(L, nf, 0); // Field names table
+    lua_createtable(L, 0, nf); // Columns by field name
+    for (int j = 0; j < nf; j++) {
+        const char *name = PQfname(result, j);
+        lua_pushstring(L, name);
+        lua_rawseti(L, -3, j+1);
+        if (columns[j].mapping == mapVector && isVectorType(columns[j].type)) {
+            pushVector(L, result, j);
+        }
+        else {
+            lua_createtable(L, nt, 0);
+            for (int i = 0; i < nt; i++) {
+                if (!PQgetisnull(result, i, j)) {
+                    pushValue(L, result, i, j, columns + j);
+                    lua_rawseti(L, -2, i+1);
+                }
             }
         }
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, -5, j+1);
+        lua_setfield(L, -2, name);
     }
+    lua_setfield(L, -3, "columns");
+    lua_setfield(L, -2, "fields");
+    lua_pushinteger(L, nt);
+    lua_setfield(L, -2, "count");
+    PQclear(result);
 }
 
-static void
-parseTypeMap(const char *typeMapString, int nfields, char **cnames, char **ptypes)
-{
-    char *sep;
-    char buf[100];
-    int span, moreOptions = 1;
-    // Parsing on special named fields.
-    while (moreOptions) {
-        sep = strchr(typeMapString, ',');
-        if (sep) {
-            span = sep - typeMapString;
-            strncpy(buf, typeMapString, span);
-            buf[span] = '\0';
-            typeMapString += span + 1;
-            innerOption(buf, nfields, cnames, ptypes);
+// Read what has arrived for a command sent on conn, without blocking. The last result is kept
+// in result, unless an earlier one is an error, as PQexec would return. Returns 1 once all the
+// results are in, with result NULL if the connection failed, or 0 while more are to come.
+int
+readCommandResults (PGconn *conn, PGresult **result)
+{
+    if (!PQconsumeInput(conn)) {
+        PQclear(*result);
+        *result = NULL;
+        return 1;
+    }
+    while (!PQisBusy(conn)) {
+        PGresult *next = PQgetResult(conn);
+        if (!next) {
+            return 1;
+        }
+        ExecStatusType status = *result ? PQresultStatus(*result) : PGRES_COMMAND_OK;
+        if (status == PGRES_COMMAND_OK || status == PGRES_TUPLES_OK) {
+            PQclear(*result);
+            *result = next;
         }
         else {
-            // At the end.
-            innerOption(typeMapString, nfields, cnames, ptypes);
-            moreOptions = 0;
+            PQclear(next);
         }
     }
+    return 0;
 }
-    
 
-static int
+// Set pfd to wait on the socket of conn for the results of a command, and for the rest of
+// the command to be sent. Returns 0 if the connection has no socket, so that reading its
+// results ends the command with its error instead.
+int
+pollCommand (PGconn *conn, struct pollfd *pfd)
+{
+    if (PQsocket(conn) < 0) {
+        return 0;
+    }
+    pfd->fd = PQsocket(conn);
+    pfd->events = POLLIN | (PQflush(conn) == 1 ? POLLOUT : 0);
+    pfd->revents = 0;
+    return 1;
+}
+
+// Push the return values of a command result, as returned by run.
+int
 processResultStatus (lua_State *L, PGresult *result, ExecStatusType status, DBSession *s)
 {
     int ret = 1;
@@ -322,59 +710,42 @@ processResultStatus (lua_State *L, PGresult *result, ExecStatusType status, DBSe
         lua_pushnumber(L, atoi(PQcmdTuples(result)));
         PQclear(result);
     }
+    else if (status == PGRES_TUPLES_OK && s->lazy) {
+        // The result is kept, to be decoded as it is read.
+        pushLazyResult(L, result, s);
+    }
+    else if (status == PGRES_TUPLES_OK && s->columnar) {
+        pushColumns(L, result, s);
+    }
     else if (status == PGRES_TUPLES_OK) {
         // Create a table with all the result data
         int nt = PQntuples(result);
         int nf = PQnfields(result);
-        PGtype columnTypes[nf];
-        char *columnNames[nf];
-        char *paramTypes[nf];
+        ColumnDecoder *columns = sessionColumns(L, s, nf);
 
         lua_createtable(L, nt, 1); // Result table
         lua_createtable(L, nf, 0); // Field names table
 
         for(int i = 0; i < nf; i++) {
-            char *fname = PQfname(result, i);
-            columnTypes[i] = PQftype(result, i);
-            columnNames[i] = fname;
-            paramTypes[i] = 0; // To initialize
-            lua_pushstring(L, fname);
+            lua_pushstring(L, PQfname(result, i));
             lua_rawseti(L, -2, i+1);
         }
+        resolveColumns(result, s->typeMap, columns);
+        decodeParallel(result, columns, s);
 
-        if (s->typeMapString) {
-            parseTypeMap(s->typeMapString, nf, columnNames, paramTypes);
-        }
-
-        // Insert the fieldNames table into the result table.
-        lua_pushstring(L, "fields");
+        // Insert the fieldNames table into the result table, keeping it on the stack for
+        // pushing the field names of each tuple.
+        lua_pushvalue(L, -1);
+        lua_setfield(L, -3, "fields");
         lua_insert(L, -2);
-        lua_rawset(L, -3);
+        int namesIndex = lua_gettop(L) - 1;
         // Inset the tuples into the result table.
         for (int i = 0; i < nt; i++) {
-            if (!s->getbyarray) {
-                lua_createtable(L, 0, nf);
-                for (int j = 0; j < nf; j++) {
-                    lua_pushstring(L, columnNames[j]);
-                    pushValue(L, result, i, j, columnTypes[j], paramTypes[j]); 
-                    lua_rawset(L, -3);
-                }
-            }
-            else {
-                lua_createtable(L, nf, 0);
-                for (int j = 0; j < nf; j++) {
-                    pushValue(L, result, i, j, columnTypes[j], paramTypes[j]); 
-                    lua_rawseti(L, -2, j+1);
-                }
-            }
+            pushRow(L, result, i, nf, columns, namesIndex, s->getbyarray);
             lua_rawseti(L, -2, i+1);
         }
-
-        if (s->typeMapString) {
-            clearTypeMap(paramTypes, nf);
-            free(s->typeMapString);
-            s->typeMapString = NULL;
-        }
+        lua_remove(L, namesIndex);
+        PQclear(result);
     }
     else {
         // Else an error condition.
@@ -390,9 +761,20 @@ static int
 getResult (lua_State *L)
 {
     DBSession *s = luaL_checkudata(L, 1, SES_REGNAME);
+    double start = s->trace ? monotonicTime() : 0;
     PGresult *result = PQgetResult(s->conn);
     // A non-null result indicates a command result to be returned.
-    if (result) {
+    if (result && s->trace) {
+        StatementSample sample;
+        double received = monotonicTime();
+        sampleResult(result, &sample);
+        int ret = processResultStatus(L, result, sample.status, s);
+        sample.latency = received - start;
+        sample.decode = monotonicTime() - received;
+        traceCall(s->trace, traceGetResult, s->trace->pending, 0, start, 0, &sample);
+        return ret;
+    }
+    else if (result) {
         return processResultStatus(L, result, PQresultStatus(result), s);
     }
     // Null pointer status indicates no more results.
@@ -413,6 +795,45 @@ processResult (lua_State *L, PGresult *result, DBSession *s)
     return processResultStatus(L, result, status, s);
 }
 
+// Process the result of command, run from the time start with nparams parameters ps, counting
+// it in the statistics and the trace of owner, the session it was run on, and explaining it if
+// slow, as kept. The statement is traced by sid if prepared.
+static int
+processTimedResult (lua_State *L, PGresult *result, DBSession *s, DBSession *owner,
+    TraceKind kind, unsigned int sid, int nparams, const ParamSet *ps, const char *command,
+    double start)
+{
+    if (!owner || (!owner->stats && !owner->trace && !owner->explain)) {
+        return processResult(L, result, s);
+    }
+    StatementSample sample;
+    double received = monotonicTime();
+    sampleResult(result, &sample);
+    int ret = processResult(L, result, s);
+    sample.latency = received - start;
+    sample.decode = monotonicTime() - received;
+    if (owner->stats) {
+        recordStatement(owner->stats, command, &sample);
+    }
+    if (owner->trace) {
+        traceCall(owner->trace, kind, traceStatement(command, sid), nparams, start, 0, &sample);
+    }
+    if (owner->explain) {
+        explainSlow(owner->explain, s->conn, command, nparams, ps, sample.latency);
+    }
+    return ret;
+}
+
+// Trace a command sent by asyncRun from the time start, if the trace of owner is kept.
+static void
+traceSend (DBSession *owner, unsigned int sid, int nparams, const char *command, double start)
+{
+    if (owner && owner->trace) {
+        traceCall(owner->trace, traceAsyncRun, traceStatement(command, sid), nparams, start,
+            monotonicTime() - start, NULL);
+    }
+}
+
 // Here, a return value of 1 indicates success and a return value of 0 indicates error.
 static int
 processReturn (lua_State *L, int rvalue, PGconn * conn)
@@ -442,38 +863,112 @@ asyncPrepare (lua_State *L)
     return processReturn(L, PQsendPrepare(s->conn, sName, query, 0, NULL), s->conn);
 }
 
-// Get the string representation of the parameter at stack position pos.
-// Check for return of NULL indicating non-string parameter.
-static const char *
-getPFS (lua_State *L, int pos)
+// Set parameter i to the binary format of the value at stack position pos, for a parameter
+// of type target, or of a type chosen from the Lua value if target is 0.
+// Returns 0 if the value has no binary format for that type.
+static int
+binaryParameter (lua_State *L, int pos, Oid target, ParamSet *ps, int i, char *scalar)
 {
-    // If a special value embedded in userdata
-    if (lua_isuserdata(L, pos)) {
-        ParamConvert *pconv = lua_touserdata(L, pos);
-        pconv->convert(L, pconv->tref);
-        return lua_tostring(L, -1);
+    int len = 0;
+    switch (lua_type(L, pos)) {
+        case LUA_TNUMBER: {
+            lua_Number n = lua_tonumber(L, pos);
+            if (target == 0) {
+                target = numberBinary(n, int8OID, scalar) ? int8OID : float8OID;
+            }
+            len = numberBinary(n, target, scalar);
+            ps->values[i] = scalar;
+            break;
+        }
+        case LUA_TBOOLEAN:
+            if (target == 0 || target == boolOID) {
+                target = boolOID;
+                scalar[0] = lua_toboolean(L, pos);
+                len = 1;
+                ps->values[i] = scalar;
+            }
+            break;
+        case LUA_TUSERDATA: {
+            ParamConvert *pconv = toParamConvert(L, pos);
+            if (pconv && (target = pconv->encode(L, pos, target))) {
+                size_t slen;
+                ps->values[i] = lua_tolstring(L, -1, &slen);
+                len = slen;
+            }
+            break;
+        }
     }
-    else {
-        return lua_tostring(L, pos);
+    if (len) {
+        ps->types[i] = target;
+        ps->lengths[i] = len;
+        ps->formats[i] = 1;
     }
+    return len;
 }
-    
-static const char **
-parametersFromStack (lua_State *L, int count, int offset)
+
+// Gather the count parameter arguments from stack position offset on.
+// With binaryParams set, numbers, booleans and arrays of them are sent in the binary format,
+// typed by the parameter types in targets if given, or else by their Lua type.
+// The text of the array parameters is written into one buffer shared by all of them.
+// The storage for the parameters is left on the stack.
+void
+parametersFromStack (lua_State *L, int count, int offset, int binaryParams, const Oid *targets,
+    int ntargets, ParamSet *ps)
 {
-    const char **pvals = malloc(count * sizeof *pvals);
     const char *s;
+    TextBuffer text;
+    text.slot = 0;
+    // One block for the arrays and an eight byte slot per parameter for binary scalars.
+    char *block = lua_newuserdata(L, count * (sizeof *ps->values + 8 + sizeof *ps->types +
+        sizeof *ps->lengths + sizeof *ps->formats));
+    char (*scalars)[8];
+    ps->values = (const char **)block;
+    scalars = (char (*)[8])(ps->values + count);
+    ps->types = (Oid *)(scalars + count);
+    ps->lengths = (int *)(ps->types + count);
+    ps->formats = ps->lengths + count;
+
     // Gather all parameter arguments
     for (int i = 0; i < count; i++) {
-        s = getPFS(L, i + offset);
+        ps->types[i] = 0;
+        ps->lengths[i] = 0;
+        ps->formats[i] = 0;
+        if (binaryParams &&
+                binaryParameter(L, i + offset, i < ntargets ? targets[i] : 0, ps, i, scalars[i])) {
+            continue;
+        }
+        ParamConvert *pconv = toParamConvert(L, i + offset);
+        if (pconv) {
+            // The text may move as the buffer grows, so its offset is kept in the length
+            // until all the parameters are gathered.
+            if (!text.slot) {
+                textBufferInit(L, &text);
+            }
+            ps->lengths[i] = text.len;
+            pconv->convert(L, i + offset, &text);
+            textBufferAdd(L, &text, "", 1);
+            ps->values[i] = NULL;
+            continue;
+        }
+        if (binaryParams && lua_isboolean(L, i + offset)) {
+            s = lua_toboolean(L, i + offset) ? "t" : "f";
+        }
+        else {
+            s = lua_tostring(L, i + offset);
+        }
         if (s) {
-            pvals[i] = s;
+            ps->values[i] = s;
         }
         else {
             luaL_error(L, "Not a valid parameter at position %i", i);
         }
     }
-    return pvals;
+    for (int i = 0; text.slot && i < count; i++) {
+        if (!ps->values[i]) {
+            ps->values[i] = text.data + ps->lengths[i];
+            ps->lengths[i] = 0;
+        }
+    }
 }
 
 static int
@@ -483,28 +978,50 @@ runG (lua_State *L, int type)
     const char *command = luaL_checkstring(L, 2);
     int nargs = lua_gettop(L);
     int ret;
-    if (nargs == 2) {
+    double start = s->stats || s->trace || s->explain ? monotonicTime() : 0;
+    if (nargs == 2 && !s->binary) {
         if (type == 1) {
-            ret = processResult(L, PQexec(s->conn, command), s);
+            ret = processTimedResult(L, PQexec(s->conn, command), s, s, traceRun, 0, 0, NULL,
+                command, start);
         }
         else {
-            ret = processReturn(L, PQsendQuery(s->conn, command), s->conn);
+            int sent = PQsendQuery(s->conn, command);
+            traceSend(s, 0, 0, command, start);
+            ret = processReturn(L, sent, s->conn);
         }
     }
     else {
         int pc = nargs - 2;
-        const char **pValues = parametersFromStack(L, pc, 3);
-        if (type == 1) {
-            ret = processResult(L,
-                PQexecParams(s->conn, command, pc, NULL, pValues, NULL, NULL, 0),
-                s);
+        ParamSet ps;
+        PGresult *failed = NULL;
+        CachedStatement *cs = type == 1 ? cachedStatement(s, command, &failed) : NULL;
+        if (failed) {
+            parametersFromStack(L, pc, 3, s->binaryParams, NULL, 0, &ps);
+            ret = processTimedResult(L, failed, s, s, traceRun, 0, pc, &ps, command, start);
+        }
+        else if (cs) {
+            char sname[16];
+            sprintf(sname, "%u", cs->sid);
+            parametersFromStack(L, pc, 3, s->binaryParams && cs->paramTypes, cs->paramTypes,
+                cs->nparams, &ps);
+            ret = processTimedResult(L,
+                PQexecPrepared(s->conn, sname, pc, ps.values, ps.lengths, ps.formats, s->binary),
+                s, s, traceRun, 0, pc, &ps, command, start);
+        }
+        else if (type == 1) {
+            parametersFromStack(L, pc, 3, s->binaryParams, NULL, 0, &ps);
+            ret = processTimedResult(L,
+                PQexecParams(s->conn, command, pc, ps.types, ps.values, ps.lengths, ps.formats,
+                    s->binary),
+                s, s, traceRun, 0, pc, &ps, command, start);
         }
         else {
-            ret = processReturn(L,
-                PQsendQueryParams(s->conn, command, pc, NULL, pValues, NULL, NULL, 0),
-                s->conn);
+            parametersFromStack(L, pc, 3, s->binaryParams, NULL, 0, &ps);
+            int sent = PQsendQueryParams(s->conn, command, pc, ps.types, ps.values, ps.lengths,
+                ps.formats, s->binary);
+            traceSend(s, 0, pc, command, start);
+            ret = processReturn(L, sent, s->conn);
         }
-        free(pValues);
     }
     return ret;
 }
@@ -526,24 +1043,35 @@ runGPrepared (lua_State *L, int type)
 {
     DBSession *s = luaL_checkudata(L, 1, SESPREP_REGNAME);
     int pc = lua_gettop(L) - 1;
-    const char **pValues = parametersFromStack(L, pc, 2);
+    ParamSet ps;
     int ret;
 
+    // Binary parameters need the statement's parameter types, so they are sent as text if
+    // the statement was not described.
+    parametersFromStack(L, pc, 2, s->binaryParams && s->paramTypes, s->paramTypes, s->nparams, &ps);
+
     // Convert the sid to a string 
     lua_pushnumber(L, s->sid);
     const char *sname = lua_tostring(L, -1);
 
+    // The statement is counted in the statistics and trace of its session, by its command.
+    lua_getfenv(L, 1);
+    lua_getfield(L, -1, "session");
+    DBSession *sess = lua_touserdata(L, -1);
+    lua_getfield(L, -2, "command");
+    const char *command = lua_isstring(L, -1) ? lua_tostring(L, -1) : STATS_PREPARED;
+    double start = sess && (sess->stats || sess->trace || sess->explain) ? monotonicTime() : 0;
     if (type == 1) {
-        ret = processResult(L,
-            PQexecPrepared(s->conn, sname, pc, pValues, NULL, NULL, 0),
-            s);
+        ret = processTimedResult(L,
+            PQexecPrepared(s->conn, sname, pc, ps.values, ps.lengths, ps.formats, s->binary),
+            s, sess, traceRunPrepared, s->sid, pc, &ps, command, start);
     }
     else {
-        ret = processReturn(L,
-            PQsendQueryPrepared(s->conn, sname, pc, pValues, NULL, NULL, 0),
-            s->conn);
+        int sent = PQsendQueryPrepared(s->conn, sname, pc, ps.values, ps.lengths, ps.formats,
+            s->binary);
+        traceSend(sess, s->sid, pc, command, start);
+        ret = processReturn(L, sent, s->conn);
     }
-    free(pValues);
     return ret;
 }
 
@@ -555,17 +1083,113 @@ arrayKeys (lua_State *L)
     s->getbyarray = lua_toboolean(L, 2);
     return 0;
 }
+
+// Check for either a session or a prepared statement object at index.
+// If isPrep is given, it is set to whether the object is a prepared statement.
+DBSession *
+checkSessionOrPrep (lua_State *L, int index, int *isPrep)
+{
+    int prep = 0;
+    if (lua_getmetatable(L, index)) {
+        luaL_getmetatable(L, SESPREP_REGNAME);
+        prep = lua_rawequal(L, -1, -2);
+        lua_pop(L, 2);
+    }
+    if (isPrep) {
+        *isPrep = prep;
+    }
+    return prep ? lua_touserdata(L, index) : luaL_checkudata(L, index, SES_REGNAME);
+}
+
+/* Request results in the binary format, decoded natively by column type.
+ * Set on a session, this applies to the statements it prepares afterwards,
+ * and may be set separately on a prepared statement.
+ * Default without an argument is a value of true. */
+static int
+binaryResults (lua_State *L)
+{
+    DBSession *s = checkSessionOrPrep(L, 1, NULL);
+    s->binary = (lua_gettop(L) < 2 || lua_toboolean(L, 2)) ? 1 : 0;
+    return 0;
+}
+
+/* Send numbers, booleans and arrays of them as binary parameters.
+ * Parameters of a statement run directly are typed as bigint, double precision
+ * or boolean. A prepared statement is described to send its parameters in the
+ * types the server expects.
+ * Default without an argument is a value of true. */
+static int
+binaryParams (lua_State *L)
+{
+    int isPrep;
+    DBSession *s = checkSessionOrPrep(L, 1, &isPrep);
+    s->binaryParams = (lua_gettop(L) < 2 || lua_toboolean(L, 2)) ? 1 : 0;
+    if (isPrep && s->binaryParams && !s->paramTypes) {
+        describeParams(L, s);
+    }
+    return 0;
+}
+
+/* Return query results as result objects that keep the server result and
+ * decode rows and values only as they are read, instead of as tables.
+ * Default without an argument is a value of true. */
+static int
+lazyResults (lua_State *L)
+{
+    DBSession *s = checkSessionOrPrep(L, 1, NULL);
+    s->lazy = (lua_gettop(L) < 2 || lua_toboolean(L, 2)) ? 1 : 0;
+    return 0;
+}
+
+/* Return query results as a table of one array of values per column, instead
+ * of a table per row. A null value is a nil hole in its column array.
+ * Default without an argument is a value of true. */
+static int
+columnarResults (lua_State *L)
+{
+    DBSession *s = checkSessionOrPrep(L, 1, NULL);
+    s->columnar = (lua_gettop(L) < 2 || lua_toboolean(L, 2)) ? 1 : 0;
+    return 0;
+}
+
+static int
+prepGC (lua_State *L)
+{
+    DBSession *s = luaL_checkudata(L, 1, SESPREP_REGNAME);
+    // Deallocate the statement with the next batch of the session.
+    if (s->sid) {
+        lua_getfenv(L, 1);
+        lua_getfield(L, -1, "session");
+        DBSession *sess = lua_touserdata(L, -1);
+        if (sess && sess->conn) {
+            queueDeallocate(sess, s->sid);
+        }
+        s->sid = 0;
+    }
+    if (s->paramTypes) {
+        free(s->paramTypes);
+        s->paramTypes = NULL;
+    }
+    freeTypeMap(s->typeMap);
+    s->typeMap = NULL;
+    free(s->columns);
+    s->columns = NULL;
+    freeDecoded(s);
+    return 0;
+}
     
 static int
 deallocatePrepared (lua_State *L)
 {
     DBSession *s = luaL_checkudata(L, 1, SESPREP_REGNAME);
-    // Convert the sid to a string 
-    lua_pushnumber(L, s->sid);
-    const char *values[1];
-    values[0] = lua_tostring(L, -1);
+    // DEALLOCATE takes no parameters, so the name goes in the command.
+    char command[32];
+    sprintf(command, "DEALLOCATE \"%u\"", s->sid);
 
-    PGresult *res = PQexecParams(s->conn, "DEALLOCATE $1", 1, NULL, values, NULL, NULL, 0);
+    PGresult *res = PQexec(s->conn, command);
+    if (PQresultStatus(res) == PGRES_COMMAND_OK) {
+        s->sid = 0;
+    }
     return processResult(L, res, s);
 }
 
@@ -639,18 +1263,27 @@ flush (lua_State *L)
     }
 }
 
+// Push a table of the channel name, sending process id and payload of notify, and free it.
+static void
+pushNotify (lua_State *L, PGnotify *notify)
+{
+    lua_createtable(L, 0, 3);
+    lua_pushstring(L, notify->relname);
+    lua_setfield(L, -2, "name");
+    lua_pushnumber(L, notify->be_pid);
+    lua_setfield(L, -2, "pid");
+    lua_pushstring(L, notify->extra);
+    lua_setfield(L, -2, "payload");
+    PQfreemem(notify);
+}
+
 static int
 checkNotifies (lua_State *L)
 {
     DBSession *s = luaL_checkudata(L, 1, SES_REGNAME);
     PGnotify *notify = PQnotifies(s->conn);
     if (notify) {
-        lua_createtable(L, 0, 2);
-        lua_pushstring(L, notify->relname);
-        lua_setfield(L, -2, "name");
-        lua_pushnumber(L, notify->be_pid);
-        lua_setfield(L, -2, "pid"); 
-        PQfreemem(notify);
+        pushNotify(L, notify);
     }
     else {
         lua_pushboolean(L, 1);
@@ -658,6 +1291,50 @@ checkNotifies (lua_State *L)
     return 1;
 }
 
+/* Returns an array of all the notifications received, up to max if given,
+ * waiting on the connection for up to timeout seconds, or without a timeout,
+ * for as long as it takes, if there are none yet. Returns an empty array if
+ * none arrived in time, or false and an error message if the connection
+ * failed. */
+static int
+waitNotifies (lua_State *L)
+{
+    DBSession *s = luaL_checkudata(L, 1, SES_REGNAME);
+    lua_Number timeout = luaL_optnumber(L, 2, -1);
+    int max = luaL_optint(L, 3, INT_MAX);
+    luaL_argcheck(L, max > 0, 3, "must be positive");
+    double deadline = monotonicTime() + timeout;
+    int count = 0;
+    PGnotify *notify;
+
+    lua_newtable(L);
+    for (;;) {
+        if (!PQconsumeInput(s->conn)) {
+            lua_pushboolean(L, 0);
+            lua_pushstring(L, PQerrorMessage(s->conn));
+            return 2;
+        }
+        while (count < max && (notify = PQnotifies(s->conn))) {
+            pushNotify(L, notify);
+            lua_rawseti(L, -2, ++count);
+        }
+        double left = deadline - monotonicTime();
+        if (count > 0 || (timeout >= 0 && left <= 0)) {
+            return 1;
+        }
+        struct pollfd pfd;
+        pfd.fd = PQsocket(s->conn);
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        // Milliseconds, rounded up and clamped for long timeouts.
+        double ms = left * 1000 + 1;
+        int wait = timeout < 0 ? -1 : ms < INT_MAX ? (int)ms : INT_MAX;
+        if (poll(&pfd, 1, wait) < 0 && errno != EINTR) {
+            return luaL_error(L, "poll failed: %s", strerror(errno));
+        }
+    }
+}
+
 static int
 backendPID (lua_State *L)
 {
@@ -670,6 +1347,10 @@ backendPID (lua_State *L)
 static const struct luaL_Reg methods [] = {
     {"run", run},
     {"arrayKeys", arrayKeys},
+    {"binaryResults", binaryResults},
+    {"binaryParams", binaryParams},
+    {"lazyResults", lazyResults},
+    {"columnarResults", columnarResults},
     {"setTypeMap", setTypeMap},
     {"prepare", prepare},
     {"asyncRun", asyncRun},
@@ -681,6 +1362,7 @@ static const struct luaL_Reg methods [] = {
     {"isBusy", isBusy},
     {"setNonBlocking", setNonBlocking},
     {"checkNotifies", checkNotifies},
+    {"waitNotifies", waitNotifies},
     {"backendPID", backendPID},
     {"flush", flush},
     {"close", close},
@@ -704,6 +1386,18 @@ registerSession (lua_State *L)
     lua_setfield(L, -2, "asyncRun");
     lua_pushcfunction(L, deallocatePrepared);
     lua_setfield(L, -2, "deallocate");
+    lua_pushcfunction(L, binaryResults);
+    lua_setfield(L, -2, "binaryResults");
+    lua_pushcfunction(L, binaryParams);
+    lua_setfield(L, -2, "binaryParams");
+    lua_pushcfunction(L, lazyResults);
+    lua_setfield(L, -2, "lazyResults");
+    lua_pushcfunction(L, columnarResults);
+    lua_setfield(L, -2, "columnarResults");
+    lua_pushcfunction(L, setTypeMap);
+    lua_setfield(L, -2, "setTypeMap");
+    lua_pushcfunction(L, prepGC);
+    lua_setfield(L, -2, "__gc");
     lua_pushvalue(L, -1);
     lua_setfield(L, -2, "__index");
 }
@@ -1,3 +1,6 @@
+#ifndef _SESSION_H
+#define _SESSION_H
+
 #include "common.h"
 
 #define SES_REGNAME "moonpg.session"
@@ -5,29 +8,154 @@
 
 typedef enum {
     boolOID = 16,
+    byteaOID = 17,
+    nameOID = 19,
     int8OID = 20,
     int2OID = 21,
     int4OID = 23,
+    textOID = 25,
+    oidOID = 26,
+    jsonOID = 114,
+    pointOID = 600,
+    lsegOID = 601,
+    pathOID = 602,
+    boxOID = 603,
+    polygonOID = 604,
     float4OID = 700,
     float8OID = 701,
+    circleOID = 718,
+    bpcharOID = 1042,
+    varcharOID = 1043,
+    dateOID = 1082,
+    timestampOID = 1114,
+    timestamptzOID = 1184,
     numericOID = 1700,
-    
+    uuidOID = 2950,
+    jsonbOID = 3802,
+
     // Array types
     boolAOID = 1000,
+    byteaAOID = 1001,
     intA2OID = 1005,
     intA4OID = 1007,
+    textAOID = 1009,
+    bpcharAOID = 1014,
+    varcharAOID = 1015,
     intA8OID = 1016,
     floatA4OID = 1021,
     floatA8OID = 1022,
-    numericAOID = 1231
-    
+    timestampAOID = 1115,
+    dateAOID = 1182,
+    timestamptzAOID = 1185,
+    numericAOID = 1231,
+    uuidAOID = 2951
+
 } PGtype;
 
+// The special Lua representations a type map can set for the values of a field.
+typedef enum {
+    mapDefault = 0,
+    mapString,
+    mapArray,
+    mapPoint,
+    mapLine,
+    mapBox,
+    mapPath,
+    mapPolygon,
+    mapCircle,
+    mapVector   // A numeric column of a columnar result, as a native vector.
+} TypeMapping;
+
+// A type map compiled from its string, of field names and their mappings.
+typedef struct {
+    int count;
+    char **fields;
+    TypeMapping *mappings;
+} TypeMap;
+
+// Pushes a non-null value, of the length and column type given, as a Lua value.
+typedef void (*ValueDecoder) (lua_State *L, char *value, int len, PGtype type,
+    TypeMapping mapping);
+
+// How the values of a result column are decoded, chosen once per result.
+typedef struct {
+    ValueDecoder decode;
+    PGtype type;
+    TypeMapping mapping;
+    const double *decoded;  // The numeric or boolean values by tuple, if decoded ahead.
+} ColumnDecoder;
+
+typedef struct StatementCache StatementCache;
+typedef struct SessionStats SessionStats;
+typedef struct Trace Trace;
+typedef struct ExplainStore ExplainStore;
 
 typedef struct {
     PGconn *conn;
     unsigned int sid; // sequence for statement IDs.
     int getbyarray;
-    char *typeMapString;
+    int binary; // Request results in the binary format.
+    int binaryParams; // Send parameters in the binary format where possible.
+    int lazy; // Return query results as result objects, decoded as they are read.
+    int columnar; // Return query results as an array of values per column.
+    Oid *paramTypes; // Parameter types of a prepared statement, if described.
+    int nparams;
+    StatementCache *cache; // Statements prepared by run, if turned on.
+    TypeMap *typeMap;
+    ColumnDecoder *columns; // Decoders of the columns of the current result.
+    int ncolumns;
+    int decodeThreads; // Threads decoding large results, if more than one.
+    double *decoded; // Values of the current result decoded by the threads.
+    size_t ndecoded;
+    SessionStats *stats; // Counts of the statements run, if kept.
+    Trace *trace; // Records of the latest calls, if kept.
+    ExplainStore *explain; // Plans of the slow statements, if captured.
+    int rowMode; // A stream has put libpq in single row mode, which may linger.
 } DBSession;
 
+// Parameter values gathered from the Lua stack, in the form taken by the libpq exec functions.
+typedef struct {
+    const char **values;
+    Oid *types;
+    int *lengths;
+    int *formats;
+} ParamSet;
+
+void
+parametersFromStack (lua_State *L, int count, int offset, int binaryParams, const Oid *targets,
+    int ntargets, ParamSet *ps);
+
+void
+freeTypeMap (TypeMap *map);
+
+void
+resolveColumns (PGresult *result, const TypeMap *map, ColumnDecoder *columns);
+
+void
+pushValue (lua_State *L, PGresult *result, int tuple, int field, const ColumnDecoder *column);
+
+int
+connectSession (lua_State *L, const char *cinfo);
+
+void
+resetSessionOptions (DBSession *s);
+
+DBSession *
+checkSessionOrPrep (lua_State *L, int index, int *isPrep);
+
+int
+processResultStatus (lua_State *L, PGresult *result, ExecStatusType status, DBSession *s);
+
+int
+readCommandResults (PGconn *conn, PGresult **result);
+
+struct pollfd;
+
+int
+pollCommand (PGconn *conn, struct pollfd *pfd);
+
+void
+pushRow (lua_State *L, PGresult *result, int tuple, int nf, const ColumnDecoder *columns,
+    int namesIndex, int byArray);
+
+#endif
@@ -0,0 +1,377 @@
+#include <ctype.h>
+#include "stats.h"
+
+// Write the fingerprint of command to out: the command with runs of white space made a
+// single space, literal strings and numbers replaced by ?, and all else but quoted names in
+// lower case. Returns its length, which is at most that of the command.
+size_t
+fingerprintCommand (const char *p, char *out)
+{
+    char *o = out;
+    int space = 0;
+    while (*p != '\0') {
+        unsigned char c = *p;
+        if (isspace(c)) {
+            space = 1;
+            p++;
+            continue;
+        }
+        if (space && o > out) {
+            *o++ = ' ';
+        }
+        space = 0;
+        if (c == '\'') {
+            for (p++; *p != '\0'; p++) {
+                if (*p == '\'' && *++p != '\'') {
+                    break;
+                }
+            }
+            *o++ = '?';
+        }
+        else if (c == '"') {
+            const char *start = p++;
+            while (*p != '\0' && *p++ != '"') {
+            }
+            memcpy(o, start, p - start);
+            o += p - start;
+        }
+        else if (isdigit(c) && (o == out ||
+                !(isalnum((unsigned char)o[-1]) || o[-1] == '_' || o[-1] == '$'))) {
+            while (isalnum((unsigned char)*p) || *p == '.') {
+                p++;
+            }
+            *o++ = '?';
+        }
+        else {
+            *o++ = tolower(c);
+            p++;
+        }
+    }
+    return o - out;
+}
+
+static StatementStats *
+findStatement (const SessionStats *st, const char *fp, size_t len, uint32_t hash)
+{
+    for (int i = st->nslots ? hash & (st->nslots - 1) : 0; st->nslots && st->slots[i];
+            i = (i + 1) & (st->nslots - 1)) {
+        StatementStats *e = st->entries + st->slots[i] - 1;
+        if (e->hash == hash && e->len == len && memcmp(e->fingerprint, fp, len) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+// Add an entry for a fingerprint not counted yet. Returns NULL if out of memory.
+static StatementStats *
+addStatement (SessionStats *st, const char *fp, size_t len, uint32_t hash)
+{
+    if (st->size == st->capacity) {
+        int capacity = MAX(st->capacity * 2, 16);
+        StatementStats *entries = realloc(st->entries, capacity * sizeof *entries);
+        if (!entries) {
+            return NULL;
+        }
+        st->entries = entries;
+        st->capacity = capacity;
+    }
+    if ((st->size + 1) * 2 > st->nslots) {
+        int nslots = MAX(st->nslots * 2, 32);
+        int *slots = calloc(nslots, sizeof *slots);
+        if (!slots) {
+            return NULL;
+        }
+        for (int n = 0; n < st->size; n++) {
+            int i = st->entries[n].hash & (nslots - 1);
+            while (slots[i]) {
+                i = (i + 1) & (nslots - 1);
+            }
+            slots[i] = n + 1;
+        }
+        free(st->slots);
+        st->slots = slots;
+        st->nslots = nslots;
+    }
+    StatementStats *e = st->entries + st->size;
+    memset(e, 0, sizeof *e);
+    e->fingerprint = malloc(len + 1);
+    if (!e->fingerprint) {
+        return NULL;
+    }
+    memcpy(e->fingerprint, fp, len);
+    e->fingerprint[len] = '\0';
+    e->len = len;
+    e->hash = hash;
+    int i = hash & (st->nslots - 1);
+    while (st->slots[i]) {
+        i = (i + 1) & (st->nslots - 1);
+    }
+    st->slots[i] = ++st->size;
+    return e;
+}
+
+// Get the entry of a fingerprint, added if new, or that of the other statements once there are
+// too many. Returns NULL if out of memory.
+static StatementStats *
+getStatement (SessionStats *st, const char *fp, size_t len)
+{
+    uint32_t hash = fnv1a(fp, len);
+    StatementStats *e = findStatement(st, fp, len, hash);
+    if (e) {
+        return e;
+    }
+    if (st->size >= STATS_MAX_STATEMENTS) {
+        fp = STATS_OTHER;
+        len = strlen(STATS_OTHER);
+        hash = fnv1a(fp, len);
+        if ((e = findStatement(st, fp, len, hash))) {
+            return e;
+        }
+    }
+    return addStatement(st, fp, len, hash);
+}
+
+// Get the statistics of the session, created when first needed.
+SessionStats *
+sessionStats (DBSession *s)
+{
+    if (!s->stats) {
+        s->stats = calloc(1, sizeof *s->stats);
+    }
+    return s->stats;
+}
+
+// Take the counts of a sample from the result of its command.
+void
+sampleResult (PGresult *result, StatementSample *sample)
+{
+    ExecStatusType status = result ? PQresultStatus(result) : PGRES_FATAL_ERROR;
+    sample->status = status;
+    sample->failed = status != PGRES_COMMAND_OK && status != PGRES_TUPLES_OK;
+    sample->rows = status == PGRES_TUPLES_OK ? PQntuples(result) : 0;
+    sample->bytes = result ? PQresultMemorySize(result) : 0;
+}
+
+// Count a sample of command for its statement. It goes uncounted if out of memory.
+void
+recordStatement (SessionStats *st, const char *command, const StatementSample *sample)
+{
+    size_t need = strlen(command) + 1;
+    if (need > st->scratchSize) {
+        char *scratch = realloc(st->scratch, need);
+        if (!scratch) {
+            return;
+        }
+        st->scratch = scratch;
+        st->scratchSize = need;
+    }
+    StatementStats *e = getStatement(st, st->scratch, fingerprintCommand(command, st->scratch));
+    if (!e) {
+        return;
+    }
+    int b = 0;
+    for (double us = sample->latency * 1e6; us >= 2 && b < STATS_BUCKETS - 1; us /= 2) {
+        b++;
+    }
+    e->calls++;
+    e->errors += sample->failed;
+    e->rows += sample->rows;
+    e->bytes += sample->bytes;
+    e->latency += sample->latency;
+    e->maxLatency = MAX(e->maxLatency, sample->latency);
+    e->decode += sample->decode;
+    e->histogram[b]++;
+}
+
+// Add the counts of from to into, statement by statement.
+void
+mergeStats (SessionStats *into, const SessionStats *from)
+{
+    for (int n = 0; n < from->size; n++) {
+        const StatementStats *f = from->entries + n;
+        StatementStats *e = getStatement(into, f->fingerprint, f->len);
+        if (!e) {
+            return;
+        }
+        e->calls += f->calls;
+        e->errors += f->errors;
+        e->rows += f->rows;
+        e->bytes += f->bytes;
+        e->latency += f->latency;
+        e->maxLatency = MAX(e->maxLatency, f->maxLatency);
+        e->decode += f->decode;
+        for (int b = 0; b < STATS_BUCKETS; b++) {
+            e->histogram[b] += f->histogram[b];
+        }
+    }
+}
+
+// The latency under which the fraction q of the commands of e took, as the upper bound of its
+// histogram bucket.
+static double
+latencyPercentile (const StatementStats *e, double q)
+{
+    unsigned long count = 0;
+    for (int b = 0; b < STATS_BUCKETS - 1; b++) {
+        count += e->histogram[b];
+        if (count >= q * e->calls) {
+            return MIN((double)(2ul << b) / 1e6, e->maxLatency);
+        }
+    }
+    return e->maxLatency;
+}
+
+static void
+pushStatement (lua_State *L, const StatementStats *e)
+{
+    lua_createtable(L, 0, 14);
+    lua_pushlstring(L, e->fingerprint, e->len);
+    lua_setfield(L, -2, "statement");
+    lua_pushnumber(L, e->calls);
+    lua_setfield(L, -2, "calls");
+    lua_pushnumber(L, e->errors);
+    lua_setfield(L, -2, "errors");
+    lua_pushnumber(L, e->rows);
+    lua_setfield(L, -2, "rows");
+    lua_pushnumber(L, e->bytes);
+    lua_setfield(L, -2, "bytes");
+    lua_pushnumber(L, e->latency);
+    lua_setfield(L, -2, "latency");
+    lua_pushnumber(L, e->calls ? e->latency / e->calls : 0);
+    lua_setfield(L, -2, "meanLatency");
+    lua_pushnumber(L, e->maxLatency);
+    lua_setfield(L, -2, "maxLatency");
+    lua_pushnumber(L, latencyPercentile(e, 0.5));
+    lua_setfield(L, -2, "p50");
+    lua_pushnumber(L, latencyPercentile(e, 0.95));
+    lua_setfield(L, -2, "p95");
+    lua_pushnumber(L, latencyPercentile(e, 0.99));
+    lua_setfield(L, -2, "p99");
+    lua_pushnumber(L, e->decode);
+    lua_setfield(L, -2, "decode");
+    lua_createtable(L, STATS_BUCKETS, 0);
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+        lua_pushnumber(L, e->histogram[b]);
+        lua_rawseti(L, -2, b + 1);
+    }
+    lua_setfield(L, -2, "histogram");
+}
+
+// Push an array of the counts of the statements of st, which may be NULL.
+void
+pushStats (lua_State *L, const SessionStats *st)
+{
+    int size = st ? st->size : 0;
+    lua_createtable(L, size, 0);
+    for (int n = 0; n < size; n++) {
+        pushStatement(L, st->entries + n);
+        lua_rawseti(L, -2, n + 1);
+    }
+}
+
+// Free the counts held by st, leaving it empty.
+void
+clearSessionStats (SessionStats *st)
+{
+    for (int n = 0; n < st->size; n++) {
+        free(st->entries[n].fingerprint);
+    }
+    free(st->entries);
+    free(st->slots);
+    free(st->scratch);
+    memset(st, 0, sizeof *st);
+}
+
+void
+freeSessionStats (SessionStats *st)
+{
+    if (st) {
+        clearSessionStats(st);
+        free(st);
+    }
+}
+
+/* Count the commands run by run, of the connection and its prepared objects,
+ * by statement, when flag is true or left out. With false, the counts are
+ * dropped. */
+static int
+trackStats (lua_State *L)
+{
+    DBSession *s = luaL_checkudata(L, 1, SES_REGNAME);
+    if (lua_gettop(L) < 2 || lua_toboolean(L, 2)) {
+        if (!sessionStats(s)) {
+            return luaL_error(L, "out of memory");
+        }
+    }
+    else {
+        freeSessionStats(s->stats);
+        s->stats = NULL;
+    }
+    return 0;
+}
+
+/* Returns an array of the counts of the statements run since counting began
+ * or was reset. */
+static int
+statementStats (lua_State *L)
+{
+    DBSession *s = luaL_checkudata(L, 1, SES_REGNAME);
+    pushStats(L, s->stats);
+    return 1;
+}
+
+/* Sets the counts of all the statements back to none. */
+static int
+resetStats (lua_State *L)
+{
+    DBSession *s = luaL_checkudata(L, 1, SES_REGNAME);
+    if (s->stats) {
+        clearSessionStats(s->stats);
+    }
+    return 0;
+}
+
+/* Returns the counts of the statement of the prepared object, as counted by
+ * its connection, or nil if it has not been counted. */
+static int
+preparedStats (lua_State *L)
+{
+    luaL_checkudata(L, 1, SESPREP_REGNAME);
+    lua_getfenv(L, 1);
+    lua_getfield(L, -1, "session");
+    DBSession *sess = lua_touserdata(L, -1);
+    lua_getfield(L, -2, "command");
+    const char *command = luaL_optstring(L, -1, STATS_PREPARED);
+    if (!sess || !sess->stats) {
+        lua_pushnil(L);
+        return 1;
+    }
+    char *fp = lua_newuserdata(L, strlen(command) + 1);
+    size_t len = fingerprintCommand(command, fp);
+    StatementStats *e = findStatement(sess->stats, fp, len, fnv1a(fp, len));
+    if (e) {
+        pushStatement(L, e);
+    }
+    else {
+        lua_pushnil(L);
+    }
+    return 1;
+}
+
+void
+registerStats (lua_State *L)
+{
+    luaL_getmetatable(L, SES_REGNAME);
+    lua_pushcfunction(L, trackStats);
+    lua_setfield(L, -2, "trackStats");
+    lua_pushcfunction(L, statementStats);
+    lua_setfield(L, -2, "stats");
+    lua_pushcfunction(L, resetStats);
+    lua_setfield(L, -2, "resetStats");
+    lua_pop(L, 1);
+    luaL_getmetatable(L, SESPREP_REGNAME);
+    lua_pushcfunction(L, preparedStats);
+    lua_setfield(L, -2, "stats");
+    lua_pop(L, 1);
+}
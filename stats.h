@@ -0,0 +1,82 @@
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <stdint.h>
+#include "session.h"
+
+// Latency histogram buckets: bucket b counts latencies under 2^(b+1) microseconds, and the
+// last one all those longer.
+#define STATS_BUCKETS 26
+
+// Statements counted apart at most, those past it being counted together.
+#define STATS_MAX_STATEMENTS 1024
+
+#define STATS_OTHER "(other statements)"
+
+// The statement counted for a prepared object whose command is not known.
+#define STATS_PREPARED "(prepared statement)"
+
+// The counts of the commands of one statement fingerprint.
+typedef struct {
+    char *fingerprint;
+    size_t len;
+    uint32_t hash;
+    unsigned long calls;
+    unsigned long errors;
+    double rows;
+    double bytes;           // Memory taken by the results.
+    double latency;         // Seconds from sending the commands to having their results.
+    double maxLatency;
+    double decode;          // Seconds converting the results to Lua values.
+    unsigned long histogram[STATS_BUCKETS];
+} StatementStats;
+
+// The statement counts of a session, by fingerprint.
+struct SessionStats {
+    StatementStats *entries;
+    int size;
+    int capacity;
+    int *slots;             // Open addressed index of the entries, by hash, 1 based.
+    int nslots;
+    char *scratch;          // For the fingerprint of the command being counted.
+    size_t scratchSize;
+};
+
+// What a command took and returned, to be counted for its statement.
+typedef struct {
+    double latency;
+    double decode;
+    double rows;
+    double bytes;
+    int failed;
+    ExecStatusType status;
+} StatementSample;
+
+size_t
+fingerprintCommand (const char *command, char *out);
+
+SessionStats *
+sessionStats (DBSession *s);
+
+void
+sampleResult (PGresult *result, StatementSample *sample);
+
+void
+recordStatement (SessionStats *st, const char *command, const StatementSample *sample);
+
+void
+mergeStats (SessionStats *into, const SessionStats *from);
+
+void
+pushStats (lua_State *L, const SessionStats *st);
+
+void
+clearSessionStats (SessionStats *st);
+
+void
+freeSessionStats (SessionStats *st);
+
+void
+registerStats (lua_State *L);
+
+#endif
@@ -0,0 +1,270 @@
+#include "stmtcache.h"
+
+// The name of a statement prepared for a sid is the sid, as with prepare.
+#define STATEMENT_NAME_LEN 16
+
+// Get the statement cache of the session, created when first needed.
+StatementCache *
+sessionCache (DBSession *s)
+{
+    if (!s->cache) {
+        s->cache = calloc(1, sizeof *s->cache);
+    }
+    return s->cache;
+}
+
+// Queue the statement of sid to be deallocated with the next batch.
+void
+queueDeallocate (DBSession *s, unsigned int sid)
+{
+    StatementCache *c = sessionCache(s);
+    if (!c) {
+        return;
+    }
+    if (c->npending == c->pendingSize) {
+        int size = MAX(c->pendingSize * 2, DEALLOCATE_BATCH);
+        unsigned int *pending = realloc(c->pending, size * sizeof *pending);
+        if (!pending) {
+            return;
+        }
+        c->pending = pending;
+        c->pendingSize = size;
+    }
+    c->pending[c->npending++] = sid;
+}
+
+// Deallocate the queued statements in one command, once a batch of them is queued, or any
+// queued if force is set. The command is only sent while no other command is in progress
+// and outside of a transaction, which the error of a statement already gone would abort.
+// If it fails, the statements are deallocated one by one, so that those gone are skipped.
+void
+flushDeallocations (DBSession *s, int force)
+{
+    StatementCache *c = s->cache;
+    if (!c || c->npending == 0 || !s->conn || (!force && c->npending < DEALLOCATE_BATCH)) {
+        return;
+    }
+    if (PQtransactionStatus(s->conn) != PQTRANS_IDLE) {
+        return;
+    }
+#ifdef LIBPQ_HAS_PIPELINING
+    if (PQpipelineStatus(s->conn) != PQ_PIPELINE_OFF) {
+        return;
+    }
+#endif
+    char *command = malloc(c->npending * (STATEMENT_NAME_LEN + sizeof "DEALLOCATE \"\";"));
+    if (!command) {
+        return;
+    }
+    char *p = command;
+    for (int i = 0; i < c->npending; i++) {
+        p += sprintf(p, "DEALLOCATE \"%u\";", c->pending[i]);
+    }
+    PGresult *result = PQexec(s->conn, command);
+    int done = PQresultStatus(result) == PGRES_COMMAND_OK;
+    PQclear(result);
+    for (int i = 0; !done && i < c->npending; i++) {
+        sprintf(command, "DEALLOCATE \"%u\"", c->pending[i]);
+        PQclear(PQexec(s->conn, command));
+    }
+    free(command);
+    c->npending = 0;
+}
+
+// Get the parameter types of a cached statement, for binary parameters.
+static void
+describeStatement (DBSession *s, CachedStatement *cs)
+{
+    char name[STATEMENT_NAME_LEN];
+    sprintf(name, "%u", cs->sid);
+    PGresult *result = PQdescribePrepared(s->conn, name);
+    if (PQresultStatus(result) == PGRES_COMMAND_OK) {
+        cs->nparams = PQnparams(result);
+        cs->paramTypes = malloc(MAX(cs->nparams, 1) * sizeof *cs->paramTypes);
+        for (int i = 0; cs->paramTypes && i < cs->nparams; i++) {
+            cs->paramTypes[i] = PQparamtype(result, i);
+        }
+    }
+    PQclear(result);
+}
+
+static void
+evictStatement (DBSession *s, CachedStatement *cs)
+{
+    queueDeallocate(s, cs->sid);
+    free(cs->command);
+    free(cs->paramTypes);
+    s->cache->evictions++;
+}
+
+static CachedStatement *
+leastRecentlyUsed (StatementCache *c)
+{
+    CachedStatement *lru = c->entries;
+    for (int i = 1; i < c->size; i++) {
+        if (c->entries[i].used < lru->used) {
+            lru = c->entries + i;
+        }
+    }
+    return lru;
+}
+
+// Get the cached statement for command, preparing it if it is not cached.
+// Returns NULL if the cache is off or the command could not be prepared, in which case the
+// result of the failed prepare, with its error, is set in failed for the caller to return,
+// as running the command again would only fail again, or in an aborted transaction, with
+// another error.
+CachedStatement *
+cachedStatement (DBSession *s, const char *command, PGresult **failed)
+{
+    StatementCache *c = s->cache;
+    CachedStatement *cs;
+    if (!c || c->capacity == 0) {
+        return NULL;
+    }
+    uint32_t hash = fnv1a(command, strlen(command));
+    for (int i = 0; i < c->size; i++) {
+        cs = c->entries + i;
+        if (cs->hash == hash && strcmp(cs->command, command) == 0) {
+            c->hits++;
+            cs->used = ++c->tick;
+            if (s->binaryParams && !cs->paramTypes) {
+                describeStatement(s, cs);
+            }
+            return cs;
+        }
+    }
+    c->misses++;
+    flushDeallocations(s, 0);
+
+    char name[STATEMENT_NAME_LEN];
+    unsigned int sid = s->sid++;
+    sprintf(name, "%u", sid);
+    PGresult *result = PQprepare(s->conn, name, command, 0, NULL);
+    if (PQresultStatus(result) != PGRES_COMMAND_OK) {
+        *failed = result;
+        return NULL;
+    }
+    PQclear(result);
+    char *copy = malloc(strlen(command) + 1);
+    if (!copy) {
+        queueDeallocate(s, sid);
+        return NULL;
+    }
+    strcpy(copy, command);
+
+    if (c->size < c->capacity) {
+        cs = c->entries + c->size++;
+    }
+    else {
+        cs = leastRecentlyUsed(c);
+        evictStatement(s, cs);
+    }
+    cs->command = copy;
+    cs->hash = hash;
+    cs->sid = sid;
+    cs->paramTypes = NULL;
+    cs->nparams = 0;
+    cs->used = ++c->tick;
+    if (s->binaryParams) {
+        describeStatement(s, cs);
+    }
+    return cs;
+}
+
+// Forget the statements of a session whose connection has been reset, which took them with
+// it, keeping the capacity and the counts.
+void
+resetStatementCache (DBSession *s)
+{
+    StatementCache *c = s->cache;
+    if (c) {
+        for (int i = 0; i < c->size; i++) {
+            free(c->entries[i].command);
+            free(c->entries[i].paramTypes);
+        }
+        c->size = 0;
+        c->npending = 0;
+    }
+}
+
+// Free the cache of a session being closed. Its statements end with the connection.
+void
+freeStatementCache (DBSession *s)
+{
+    StatementCache *c = s->cache;
+    if (c) {
+        for (int i = 0; i < c->size; i++) {
+            free(c->entries[i].command);
+            free(c->entries[i].paramTypes);
+        }
+        free(c->entries);
+        free(c->pending);
+        free(c);
+        s->cache = NULL;
+    }
+}
+
+/* Have run prepare the commands it runs with parameters or binary results,
+ * keeping up to size of the most recently used prepared, to be run again
+ * without being parsed and planned again. A size of 0 turns the cache off,
+ * deallocating its statements. */
+static int
+cacheStatements (lua_State *L)
+{
+    DBSession *s = luaL_checkudata(L, 1, SES_REGNAME);
+    int size = luaL_checkint(L, 2);
+    luaL_argcheck(L, size >= 0, 2, "cache size can not be negative");
+    StatementCache *c = sessionCache(s);
+    if (!c) {
+        return luaL_error(L, "out of memory");
+    }
+    while (c->size > size) {
+        CachedStatement *cs = leastRecentlyUsed(c);
+        evictStatement(s, cs);
+        *cs = c->entries[--c->size];
+    }
+    if (size != c->capacity) {
+        CachedStatement *entries = realloc(c->entries, MAX(size, 1) * sizeof *entries);
+        if (!entries) {
+            return luaL_error(L, "out of memory");
+        }
+        c->entries = entries;
+        c->capacity = size;
+    }
+    flushDeallocations(s, 1);
+    return 0;
+}
+
+/* Returns a table of the statement cache counts. */
+static int
+cacheStats (lua_State *L)
+{
+    DBSession *s = luaL_checkudata(L, 1, SES_REGNAME);
+    StatementCache *c = s->cache;
+    lua_createtable(L, 0, 6);
+    lua_pushnumber(L, c ? c->hits : 0);
+    lua_setfield(L, -2, "hits");
+    lua_pushnumber(L, c ? c->misses : 0);
+    lua_setfield(L, -2, "misses");
+    lua_pushnumber(L, c ? c->evictions : 0);
+    lua_setfield(L, -2, "evictions");
+    lua_pushnumber(L, c ? c->size : 0);
+    lua_setfield(L, -2, "size");
+    lua_pushnumber(L, c ? c->capacity : 0);
+    lua_setfield(L, -2, "capacity");
+    lua_pushnumber(L, c ? c->npending : 0);
+    lua_setfield(L, -2, "pending");
+    return 1;
+}
+
+void
+registerStatementCache (lua_State *L)
+{
+    luaL_getmetatable(L, SES_REGNAME);
+    lua_pushcfunction(L, cacheStatements);
+    lua_setfield(L, -2, "cacheStatements");
+    lua_pushcfunction(L, cacheStats);
+    lua_setfield(L, -2, "cacheStats");
+    lua_pop(L, 1);
+}
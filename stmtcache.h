@@ -0,0 +1,55 @@
+#ifndef _STMTCACHE_H
+#define _STMTCACHE_H
+
+#include <stdint.h>
+#include "session.h"
+
+// Deallocations of statements are sent together once this many are pending.
+#define DEALLOCATE_BATCH 16
+
+// A statement prepared by the cache for a command string.
+typedef struct {
+    char *command;
+    uint32_t hash;
+    unsigned int sid;
+    Oid *paramTypes;    // Parameter types, if described for binary parameters.
+    int nparams;
+    unsigned long used; // Tick of the last use, for finding the least recently used.
+} CachedStatement;
+
+// The prepared statements of a session, and those waiting to be deallocated.
+struct StatementCache {
+    CachedStatement *entries;
+    int size;
+    int capacity;
+    unsigned long tick;
+    unsigned int *pending;  // Statements to deallocate.
+    int npending;
+    int pendingSize;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+};
+
+StatementCache *
+sessionCache (DBSession *s);
+
+CachedStatement *
+cachedStatement (DBSession *s, const char *command, PGresult **failed);
+
+void
+queueDeallocate (DBSession *s, unsigned int sid);
+
+void
+flushDeallocations (DBSession *s, int force);
+
+void
+resetStatementCache (DBSession *s);
+
+void
+freeStatementCache (DBSession *s);
+
+void
+registerStatementCache (lua_State *L);
+
+#endif
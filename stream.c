@@ -0,0 +1,282 @@
+#include "stream.h"
+
+// Discard the rest of the query results, so that the session can run other commands.
+// If cancel is set, the server is asked to stop sending them first.
+static void
+finishStream (Stream *st, int cancel)
+{
+    if (st->result) {
+        PQclear(st->result);
+        st->result = NULL;
+    }
+    // The session may have been closed, or collected along with the stream.
+    if (!st->done && st->sess->conn) {
+        PGresult *result;
+        if (cancel) {
+            char errbuf[256];
+            PGcancel *c = PQgetCancel(st->sess->conn);
+            if (c) {
+                PQcancel(c, errbuf, sizeof errbuf);
+                PQfreeCancel(c);
+            }
+        }
+        while ((result = PQgetResult(st->sess->conn))) {
+            PQclear(result);
+        }
+    }
+    st->done = 1;
+    if (st->columns) {
+        free(st->columns);
+        st->columns = NULL;
+    }
+}
+
+// Set up the column decoders from the first chunk. The field names table is kept in the
+// environment of the stream at index, to be shared by all rows.
+static void
+describeColumns (lua_State *L, int index, Stream *st)
+{
+    int nf = PQnfields(st->result);
+    st->nfields = nf;
+    st->columns = malloc(MAX(nf, 1) * sizeof *st->columns);
+    if (!st->columns) {
+        finishStream(st, 1);
+        luaL_error(L, "out of memory");
+    }
+    resolveColumns(st->result, st->sess->typeMap, st->columns);
+    lua_getfenv(L, index);
+    lua_createtable(L, nf, 0);
+    for (int i = 0; i < nf; i++) {
+        lua_pushstring(L, PQfname(st->result, i));
+        lua_rawseti(L, -2, i+1);
+    }
+    lua_setfield(L, -2, "fields");
+    lua_pop(L, 1);
+}
+
+// Make the next chunk of rows current. Returns 0 at the end of the results, and raises an
+// error if the query failed.
+static int
+nextChunk (lua_State *L, int index, Stream *st)
+{
+    if (st->result) {
+        PQclear(st->result);
+        st->result = NULL;
+    }
+    while (!st->done) {
+        PGresult *result = PQgetResult(st->sess->conn);
+        if (!result) {
+            st->done = 1;
+            break;
+        }
+        switch (PQresultStatus(result)) {
+            case PGRES_SINGLE_TUPLE:
+#ifdef LIBPQ_HAS_CHUNK_MODE
+            case PGRES_TUPLES_CHUNK:
+#endif
+                st->result = result;
+                st->row = 0;
+                if (!st->columns) {
+                    describeColumns(L, index, st);
+                }
+                return 1;
+            case PGRES_TUPLES_OK:
+            case PGRES_COMMAND_OK:
+                // The final, empty, result of the query or a command without rows.
+                PQclear(result);
+                break;
+            default:
+                lua_pushstring(L, PQresultErrorMessage(result));
+                PQclear(result);
+                finishStream(st, 0);
+                lua_error(L);
+        }
+    }
+    finishStream(st, 0);
+    return 0;
+}
+
+// Push the next row onto the stack. Returns 0 at the end of the results.
+static int
+nextRow (lua_State *L, int index, Stream *st, int namesIndex)
+{
+    if ((!st->result || st->row >= PQntuples(st->result)) && !nextChunk(L, index, st)) {
+        return 0;
+    }
+    if (namesIndex == 0) {
+        lua_getfenv(L, index);
+        lua_getfield(L, -1, "fields");
+        lua_remove(L, -2);
+        namesIndex = lua_gettop(L);
+        pushRow(L, st->result, st->row++, st->nfields, st->columns, namesIndex,
+            st->sess->getbyarray);
+        lua_remove(L, namesIndex);
+    }
+    else {
+        pushRow(L, st->result, st->row++, st->nfields, st->columns, namesIndex,
+            st->sess->getbyarray);
+    }
+    return 1;
+}
+
+// The iterator function: returns the next row, or the next batch of rows as an array,
+// or nil at the end of the results.
+static int
+streamCall (lua_State *L)
+{
+    Stream *st = luaL_checkudata(L, 1, STREAM_REGNAME);
+    if (st->done && !st->result) {
+        lua_pushnil(L);
+        return 1;
+    }
+    if (st->batch == 0) {
+        if (!nextRow(L, 1, st, 0)) {
+            lua_pushnil(L);
+        }
+        return 1;
+    }
+    lua_createtable(L, st->batch, 0);
+    int n = 0;
+    int namesIndex = 0;
+    while (n < st->batch) {
+        if (st->result && st->row < PQntuples(st->result) && namesIndex == 0) {
+            lua_getfenv(L, 1);
+            lua_getfield(L, -1, "fields");
+            lua_remove(L, -2);
+            lua_insert(L, -2);
+            namesIndex = lua_gettop(L) - 1;
+        }
+        if (!nextRow(L, 1, st, namesIndex)) {
+            break;
+        }
+        lua_rawseti(L, -2, ++n);
+    }
+    if (n == 0) {
+        lua_pushnil(L);
+    }
+    return 1;
+}
+
+// Stop reading the results, cancelling the rest of the query.
+static int
+streamClose (lua_State *L)
+{
+    Stream *st = luaL_checkudata(L, 1, STREAM_REGNAME);
+    finishStream(st, 1);
+    return 0;
+}
+
+// Returns the field names of the results, once the first row is read.
+static int
+streamFields (lua_State *L)
+{
+    luaL_checkudata(L, 1, STREAM_REGNAME);
+    lua_getfenv(L, 1);
+    lua_getfield(L, -1, "fields");
+    return 1;
+}
+
+// Send the query at stack position 3 and return a stream for reading its results, with
+// batch rows at a time. The parameters follow the query on the stack.
+static int
+startStream (lua_State *L, int batch)
+{
+    DBSession *s = luaL_checkudata(L, 1, SES_REGNAME);
+    const char *command = luaL_checkstring(L, 2);
+    int pc = lua_gettop(L) - 2;
+    int sent, rowMode;
+    ParamSet ps;
+
+    parametersFromStack(L, pc, 3, s->binaryParams, NULL, 0, &ps);
+    sent = PQsendQueryParams(s->conn, command, pc, ps.types, ps.values, ps.lengths, ps.formats,
+        s->binary);
+    if (sent) {
+#ifdef LIBPQ_HAS_CHUNK_MODE
+        rowMode = PQsetChunkedRowsMode(s->conn, batch ? batch : STREAM_CHUNK_ROWS);
+#else
+        rowMode = PQsetSingleRowMode(s->conn);
+#endif
+        if (!rowMode) {
+            PGresult *result;
+            while ((result = PQgetResult(s->conn))) {
+                PQclear(result);
+            }
+        }
+    }
+    if (!sent || !rowMode) {
+        lua_pushnil(L);
+        lua_pushstring(L, PQerrorMessage(s->conn));
+        return 2;
+    }
+    s->rowMode = 1;
+
+    Stream *st = lua_newuserdata(L, sizeof *st);
+    st->sess = s;
+    st->result = NULL;
+    st->row = 0;
+    st->batch = batch;
+    st->done = 0;
+    st->nfields = 0;
+    st->columns = NULL;
+    luaL_getmetatable(L, STREAM_REGNAME);
+    lua_setmetatable(L, -2);
+    // The environment keeps the session alive while streaming.
+    lua_createtable(L, 0, 2);
+    lua_pushvalue(L, 1);
+    lua_setfield(L, -2, "session");
+    lua_setfenv(L, -2);
+    return 1;
+}
+
+/* Run a query, returning a stream object that is called as an iterator for
+ * each row in turn. Rows are received from the server as they are read, so
+ * the full result set is never held in memory. */
+static int
+stream (lua_State *L)
+{
+    luaL_checkudata(L, 1, SES_REGNAME);
+    return startStream(L, 0);
+}
+
+/* Like stream, but the iterator returns arrays of up to size rows. */
+static int
+streamBatches (lua_State *L)
+{
+    luaL_checkudata(L, 1, SES_REGNAME);
+    int batch = luaL_checkint(L, 2);
+    luaL_argcheck(L, batch > 0, 2, "batch size must be positive");
+    lua_remove(L, 2);
+    return startStream(L, batch);
+}
+
+static int
+streamGC (lua_State *L)
+{
+    Stream *st = luaL_checkudata(L, 1, STREAM_REGNAME);
+    finishStream(st, 1);
+    return 0;
+}
+
+static const struct luaL_Reg streamMethods [] = {
+    {"close", streamClose},
+    {"fields", streamFields},
+    {"__call", streamCall},
+    {"__gc", streamGC},
+    {NULL, NULL}
+};
+
+void
+registerStream (lua_State *L)
+{
+    luaL_newmetatable(L, STREAM_REGNAME);
+    luaL_register(L, NULL, streamMethods);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+
+    luaL_getmetatable(L, SES_REGNAME);
+    lua_pushcfunction(L, stream);
+    lua_setfield(L, -2, "stream");
+    lua_pushcfunction(L, streamBatches);
+    lua_setfield(L, -2, "streamBatches");
+    lua_pop(L, 2);
+}
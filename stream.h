@@ -0,0 +1,25 @@
+#ifndef _STREAM_H
+#define _STREAM_H
+
+#include "session.h"
+
+#define STREAM_REGNAME "moonpg.stream"
+
+// Rows fetched per result in chunked rows mode, when streaming single rows.
+#define STREAM_CHUNK_ROWS 1000
+
+// The state of a query result being read a row, or a batch of rows, at a time.
+typedef struct {
+    DBSession *sess;
+    PGresult *result;   // The current chunk of rows.
+    int row;            // Next row of the current chunk.
+    int batch;          // Rows per batch, or 0 to return single rows.
+    int done;           // All results of the query have been read.
+    int nfields;
+    ColumnDecoder *columns;
+} Stream;
+
+void
+registerStream (lua_State *L);
+
+#endif
@@ -83,6 +83,91 @@ assert(cols[1] == 'city')
 assert(cols[3] == 'code')
 assert(cols[4] == nil)
 
+-- Stream rows one at a time.
+local count = 0
+for row in con:stream("select * from zipcodes where code > $1", 80000) do
+    assert(row.state)
+    count = count + 1
+end
+assert(count == 5)
+-- Stream rows in batches.
+local sizes = {}
+for batch in con:streamBatches(3, "select code from zipcodes") do
+    sizes[#sizes+1] = #batch
+    assert(type(batch[1].code) == 'number')
+end
+assert(#sizes == 3 and sizes[1] == 3 and sizes[3] == 1)
+-- Closing a stream early leaves the connection ready for other commands.
+local st = con:stream("select city from zipcodes")
+assert(st().city == 'Joppa')
+st:close()
+assert(st() == nil)
+res = con:run("select count(*) from zipcodes")
+assert(res[1].count == 7)
+-- A failing query raises an error while streaming.
+assert(not pcall(function ()
+    for row in con:stream("select nosuchcolumn from zipcodes") do end
+end))
+
+-- Lazy result objects decode rows as they are read.
+con:lazyResults(true)
+res = con:run("select * from zipcodes where state = $1", 'AZ')
+assert(#res == 2)
+assert(res[2].city == 'Why')
+assert(res[3] == nil)
+assert(res.fields[3] == 'code')
+assert(res:value(1, 'code') == 85321)
+assert(res:value(1, 2) == 'AZ')
+count = 0
+for i, row in res:rows() do
+    assert(row.code == 85321)
+    count = i
+end
+assert(count == 2)
+res:close()
+assert(#res == 0)
+assert(not pcall(function () return res[1] end))
+con:lazyResults(false)
+
+-- Columnar results return an array per column.
+con:columnarResults()
+res = con:run("select city, code, nullif(state, 'AZ') as state from zipcodes where state in ('AL', 'AZ') order by code")
+assert(res.count == 3)
+assert(res.fields[1] == 'city' and res.fields[3] == 'state')
+assert(res[1][1] == 'Joppa' and res[1][3] == 'Why')
+assert(res.columns.code == res[2])
+assert(res.columns.code[2] == 85321)
+assert(res.columns.state[1] == 'AL' and res.columns.state[2] == nil and res.columns.state[3] == nil)
+-- Numeric columns mapped to vectors are held natively.
+con:setTypeMap("code:Vector,state:Vector")
+res = con:run("select code, nullif(code, 72061) as n, state from zipcodes")
+local v = res.columns.code
+assert(#v == 7 and v:count() == 7)
+assert(v:sum() == 35087 + 99664 + 85321 * 2 + 72061 + 92354 + 81631)
+assert(v:min() == 35087 and v:max() == 99664)
+assert(v[1] == 35087)
+local big = v:filter(">", 85000)
+assert(#big == 4 and big:min() == 85321)
+assert(v:filter("<", 0):max() == nil)
+assert(type(res.columns.n) == 'table')
+assert(res.columns.state[1] == 'AL')
+con:setTypeMap("n:Vector")
+res = con:run("select nullif(code, 72061) as n, code * 0.5 as half from zipcodes")
+v = res.columns.n
+assert(#v == 7 and v:count() == 6 and v[4] == nil)
+assert(v:mean() == (35087 + 99664 + 85321 * 2 + 92354 + 81631) / 6)
+con:setTypeMap("half:Vector")
+res = con:run("select code * 0.5 as half from zipcodes")
+assert(res.columns.half:max() == 49832)
+con:setTypeMap("code:Vector,half:Vector,f:Vector")
+con:binaryResults(true)
+res = con:run("select code, code * 0.5 as half, cast(code as double precision) as f from zipcodes")
+con:binaryResults(false)
+assert(res.columns.code:sum() == res.columns.f:sum())
+assert(res.columns.half:sum() == res.columns.f:sum() / 2)
+con:setTypeMap()
+con:columnarResults(false)
+
 con:run"drop table zipcodes"
 
 -- Testing arrays
@@ -130,6 +215,30 @@ assert(b[2] == nil)
 assert(b[3] == "")
 assert(b[4] == sp2)
 
+-- Array text with many escapes, dimension decoration, empty arrays and bigint elements.
+con:setTypeMap("a:Array,e:Array,d:Array,n:Array")
+res = con:run[[select '{"{\"k\": 1}","x\\y",NULL,"NULL"}' as a, '{}' as e, '[0:1]={{1,2},{3,4}}' as d]]
+b = res[1].a
+assert(b[1] == '{"k": 1}' and b[2] == 'x\\y' and b[3] == nil and b[4] == 'NULL')
+assert(#res[1].e == 0)
+assert(res[1].d[2][1] == '3')
+-- An Array may be passed more than once, and several in one call share a buffer.
+local tags = Array({'a b', 'NULL', '', 'q"\\', {'x', 'y'}})
+res = con:run("select $1 as t, $2 as u, $3 as v", tags, tags, Array({true, false, 0.1}))
+assert(res[1].t == [[{"a b","NULL","","q\"\\",{x,y}}]])
+assert(res[1].u == res[1].t)
+assert(res[1].v == '{t,f,0.1}')
+-- Other userdata are not parameters.
+assert(not pcall(con.run, con, "select $1 as t", con))
+con:binaryParams(true)
+assert(not pcall(con.run, con, "select $1 as t", con))
+con:binaryParams(false)
+con:run"create table bigs (n bigint[])"
+con:run"insert into bigs values ('{4294967296,-3000000000}')"
+res = con:run"select n from bigs"
+assert(res[1].n[1] == 4294967296 and res[1].n[2] == -3000000000)
+con:run"drop table bigs"
+
 con:run"drop table schedule"
 
 -- Test type values
@@ -149,9 +258,10 @@ assert(res[1][3] == val2)
 assert(res[1][4] == val3)
 -- Numeric type returned as a string.
 assert(res[2][4] == tostring(val1))
--- Numeric returned as number
+-- Numeric returned as number, once the type map is cleared.
 val1 = 3.14159
 con:arrayKeys(false)
+con:setTypeMap()
 con:run("insert into type_test (a, d) values (FALSE, $1)", val1)
 res = con:run"select d from type_test where a = FALSE"
 assert(res[1].d == val1)
@@ -228,6 +338,572 @@ assert(path.closed == false)
 
 con:run"drop table geo_test"
 
+-- Test binary result format
+con:run[[create table bin_test (i integer, b bigint, f double precision, r real, n numeric,
+    t boolean, s text, ts timestamp, u uuid, a integer[], x bytea, p point)]]
+val1 = '12345678901234567890.1234'
+val2 = 'a0eebc99-9c0b-4ef8-bb6d-6bb9bd380a11'
+con:run("insert into bin_test values (42, $1, $2, 2.5, $3, TRUE, 'text', $4, $5, $6, $7, $8)",
+    '1234567890123', '1234567890.1234', val1, '2010-06-15 13:45:30.25', val2, Array{{1,2},{3,4}},
+    '\\x00ff41', pg.Point(1.5, -2))
+con:binaryResults(true)
+con:setTypeMap('n:String')
+res = con:run"select * from bin_test"
+p = res[1]
+assert(p.i == 42)
+assert(p.b == 1234567890123)
+assert(p.f == 1234567890.1234)
+assert(p.r == 2.5)
+assert(p.n == val1)
+assert(p.t == true)
+assert(p.s == 'text')
+assert(p.ts == '2010-06-15 13:45:30.25')
+assert(p.u == val2)
+assert(p.a[2][1] == 3)
+assert(p.x == '\0\255A')
+assert(p.p.x == 1.5 and p.p.y == -2)
+-- Parameters and prepared statements also return binary results.
+con:setTypeMap()
+res = con:run("select n from bin_test where i = $1", 42)
+assert(res[1].n == tonumber(val1))
+prep = con:prepare("select i, n from bin_test")
+res = prep:run()
+assert(res[1].i == 42)
+prep:binaryResults(false)
+res = prep:run()
+assert(res[1].i == 42)
+con:binaryResults(false)
+
+con:run"drop table bin_test"
+
+-- Test binary parameters
+con:run"create table param_test (i integer, b bigint, f double precision, t boolean, a integer[], d float8[])"
+con:binaryParams(true)
+val1 = 0.1 + 0.2
+p, err = con:run("insert into param_test values ($1, $2, $3, $4, $5, $6)",
+    7, 2^53, val1, true, Array{{1,2},{3,4}}, Array{0.5, 1.25})
+assert(p == 1)
+con:binaryResults(true)
+res = con:run("select * from param_test where i = $1 and t = $2", 7, true)
+p = res[1]
+assert(p.b == 2^53)
+assert(p.f == val1)
+assert(p.a[2][2] == 4)
+assert(p.d[2] == 1.25)
+-- A prepared statement sends its parameters in the types described by the server.
+prep = con:prepare("insert into param_test (i, f, t) values ($1, $2, $3)")
+assert(prep:run(8, 1, false) == 1)
+prep = con:prepare("select f from param_test where i = $1")
+res = prep:run(8)
+assert(res[1].f == 1)
+-- Strings are still sent as text.
+res = con:run("select i from param_test where i = $1", '8')
+assert(res[1].i == 8)
+con:binaryParams(false)
+con:binaryResults(false)
+-- Geometric values keep their full precision.
+p = pg.Point(1/3, -2.5e-300)
+con:run"create table geo_prec (p point)"
+con:run("insert into geo_prec values ($1)", p)
+con:setTypeMap('p:Point')
+res = con:run"select p from geo_prec"
+assert(res[1].p.x == 1/3)
+assert(res[1].p.y == -2.5e-300)
+con:run"drop table geo_prec"
+
+con:run"drop table param_test"
+
+-- Test COPY FROM STDIN
+con:run"create table copy_test (id integer, name text, score double precision)"
+local writer = con:copyIn("copy copy_test from stdin")
+assert(writer:write{1, 'tab\tand\\slash', 0.1})
+assert(writer:writeRows{{2, 'two', nil}, {3, nil, 1e300}})
+assert(writer:flush())
+assert(writer:finish() == 3)
+res = con:run"select * from copy_test order by id"
+assert(#res == 3)
+assert(res[1].name == 'tab\tand\\slash')
+assert(res[1].score == 0.1)
+assert(res[2].score == nil)
+assert(res[3].name == nil)
+-- The binary format needs the column types.
+writer = con:copyIn("copy copy_test from stdin (format binary)", {'int4', 'text', 'float8'})
+for i = 4, 1003 do
+    writer:write{i, 'row' .. i, i / 3}
+end
+assert(writer:finish() == 1000)
+res = con:run("select * from copy_test where id = $1", 1003)
+assert(res[1].name == 'row1003')
+assert(res[1].score == 1003 / 3)
+-- Strings go to number columns by their value, and only text of a number does.
+writer = con:copyIn("copy copy_test from stdin (format binary)", {'int4', 'text', 'float8'})
+writer:write{'1004', 'row1004', '2.5'}
+assert(not pcall(writer.write, writer, {'abcd', 'bad', 0}))
+assert(not pcall(writer.write, writer, {1005, con, 0}))
+assert(writer:finish() == 1)
+res = con:run("select * from copy_test where id = $1", 1004)
+assert(res[1].name == 'row1004' and res[1].score == 2.5)
+con:run("delete from copy_test where id = $1", 1004)
+res, err = con:copyIn("copy copy_test from stdin (format binary)")
+assert(res == false)
+-- An aborted COPY adds no rows.
+writer = con:copyIn("copy copy_test from stdin")
+writer:write{2000, 'never', 0}
+assert(writer:finish('stopped') == false)
+assert(not pcall(writer.write, writer, {1}))
+res = con:run"select count(*) from copy_test"
+assert(res[1].count == 1003)
+-- Test COPY TO STDOUT
+local chunks = {}
+assert(con:copyOut("copy (select * from copy_test where id < 3 order by id) to stdout",
+    function (chunk) chunks[#chunks+1] = chunk end) == 2)
+assert(chunks[1] == '1\ttab\\tand\\\\slash\t0.1\n')
+local rows = {}
+assert(con:copyOut("copy (select * from copy_test where id < 4 order by id) to stdout",
+    function (row) rows[#rows+1] = row end, true) == 3)
+assert(rows[1][2] == 'tab\tand\\slash')
+assert(rows[2][3] == nil)
+rows = {}
+assert(con:copyOut("copy (select * from copy_test where id > 1000 order by id) to stdout (format binary)",
+    function (row) rows[#rows+1] = row end, {'int4', 'text', 'float8'}) == 3)
+assert(rows[3][1] == 1003 and rows[3][2] == 'row1003' and rows[3][3] == 1003 / 3)
+local path = os.tmpname()
+assert(con:copyOut("copy (select id from copy_test where id < 3 order by id) to stdout", path) == 2)
+local f = io.open(path)
+assert(f:read('*a') == '1\n2\n')
+f:close()
+os.remove(path)
+assert(not pcall(con.copyOut, con, "copy copy_test to stdout", function () error('stop') end))
+res = con:run"select count(*) from copy_test"
+assert(res[1].count == 1003)
+con:run"drop table copy_test"
+
+-- Test pipeline mode
+con:run"create table pipe_test (id integer primary key, name text)"
+prep = con:prepare("select id from pipe_test where name = $1")
+local pipe = con:pipeline()
+for i = 1, 50 do
+    assert(pipe:run("insert into pipe_test values ($1, $2)", i, 'name' .. i))
+end
+pipe:sync()
+assert(pipe:run("select name from pipe_test where id = $1", 7))
+assert(pipe:run("select nosuchcolumn from pipe_test"))
+assert(pipe:run("select count(*) from pipe_test"))
+pipe:sync()
+assert(pipe:run("select count(*) from pipe_test"))
+local results, errors = pipe:execute()
+assert(#results == 54)
+assert(results[50] == 1)
+assert(results[51][1].name == 'name7')
+assert(results[52] == false and errors[52])
+assert(results[53] == false and errors[53])
+assert(results[54][1].count == 50)
+assert(errors[51] == nil)
+-- The pipeline can be reused after its results are read.
+assert(pipe:run("select 1 as one"))
+assert(pipe:run(prep, 'name9'))
+results = pipe:execute()
+assert(results[1][1].one == 1)
+assert(results[2][1].id == 9)
+-- A prepared object of another connection is refused.
+local other = pg.connect('dbname=postgres')
+local otherPrep = other:prepare("select 1 as one")
+assert(not pcall(pipe.run, pipe, otherPrep))
+other:close()
+assert(pipe:close())
+assert(not pcall(pipe.run, pipe, "select 1"))
+res = con:run"select count(*) from pipe_test"
+assert(res[1].count == 50)
+con:run"drop table pipe_test"
+
+-- Test the prepared statement cache
+con:run"create table cache_test (id integer, name text)"
+con:cacheStatements(2)
+for i = 1, 3 do
+    assert(con:run("insert into cache_test values ($1, $2)", i, 'n' .. i) == 1)
+end
+local stats = con:cacheStats()
+assert(stats.misses == 1 and stats.hits == 2 and stats.size == 1)
+assert(con:run("select name from cache_test where id = $1", 2)[1].name == 'n2')
+assert(con:run("select id from cache_test where name = $1", 'n3')[1].id == 3)
+stats = con:cacheStats()
+assert(stats.evictions == 1 and stats.size == 2 and stats.pending == 1)
+-- A command that can not be prepared gives its error as usual.
+res, err = con:run("select nosuchcolumn from cache_test where id = $1", 1)
+assert(res == false and err)
+-- In a transaction too, rather than the error of the transaction it aborted.
+con:run"begin"
+res, err = con:run("select nosuchcolumn from cache_test where id = $1", 1)
+assert(res == false and err:match("nosuchcolumn") and not err:match("aborted"))
+con:run"rollback"
+con:cacheStatements(0)
+stats = con:cacheStats()
+assert(stats.size == 0 and stats.pending == 0)
+-- Deallocations wait for the end of a transaction and skip the statements already gone.
+collectgarbage()
+con:cacheStatements(1)
+assert(con:cacheStats().pending == 0)
+con:run("select id from cache_test where id = $1", 1)
+con:run"begin"
+con:run"deallocate all"
+con:run("select name from cache_test where id = $1", 1)
+con:cacheStatements(1)
+assert(con:cacheStats().pending == 1)
+assert(con:run("select count(*) from cache_test where id > $1", 0)[1].count == 3)
+con:run"commit"
+con:cacheStatements(0)
+assert(con:cacheStats().pending == 0)
+assert(con:run("select id from cache_test where id = $1", 2)[1].id == 2)
+assert(con:run("select count(*) from cache_test where id > $1", 0)[1].count == 3)
+-- Deallocating a prepared statement.
+prep = con:prepare("select id from cache_test where name = $1")
+assert(prep:run('n1')[1].id == 1)
+assert(prep:deallocate())
+assert(prep:run('n1') == false)
+-- Collected prepared statements are deallocated with the next batch.
+prep = con:prepare("select name from cache_test where id = $1")
+prep = nil
+collectgarbage()
+assert(con:cacheStats().pending >= 1)
+con:run"drop table cache_test"
+
+-- Test the type map
+con:run"create table map_test (n numeric, nn numeric)"
+con:run"insert into map_test values (1.5, 2.5)"
+con:setTypeMap('n:String')
+-- The map stays set for the following queries, and matches whole field names.
+for i = 1, 2 do
+    res = con:run"select * from map_test"
+    assert(res[1].n == '1.5' and res[1].nn == 2.5)
+end
+prep = con:prepare("select n from map_test")
+assert(prep:run()[1].n == 1.5)
+prep:setTypeMap('n:String')
+assert(prep:run()[1].n == '1.5')
+con:setTypeMap()
+assert(con:run"select n from map_test"[1].n == 1.5)
+assert(not pcall(con.setTypeMap, con, 'n:Strung'))
+assert(not pcall(con.setTypeMap, con, 'n'))
+con:run"drop table map_test"
+
+-- Test the scheduler
+local sched = pg.scheduler(0.2)
+local cons = {con, pg.connect('dbname=postgres'), pg.connect('dbname=postgres')}
+local got = {}
+for i = 1, 3 do
+    sched:spawn(function (c, n)
+        local r = sched:run(c, "select $1 as n", n)
+        got[n] = r[1].n
+        sched:sleep(0.01)
+        r = sched:run(c, "select 1 as one; select " .. n .. " as n")
+        got[n] = got[n] .. r[1].n
+    end, cons[i], i)
+end
+sched:loop()
+assert(got[1] == '11' and got[2] == '22' and got[3] == '33')
+sched:spawn(function ()
+    local ok, err = sched:run(cons[2], "select pg_sleep(0.4)")
+    got.timeout = err
+    got.after = sched:run(cons[2], "select 5 as five")[1].five
+end)
+sched:spawn(function ()
+    -- Past the sleep, as the server may not get to this command before the timeout.
+    sched:sleep(0.5)
+    local ok, err = sched:run(con, "select nosuchcolumn from nosuchtable")
+    got.err = err
+end)
+sched:loop()
+assert(got.timeout == 'Command timed out' and got.after == 5)
+assert(got.err:match('nosuch'))
+sched:spawn(function () error('task failed') end)
+assert(not pcall(sched.loop, sched))
+assert(not pcall(sched.run, sched, con, "select 1"))
+cons[2]:close()
+cons[3]:close()
+
+-- Test the connection pool
+local pool = pg.pool{conninfo = 'dbname=postgres', min = 1, max = 2}
+assert(pool:stats().open == 1 and pool:stats().idle == 1)
+local c1 = pool:checkout()
+local c2 = pool:checkout()
+assert(c1 and c2 and c1 ~= c2)
+local c3, err = pool:checkout()
+assert(c3 == nil and err)
+assert(pool:stats().exhausted == 1 and pool:stats().utilization == 1)
+-- A transaction left open is rolled back, and options are reset, on checkin.
+c1:run"begin"
+c1:lazyResults(true)
+local pid = c1:backendPID()
+pool:checkin(c1)
+assert(not pcall(pool.checkin, pool, c1))
+c1 = pool:checkout()
+assert(c1:backendPID() == pid)
+res = c1:run"select 1 as one"
+assert(type(res) == 'table' and res[1].one == 1)
+assert(pool:stats().reused == 2)
+-- A closed session is dropped on checkin.
+c1:close()
+pool:checkin(c1)
+assert(pool:stats().discarded == 1)
+pool:checkin(c2)
+local stats = pool:stats()
+assert(stats.open == 1 and stats.idle == 1 and stats.inUse == 0 and stats.peakInUse == 2)
+pool:close()
+assert(pool:stats().open == 0)
+assert(not pcall(pool.checkout, pool))
+
+-- Test the thread-pool executor
+con:run"create table jobs (state char(2), code integer, done boolean)"
+for i = 1, 30 do
+    con:run("insert into jobs values ('" .. (i % 3 == 0 and 'CA' or 'NY') .. "', " .. i .. ", " .. (i % 2 == 0 and 'true' or 'false') .. ")")
+end
+local ex = pg.executor{conninfo = 'dbname=postgres', threads = 2}
+local ids = {}
+for _, state in ipairs{'CA', 'NY', 'TX'} do
+    ids[state] = ex:submit("select code, state, done from jobs where state = $1 order by code", state)
+end
+local bad = ex:submit("select nosuch from jobs")
+local n = ex:submit("update jobs set code = code where state = $1", 'CA')
+assert(ex:pending() == 5 and type(ex:fd()) == 'number')
+assert(not pcall(ex.submit, ex, "select $1", con))
+local results, errors = {}, {}
+while ex:pending() > 0 do
+    local r, e = ex:collect(true)
+    for id, v in pairs(r) do results[id] = v end
+    for id, v in pairs(e) do errors[id] = v end
+end
+local direct = con:run("select code, state, done from jobs where state = 'CA' order by code")
+assert(#results[ids.CA] == 10 and results[ids.CA][1].code == direct[1].code)
+assert(results[ids.CA][2].done == direct[2].done and type(results[ids.CA][2].done) == 'boolean')
+assert(results[ids.CA].fields[1] == 'code' and results[ids.NY][1].state == 'NY')
+assert(#results[ids.TX] == 0)
+assert(results[bad] == false and errors[bad]:match("nosuch"))
+assert(results[n] == #direct)
+local r, e = ex:collect()
+assert(next(r) == nil and next(e) == nil)
+ex:close()
+assert(not pcall(ex.submit, ex, "select 1"))
+con:run"drop table jobs"
+
+-- Test decoding large results on threads
+con:run"create table pd (i integer, f double precision, b boolean, t text)"
+con:run"insert into pd with recursive s(n) as (select 1 union all select n + 1 from s where n < 20000) select n, n / 4.0, n % 2 = 0, 'r' || n from s"
+con:run"update pd set f = null where i % 1000 = 0"
+local serial = con:run"select i, f, b, t from pd order by i"
+con:parallelDecode(4)
+local par = con:run"select i, f, b, t from pd order by i"
+assert(#par == 20000 and par[20000].i == 20000 and par[3].f == 0.75 and par[1000].f == nil)
+for k = 1, #serial do
+    local a, b = serial[k], par[k]
+    assert(a.i == b.i and a.f == b.f and a.b == b.b and a.t == b.t)
+end
+con:columnarResults(true)
+res = con:run"select i, b from pd order by i"
+assert(res.columns.i[19999] == 19999 and res.columns.b[2] == true)
+con:columnarResults(false)
+con:parallelDecode(1)
+con:run"drop table pd"
+
+-- Test scattering a command to several connections
+con:run"create table shardt (k integer, v text)"
+con:run"insert into shardt values (1, 'a')"
+con:run"insert into shardt values (2, 'b')"
+con:run"insert into shardt values (3, 'c')"
+local shards = {con, pg.connect('dbname=postgres'), pg.connect('dbname=postgres')}
+res = pg.scatter(shards, "select k, v from shardt where k <= $1 order by k", {{1}, {2}, {3}})
+assert(#res == 6 and res.fields[2] == 'v')
+assert(res[1].k == 1 and res[2].k == 1 and res[3].v == 'b' and res[6].k == 3)
+res = pg.scatter(shards, "select k from shardt where k = $1", 2)
+assert(#res == 3 and res[3].k == 2)
+assert(pg.scatter(shards, "update shardt set v = v") == 9)
+local ok, err = pg.scatter(shards, "select nosuch from shardt")
+assert(ok == false and err:match("^shard 1:"))
+assert(not pcall(pg.scatter, shards, "select $1", {{1}, 2}))
+assert(con:run"select 1 as one"[1].one == 1)
+local s1, i1 = pg.shard(shards, 42)
+local s2, i2 = pg.shard(shards, "42")
+assert(s1 == s2 and i1 == i2 and shards[i1] == s1)
+shards[2]:close()
+shards[3]:close()
+con:run"drop table shardt"
+
+-- Test routing reads to replicas
+local router = pg.router{primary = 'dbname=postgres', replicas = {'dbname=postgres', 'dbname=postgres'}}
+local primary, at = router:route()
+assert(at == 0 and router:route("insert into t values (1)") == primary)
+local r1, i1 = router:route("select 1")
+local r2, i2 = router:route(" -- comment\n SELECT 1;")
+assert(i1 == 1 and i2 == 2 and r1 ~= primary and r2 ~= r1)
+for _, command in ipairs{"select * from t for update", "select 1 into t2", "select 1; delete from t"} do
+    assert(select(2, router:route(command)) == 0)
+end
+assert(select(2, router:route("select 'for update'")) > 0)
+assert(router:run("select 1 as one")[1].one == 1)
+assert(router:read("select 2 as two")[1].two == 2)
+assert(router:write("select 3 as three")[1].three == 3)
+router:run"begin"
+assert(select(2, router:route("select 1")) == 0)
+router:run"rollback"
+local lags = router:checkLag()
+assert(#lags == 2 and lags[1] == 0)
+local stats = router:stats()
+assert(stats.primary == 3 and stats.replicas[1].commands + stats.replicas[2].commands == 2)
+assert(stats.replicas[1].healthy and stats.fallbacks == 0)
+router:close()
+assert(not pcall(router.run, router, "select 1"))
+
+-- Test waiting for notifications
+local listener = pg.connect('dbname=postgres')
+listener:run"listen cache"
+local notes = listener:waitNotifies(0.2)
+assert(type(notes) == 'table' and #notes == 0)
+con:run"notify cache, 'key1'"
+con:run"notify cache, 'key2'"
+con:run"notify cache"
+-- Notifications may arrive apart, each ending a wait, so they are gathered up to a deadline.
+local function waitFor (n)
+    local got, deadline = {}, pg.clock() + 5
+    while #got < n and pg.clock() < deadline do
+        for _, note in ipairs(listener:waitNotifies(math.max(deadline - pg.clock(), 0), n - #got)) do
+            got[#got + 1] = note
+        end
+    end
+    return got
+end
+notes = waitFor(2)
+assert(#notes == 2 and notes[1].name == 'cache' and notes[1].payload == 'key1')
+assert(notes[2].payload == 'key2' and notes[1].pid == con:backendPID())
+notes = waitFor(1)
+assert(#notes == 1 and notes[1].payload == '')
+assert(#listener:waitNotifies(0) == 0)
+-- A timeout past the range of poll is clamped.
+con:run"notify cache, 'key3'"
+notes = listener:waitNotifies(1e10)
+assert(#notes >= 1 and notes[1].payload == 'key3')
+listener:close()
+
+-- Test counting statements
+local sc = pg.connect('dbname=postgres')
+assert(#sc:stats() == 0)
+sc:trackStats()
+sc:run"create table statst (k integer, v text)"
+for i = 1, 5 do
+    sc:run("insert into statst values (" .. i .. ", 'v" .. i .. "')")
+end
+sc:run("select k, v from statst where k > $1", 2)
+sc:run("SELECT  k, v FROM statst WHERE k > $1", 0)
+sc:run"select nosuch from statst"
+local sprep = sc:prepare("select v from statst where k = $1")
+sprep:run(1)
+sprep:run(2)
+local byStatement = {}
+for _, st in ipairs(sc:stats()) do byStatement[st.statement] = st end
+local ins = byStatement["insert into statst values (?, ?)"]
+assert(ins and ins.calls == 5 and ins.errors == 0 and ins.latency > 0)
+local sel = byStatement["select k, v from statst where k > $1"]
+assert(sel and sel.calls == 2 and sel.rows == 8 and sel.bytes > 0 and sel.decode >= 0)
+assert(sel.p50 <= sel.maxLatency and sel.p99 <= sel.maxLatency and sel.maxLatency <= sel.latency)
+local n = 0
+for _, c in ipairs(sel.histogram) do n = n + c end
+assert(n == 2)
+assert(byStatement["select nosuch from statst"].errors == 1)
+local pst = sprep:stats()
+assert(pst.calls == 2 and pst.rows == 2 and pst.statement == "select v from statst where k = $1")
+sc:resetStats()
+assert(#sc:stats() == 0 and sprep:stats() == nil)
+sc:run"drop table statst"
+sc:trackStats(false)
+sc:run"select 1"
+assert(#sc:stats() == 0)
+sc:close()
+local spool = pg.pool{conninfo = 'dbname=postgres', min = 2, trackStats = true}
+local p1, p2 = spool:checkout(), spool:checkout()
+p1:run"select 1 as one"
+p2:run"select 2 as one"
+spool:checkin(p1)
+local pstats = spool:stats().statements
+assert(#pstats == 1 and pstats[1].statement == "select ? as one" and pstats[1].calls == 2)
+spool:checkin(p2)
+spool:close()
+
+-- Test tracing calls
+local tc = pg.connect('dbname=postgres')
+tc:run"drop table if exists tracet"
+tc:startTrace{size = 4}
+tc:run"create table tracet (k integer)"
+for i = 1, 3 do
+    tc:run("insert into tracet values ($1)", i)
+end
+local trecs = tc:traceRecords()
+assert(#trecs == 4 and trecs[1].kind == 'run' and trecs[1].nparams == 0)
+assert(trecs[4].nparams == 1 and trecs[4].status == 'PGRES_COMMAND_OK' and trecs[4].wait >= 0)
+assert(trecs[2].statement == trecs[4].statement and trecs[1].statement ~= trecs[2].statement)
+assert(trecs[1].time <= trecs[4].time and math.abs(trecs[4].time - os.time()) < 60)
+local tprep = tc:prepare("select k from tracet where k >= $1")
+tprep:run(2)
+tc:asyncRun("select k from tracet")
+while tc:getResult() do end
+trecs = tc:traceRecords()
+assert(#trecs == 4 and trecs[2].kind == 'runPrepared' and trecs[2].rows == 2)
+assert(trecs[3].kind == 'asyncRun' and trecs[3].rows == nil and trecs[3].send >= 0)
+assert(trecs[4].kind == 'getResult' and trecs[4].rows == 3 and trecs[4].bytes > 0)
+assert(trecs[4].statement == trecs[3].statement)
+local tpath = os.tmpname()
+assert(tc:dumpTrace(tpath) == 4)
+local lines, realPrint = {}, print
+print = function (...) lines[#lines + 1] = table.concat({...}, '\t') end
+arg = {tpath}
+dofile('tools/readtrace.lua')
+print = realPrint
+os.remove(tpath)
+assert(#lines == 5 and lines[5]:match('\tgetResult\t0\t3\t'))
+assert(tc:dumpTrace('/nonexistent/trace.bin') == false)
+tc:startTrace{sample = 0, slow = 3600}
+tc:run"select 1"
+assert(#tc:traceRecords() == 0)
+tc:run"drop table tracet"
+tc:stopTrace()
+assert(not pcall(tc.traceRecords, tc))
+tc:close()
+
+-- Test capturing the plans of slow statements
+local ec = pg.connect('dbname=postgres')
+assert(next(ec:plans()) == nil)
+ec:explainSlow{threshold = 0.1, sample = 1, interval = 60, max = 2}
+ec:run"select pg_sleep(0.15)"
+ec:run"select 1"
+local eprep = ec:prepare("select pg_sleep($1), $2::int")
+eprep:run(0.15, 7)
+local eplans = ec:plans()
+local ep = eplans["select pg_sleep(?)"]
+assert(ep and ep.captures == 1 and ep.latency >= 0.1 and ep.plan:match('"Plan"'))
+assert(eplans["select pg_sleep($1), $2::int"] and eplans["select 1"] == nil)
+ec:run"select pg_sleep(0.12)"
+assert(ec:plans()["select pg_sleep(?)"].captures == 1)
+ec:run"select pg_sleep(0.11), 2"
+eplans = ec:plans()
+assert(eplans["select pg_sleep(?), ?"] and eplans["select pg_sleep(?)"] == nil)
+ec:explainSlow{threshold = 0.1, sample = 0}
+ec:run"select pg_sleep(0.15)"
+assert(next(ec:plans()) == nil)
+ec:explainSlow(false)
+assert(next(ec:plans()) == nil)
+ec:close()
+
+-- Test a pipeline right after a stream, which leaves libpq in single row mode
+local rc = pg.connect('dbname=postgres')
+for _ in rc:stream("select 1 as c1 union all select 2") do end
+local rpipe = rc:pipeline()
+rpipe:run("select 1 as c1 union all select 2")
+local rres = rpipe:execute()
+assert(#rres == 1 and #rres[1] == 2)
+rpipe:close()
+rc:close()
+
+-- Test the monotonic clock
+local clockStart = pg.clock()
+assert(type(clockStart) == 'number' and pg.clock() >= clockStart)
+
 print('All tests Passed!')
 
 
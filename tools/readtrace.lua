@@ -0,0 +1,67 @@
+-- Prints a trace dumped by connection:dumpTrace as tab separated values, a line per record.
+--
+--     lua tools/readtrace.lua trace.bin
+
+local kinds = {'run', 'runPrepared', 'asyncRun', 'getResult'}
+local RESULT, SLOW = 1, 4
+
+local function uint (s, i, n)
+    local v = 0
+    for k = i + n - 1, i, -1 do
+        v = v * 256 + s:byte(k)
+    end
+    return v
+end
+
+local function float (s, i, n)
+    local bits = uint(s, i, n)
+    local ebits = n == 4 and 8 or 11
+    local mbits = n * 8 - 1 - ebits
+    local bias = 2 ^ (ebits - 1) - 1
+    local sign = bits >= 2 ^ (n * 8 - 1) and -1 or 1
+    local e = math.floor(bits / 2 ^ mbits) % 2 ^ ebits
+    local m = bits % 2 ^ mbits
+    if e == 0 then
+        return sign * m * 2 ^ (1 - bias - mbits)
+    elseif e == 2 ^ ebits - 1 then
+        return m == 0 and sign / 0 or 0 / 0
+    end
+    return sign * (1 + m / 2 ^ mbits) * 2 ^ (e - bias)
+end
+
+local path = arg[1]
+if not path then
+    error('usage: readtrace.lua file')
+end
+local f, err = io.open(path, 'rb')
+if not f then
+    error(err)
+end
+local data = f:read('*a')
+f:close()
+assert(data:sub(1, 8) == 'MPGTRACE', 'not a trace file')
+local version, size, count = uint(data, 9, 4), uint(data, 13, 4), uint(data, 17, 4)
+assert(version == 1, 'unknown trace version ' .. version)
+assert(#data >= 24 + size * count, 'truncated trace file')
+
+print('time', 'statement', 'kind', 'nparams', 'rows', 'bytes', 'status', 'send', 'wait',
+    'decode', 'slow')
+for n = 0, count - 1 do
+    local i = 25 + n * size
+    local flags = uint(data, i + 22, 2)
+    local result = flags % (2 * RESULT) >= RESULT
+    local function ifResult (v)
+        return result and v or ''
+    end
+    print(string.format('%.6f', float(data, i, 8)),
+        string.format('%08x', uint(data, i + 8, 4)),
+        kinds[uint(data, i + 12, 2)] or '?',
+        uint(data, i + 14, 2),
+        ifResult(uint(data, i + 16, 4)),
+        ifResult(string.format('%.0f', float(data, i + 24, 8))),
+        ifResult(uint(data, i + 20, 2)),
+        string.format('%.6f', float(data, i + 32, 4)),
+        ifResult(string.format('%.6f', float(data, i + 36, 4))),
+        ifResult(string.format('%.6f', float(data, i + 40, 4))),
+        flags % (2 * SLOW) >= SLOW and 'slow' or '')
+end
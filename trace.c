@@ -0,0 +1,271 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <time.h>
+#include "trace.h"
+
+static const char *const kindNames[] = {
+    [traceRun] = "run",
+    [traceRunPrepared] = "runPrepared",
+    [traceAsyncRun] = "asyncRun",
+    [traceGetResult] = "getResult"
+};
+
+// The id of a statement in the trace: the id of a prepared statement, or else a hash of the
+// command.
+uint32_t
+traceStatement (const char *command, unsigned int sid)
+{
+    if (sid || !command) {
+        return sid;
+    }
+    return fnv1a(command, strlen(command));
+}
+
+// Keep a record of a call begun at the monotonic time start, if it is sampled or slow. The
+// sample of its result is NULL for a command only sent, whose statement is then kept for
+// the record of its results.
+void
+traceCall (Trace *t, TraceKind kind, uint32_t statement, int nparams, double start, double send,
+    const StatementSample *sample)
+{
+    struct timespec ts;
+    double now = monotonicTime();
+    int flags = sampleDraw(&t->random, t->sample) ? TRACE_SAMPLED : 0;
+    if (kind == traceAsyncRun) {
+        t->pending = statement;
+    }
+    if (t->slow > 0 && now - start >= t->slow) {
+        flags |= TRACE_SLOW;
+    }
+    if (!flags) {
+        return;
+    }
+    TraceRecord *r = t->records + t->next;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    r->time = ts.tv_sec + ts.tv_nsec / 1e9 - (now - start);
+    r->statement = statement;
+    r->kind = kind;
+    r->nparams = nparams;
+    r->send = send;
+    if (sample) {
+        flags |= TRACE_RESULT;
+        r->rows = sample->rows;
+        r->bytes = sample->bytes;
+        r->status = sample->status;
+        r->wait = sample->latency;
+        r->decode = sample->decode;
+    }
+    else {
+        r->rows = 0;
+        r->bytes = 0;
+        r->status = 0;
+        r->wait = 0;
+        r->decode = 0;
+    }
+    r->flags = flags;
+    t->next = (t->next + 1) % t->size;
+    t->count = MIN(t->count + 1, t->size);
+}
+
+void
+freeTrace (Trace *t)
+{
+    if (t) {
+        free(t->records);
+        free(t);
+    }
+}
+
+static Trace *
+checkTrace (lua_State *L)
+{
+    DBSession *s = luaL_checkudata(L, 1, SES_REGNAME);
+    if (!s->trace) {
+        luaL_error(L, "not tracing");
+    }
+    return s->trace;
+}
+
+// Get the record n of the trace t, from the oldest.
+static const TraceRecord *
+traceRecord (const Trace *t, int n)
+{
+    return t->records + (t->next - t->count + n + t->size) % t->size;
+}
+
+/* Keeps records of the latest calls of run, asyncRun and getResult of the
+ * connection, and of run of its prepared objects, from a table of options:
+ * size, the number of records kept, sample, the fraction of the calls
+ * recorded, and slow, the seconds over which a call is always recorded.
+ * Records kept before are dropped. */
+static int
+startTrace (lua_State *L)
+{
+    DBSession *s = luaL_checkudata(L, 1, SES_REGNAME);
+    int size = TRACE_SIZE;
+    lua_Number sample = 1, slow = 0;
+    if (!lua_isnoneornil(L, 2)) {
+        luaL_checktype(L, 2, LUA_TTABLE);
+        lua_getfield(L, 2, "size");
+        lua_getfield(L, 2, "sample");
+        lua_getfield(L, 2, "slow");
+        size = luaL_optint(L, 3, TRACE_SIZE);
+        sample = luaL_optnumber(L, 4, 1);
+        slow = luaL_optnumber(L, 5, 0);
+        luaL_argcheck(L, size > 0, 2, "size must be positive");
+    }
+    Trace *t = calloc(1, sizeof *t);
+    if (t) {
+        t->records = malloc(size * sizeof *t->records);
+    }
+    if (!t || !t->records) {
+        freeTrace(t);
+        return luaL_error(L, "out of memory");
+    }
+    t->size = size;
+    t->sample = sample;
+    t->slow = slow;
+    t->random = 2463534242u ^ (uint32_t)(size_t)s;
+    freeTrace(s->trace);
+    s->trace = t;
+    return 0;
+}
+
+/* Stops keeping records, dropping those kept. */
+static int
+stopTrace (lua_State *L)
+{
+    DBSession *s = luaL_checkudata(L, 1, SES_REGNAME);
+    freeTrace(s->trace);
+    s->trace = NULL;
+    return 0;
+}
+
+/* Returns an array of the records kept, from the oldest, each a table. */
+static int
+traceRecords (lua_State *L)
+{
+    Trace *t = checkTrace(L);
+    lua_createtable(L, t->count, 0);
+    for (int n = 0; n < t->count; n++) {
+        const TraceRecord *r = traceRecord(t, n);
+        lua_createtable(L, 0, 12);
+        lua_pushnumber(L, r->time);
+        lua_setfield(L, -2, "time");
+        lua_pushnumber(L, r->statement);
+        lua_setfield(L, -2, "statement");
+        lua_pushstring(L, kindNames[r->kind]);
+        lua_setfield(L, -2, "kind");
+        lua_pushinteger(L, r->nparams);
+        lua_setfield(L, -2, "nparams");
+        if (r->flags & TRACE_RESULT) {
+            lua_pushnumber(L, r->rows);
+            lua_setfield(L, -2, "rows");
+            lua_pushnumber(L, r->bytes);
+            lua_setfield(L, -2, "bytes");
+            lua_pushstring(L, PQresStatus(r->status));
+            lua_setfield(L, -2, "status");
+            lua_pushnumber(L, r->wait);
+            lua_setfield(L, -2, "wait");
+            lua_pushnumber(L, r->decode);
+            lua_setfield(L, -2, "decode");
+        }
+        lua_pushnumber(L, r->send);
+        lua_setfield(L, -2, "send");
+        lua_pushboolean(L, r->flags & TRACE_SLOW);
+        lua_setfield(L, -2, "slow");
+        lua_rawseti(L, -2, n + 1);
+    }
+    return 1;
+}
+
+static unsigned char *
+putU16 (unsigned char *p, unsigned int v)
+{
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    return p + 2;
+}
+
+static unsigned char *
+putU32 (unsigned char *p, uint32_t v)
+{
+    for (int i = 0; i < 4; i++) {
+        p[i] = (v >> (8 * i)) & 0xff;
+    }
+    return p + 4;
+}
+
+static unsigned char *
+putF32 (unsigned char *p, float f)
+{
+    uint32_t v;
+    memcpy(&v, &f, 4);
+    return putU32(p, v);
+}
+
+static unsigned char *
+putF64 (unsigned char *p, double d)
+{
+    uint64_t v;
+    memcpy(&v, &d, 8);
+    putU32(p, (uint32_t)v);
+    return putU32(p + 4, (uint32_t)(v >> 32));
+}
+
+/* Writes the records kept to the file at path, in the binary trace format.
+ * Returns the number of records written, or false and an error message. */
+static int
+dumpTrace (lua_State *L)
+{
+    Trace *t = checkTrace(L);
+    const char *path = luaL_checkstring(L, 2);
+    unsigned char header[TRACE_HEADER_SIZE], record[TRACE_RECORD_SIZE];
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        lua_pushboolean(L, 0);
+        lua_pushstring(L, strerror(errno));
+        return 2;
+    }
+    memcpy(header, TRACE_MAGIC, 8);
+    putU32(putU32(putU32(putU32(header + 8, TRACE_VERSION), TRACE_RECORD_SIZE), t->count), 0);
+    int ok = fwrite(header, sizeof header, 1, f) == 1;
+    for (int n = 0; ok && n < t->count; n++) {
+        const TraceRecord *r = traceRecord(t, n);
+        unsigned char *p = putF64(record, r->time);
+        p = putU32(p, r->statement);
+        p = putU16(p, r->kind);
+        p = putU16(p, r->nparams);
+        p = putU32(p, r->rows);
+        p = putU16(p, r->status);
+        p = putU16(p, r->flags);
+        p = putF64(p, r->bytes);
+        p = putF32(p, r->send);
+        p = putF32(p, r->wait);
+        p = putF32(p, r->decode);
+        putU32(p, 0);
+        ok = fwrite(record, sizeof record, 1, f) == 1;
+    }
+    if (fclose(f) != 0 || !ok) {
+        lua_pushboolean(L, 0);
+        lua_pushstring(L, strerror(errno));
+        return 2;
+    }
+    lua_pushinteger(L, t->count);
+    return 1;
+}
+
+void
+registerTrace (lua_State *L)
+{
+    luaL_getmetatable(L, SES_REGNAME);
+    lua_pushcfunction(L, startTrace);
+    lua_setfield(L, -2, "startTrace");
+    lua_pushcfunction(L, stopTrace);
+    lua_setfield(L, -2, "stopTrace");
+    lua_pushcfunction(L, traceRecords);
+    lua_setfield(L, -2, "traceRecords");
+    lua_pushcfunction(L, dumpTrace);
+    lua_setfield(L, -2, "dumpTrace");
+    lua_pop(L, 1);
+}
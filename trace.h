@@ -0,0 +1,69 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdint.h>
+#include "stats.h"
+
+// Records kept by default.
+#define TRACE_SIZE 4096
+
+// The dump file: a header of the magic, the version, the record size and the number of
+// records, then the records, oldest first. All numbers are little endian.
+#define TRACE_MAGIC "MPGTRACE"
+#define TRACE_VERSION 1
+#define TRACE_HEADER_SIZE 24
+#define TRACE_RECORD_SIZE 48
+
+typedef enum {
+    traceRun = 1,
+    traceRunPrepared,
+    traceAsyncRun,
+    traceGetResult
+} TraceKind;
+
+// Flags of a trace record.
+#define TRACE_RESULT 1      // A result was received, with its status, rows and bytes.
+#define TRACE_SAMPLED 2
+#define TRACE_SLOW 4        // Kept for taking longer than the slow threshold.
+
+// A call traced.
+typedef struct {
+    double time;            // Seconds since the epoch when the call began.
+    uint32_t statement;     // Hash of the command, or the id of the prepared statement.
+    uint16_t kind;
+    uint16_t nparams;
+    uint32_t rows;
+    uint16_t status;        // ExecStatusType of the result.
+    uint16_t flags;
+    double bytes;
+    float send;             // Seconds sending the command alone.
+    float wait;             // Seconds until the result was received.
+    float decode;           // Seconds converting the result to Lua values.
+} TraceRecord;
+
+// The ring of the latest records of a session.
+struct Trace {
+    TraceRecord *records;
+    int size;
+    int next;
+    int count;
+    double sample;          // Fraction of the calls kept.
+    double slow;            // Calls taking longer are always kept, if set.
+    uint32_t random;
+    uint32_t pending;       // Statement of the last command sent, for its results.
+};
+
+uint32_t
+traceStatement (const char *command, unsigned int sid);
+
+void
+traceCall (Trace *t, TraceKind kind, uint32_t statement, int nparams, double start, double send,
+    const StatementSample *sample);
+
+void
+freeTrace (Trace *t);
+
+void
+registerTrace (lua_State *L);
+
+#endif
@@ -0,0 +1,368 @@
+#include "vector.h"
+#include "binary.h"
+
+#define VALID(v, i) ((v)->valid[(i) >> 3] & (1 << ((i) & 7)))
+
+enum {opLess, opLessEqual, opEqual, opNotEqual, opGreater, opGreaterEqual};
+
+static const char *const opNames[] = {"<", "<=", "==", "~=", ">", ">=", NULL};
+
+int
+isVectorType (PGtype type)
+{
+    switch (type) {
+        case int2OID:
+        case int4OID:
+        case int8OID:
+        case float4OID:
+        case float8OID:
+        case numericOID:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// Push a new vector of length values, with all of them valid.
+static Vector *
+newVector (lua_State *L, int length, int isFloat)
+{
+    // The values follow the header, then the bitmap.
+    size_t bitmapSize = (length + 7) / 8;
+    Vector *v = lua_newuserdata(L, sizeof *v + length * sizeof(int64_t) + bitmapSize);
+    v->isFloat = isFloat;
+    v->length = length;
+    v->nulls = 0;
+    v->data.ints = (int64_t *)(v + 1);
+    v->valid = (unsigned char *)(v->data.ints + length);
+    memset(v->valid, 0xff, bitmapSize);
+    luaL_getmetatable(L, VECTOR_REGNAME);
+    lua_setmetatable(L, -2);
+    return v;
+}
+
+// Push a vector of the values of a numeric field of result. Integer types are held as
+// int64, and float and numeric types as double.
+void
+pushVector (lua_State *L, PGresult *result, int field)
+{
+    PGtype type = PQftype(result, field);
+    int isFloat = type == float4OID || type == float8OID || type == numericOID;
+    int binary = PQfformat(result, field) == 1;
+    int nt = PQntuples(result);
+    Vector *v = newVector(L, nt, isFloat);
+
+    for (int i = 0; i < nt; i++) {
+        const char *value = PQgetvalue(result, i, field);
+        if (PQgetisnull(result, i, field)) {
+            v->valid[i >> 3] &= ~(1 << (i & 7));
+            v->nulls++;
+            // A null is 0 as either an int64 or a double.
+            v->data.ints[i] = 0;
+        }
+        else if (!binary) {
+            if (isFloat) {
+                v->data.floats[i] = strtod(value, NULL);
+            }
+            else {
+                v->data.ints[i] = strtoll(value, NULL, 10);
+            }
+        }
+        else {
+            switch (type) {
+                case int2OID:
+                    v->data.ints[i] = readInt16(value);
+                    break;
+                case int4OID:
+                    v->data.ints[i] = readInt32(value);
+                    break;
+                case int8OID:
+                    v->data.ints[i] = readInt64(value);
+                    break;
+                case float4OID:
+                    v->data.floats[i] = readFloat4(value);
+                    break;
+                case float8OID:
+                    v->data.floats[i] = readFloat8(value);
+                    break;
+                default:
+                    v->data.floats[i] = numericDouble(value);
+            }
+        }
+    }
+}
+
+static void
+pushElement (lua_State *L, const Vector *v, int i)
+{
+    if (!VALID(v, i)) {
+        lua_pushnil(L);
+    }
+    else if (v->isFloat) {
+        lua_pushnumber(L, v->data.floats[i]);
+    }
+    else {
+        lua_pushnumber(L, (lua_Number)v->data.ints[i]);
+    }
+}
+
+// The aggregation loops keep to plain array arithmetic over the whole vector, which the
+// compiler vectorizes. Nulls being 0, sums do not test the bitmap.
+
+static int64_t
+sumInts (const int64_t *d, int n)
+{
+    int64_t sum = 0;
+    for (int i = 0; i < n; i++) {
+        sum += d[i];
+    }
+    return sum;
+}
+
+static double
+sumFloats (const double *d, int n)
+{
+    // Separate partial sums, as floating point addition is not reordered by the compiler.
+    double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        s0 += d[i];
+        s1 += d[i+1];
+        s2 += d[i+2];
+        s3 += d[i+3];
+    }
+    for (; i < n; i++) {
+        s0 += d[i];
+    }
+    return (s0 + s1) + (s2 + s3);
+}
+
+// Get the least, or with greatest set the greatest, valid value of v as a number.
+// Returns 0 if there are no valid values.
+static int
+extreme (const Vector *v, int greatest, lua_Number *out)
+{
+    int first = 0;
+    while (first < v->length && !VALID(v, first)) {
+        first++;
+    }
+    if (first == v->length) {
+        return 0;
+    }
+    if (v->isFloat) {
+        const double *d = v->data.floats;
+        double m = d[first];
+        if (v->nulls == 0) {
+            for (int i = first + 1; i < v->length; i++) {
+                m = (greatest ? d[i] > m : d[i] < m) ? d[i] : m;
+            }
+        }
+        else {
+            for (int i = first + 1; i < v->length; i++) {
+                if (VALID(v, i) && (greatest ? d[i] > m : d[i] < m)) {
+                    m = d[i];
+                }
+            }
+        }
+        *out = m;
+    }
+    else {
+        const int64_t *d = v->data.ints;
+        int64_t m = d[first];
+        if (v->nulls == 0) {
+            if (greatest) {
+                for (int i = first + 1; i < v->length; i++) {
+                    m = d[i] > m ? d[i] : m;
+                }
+            }
+            else {
+                for (int i = first + 1; i < v->length; i++) {
+                    m = d[i] < m ? d[i] : m;
+                }
+            }
+        }
+        else {
+            for (int i = first + 1; i < v->length; i++) {
+                if (VALID(v, i) && (greatest ? d[i] > m : d[i] < m)) {
+                    m = d[i];
+                }
+            }
+        }
+        *out = (lua_Number)m;
+    }
+    return 1;
+}
+
+/* Returns the sum of the non-null values. */
+static int
+vectorSum (lua_State *L)
+{
+    Vector *v = luaL_checkudata(L, 1, VECTOR_REGNAME);
+    if (v->isFloat) {
+        lua_pushnumber(L, sumFloats(v->data.floats, v->length));
+    }
+    else {
+        lua_pushnumber(L, (lua_Number)sumInts(v->data.ints, v->length));
+    }
+    return 1;
+}
+
+/* Returns the number of non-null values. */
+static int
+vectorCount (lua_State *L)
+{
+    Vector *v = luaL_checkudata(L, 1, VECTOR_REGNAME);
+    lua_pushinteger(L, v->length - v->nulls);
+    return 1;
+}
+
+static int
+pushExtreme (lua_State *L, int greatest)
+{
+    Vector *v = luaL_checkudata(L, 1, VECTOR_REGNAME);
+    lua_Number m;
+    if (extreme(v, greatest, &m)) {
+        lua_pushnumber(L, m);
+    }
+    else {
+        lua_pushnil(L);
+    }
+    return 1;
+}
+
+/* Returns the least non-null value, or nil if there are none. */
+static int
+vectorMin (lua_State *L)
+{
+    return pushExtreme(L, 0);
+}
+
+/* Returns the greatest non-null value, or nil if there are none. */
+static int
+vectorMax (lua_State *L)
+{
+    return pushExtreme(L, 1);
+}
+
+/* Returns the mean of the non-null values, or nil if there are none. */
+static int
+vectorMean (lua_State *L)
+{
+    Vector *v = luaL_checkudata(L, 1, VECTOR_REGNAME);
+    int count = v->length - v->nulls;
+    if (count == 0) {
+        lua_pushnil(L);
+    }
+    else if (v->isFloat) {
+        lua_pushnumber(L, sumFloats(v->data.floats, v->length) / count);
+    }
+    else {
+        lua_pushnumber(L, (lua_Number)sumInts(v->data.ints, v->length) / count);
+    }
+    return 1;
+}
+
+// Set keep[i] for each valid value of d that compares by op to x. Returns the count kept.
+#define MARK_MATCHES(d) \
+    switch (op) { \
+        case opLess: MARK_LOOP(d, <); break; \
+        case opLessEqual: MARK_LOOP(d, <=); break; \
+        case opEqual: MARK_LOOP(d, ==); break; \
+        case opNotEqual: MARK_LOOP(d, !=); break; \
+        case opGreater: MARK_LOOP(d, >); break; \
+        default: MARK_LOOP(d, >=); \
+    }
+
+#define MARK_LOOP(d, cmp) \
+    for (int i = 0; i < v->length; i++) { \
+        keep[i] = ((double)d[i] cmp x) && VALID(v, i); \
+        kept += keep[i]; \
+    }
+
+static int
+markMatches (const Vector *v, int op, double x, unsigned char *keep)
+{
+    int kept = 0;
+    if (v->isFloat) {
+        const double *d = v->data.floats;
+        MARK_MATCHES(d)
+    }
+    else {
+        const int64_t *d = v->data.ints;
+        MARK_MATCHES(d)
+    }
+    return kept;
+}
+
+/* Returns a new vector of the non-null values that compare by op, one of
+ * "<", "<=", "==", "~=", ">" or ">=", to the number x. */
+static int
+vectorFilter (lua_State *L)
+{
+    Vector *v = luaL_checkudata(L, 1, VECTOR_REGNAME);
+    int op = luaL_checkoption(L, 2, NULL, opNames);
+    double x = luaL_checknumber(L, 3);
+    unsigned char *keep = malloc(MAX(v->length, 1));
+    if (!keep) {
+        return luaL_error(L, "out of memory");
+    }
+    int kept = markMatches(v, op, x, keep);
+    Vector *out = newVector(L, kept, v->isFloat);
+    for (int i = 0, j = 0; j < kept; i++) {
+        if (keep[i]) {
+            out->data.ints[j++] = v->data.ints[i];
+        }
+    }
+    free(keep);
+    return 1;
+}
+
+/* Indexed by a position, returns the value there, or nil for a null. */
+static int
+vectorIndex (lua_State *L)
+{
+    Vector *v = luaL_checkudata(L, 1, VECTOR_REGNAME);
+    if (lua_type(L, 2) == LUA_TNUMBER) {
+        int i = lua_tointeger(L, 2);
+        if (i >= 1 && i <= v->length) {
+            pushElement(L, v, i - 1);
+        }
+        else {
+            lua_pushnil(L);
+        }
+    }
+    else {
+        lua_getmetatable(L, 1);
+        lua_pushvalue(L, 2);
+        lua_rawget(L, -2);
+    }
+    return 1;
+}
+
+static int
+vectorLen (lua_State *L)
+{
+    Vector *v = luaL_checkudata(L, 1, VECTOR_REGNAME);
+    lua_pushinteger(L, v->length);
+    return 1;
+}
+
+static const struct luaL_Reg vectorMethods [] = {
+    {"sum", vectorSum},
+    {"min", vectorMin},
+    {"max", vectorMax},
+    {"mean", vectorMean},
+    {"count", vectorCount},
+    {"filter", vectorFilter},
+    {"__index", vectorIndex},
+    {"__len", vectorLen},
+    {NULL, NULL}
+};
+
+void
+registerVector (lua_State *L)
+{
+    luaL_newmetatable(L, VECTOR_REGNAME);
+    luaL_register(L, NULL, vectorMethods);
+    lua_pop(L, 1);
+}
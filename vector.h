@@ -0,0 +1,31 @@
+#ifndef _VECTOR_H
+#define _VECTOR_H
+
+#include <stdint.h>
+#include "session.h"
+
+#define VECTOR_REGNAME "moonpg.vector"
+
+// The native values of a numeric result column, held contiguously, with a validity bitmap.
+// A null value is stored as 0, so sums need not test the bitmap.
+typedef struct {
+    int isFloat;            // The values are doubles, else int64.
+    int length;
+    int nulls;
+    unsigned char *valid;   // Bit set for each non-null value.
+    union {
+        int64_t *ints;
+        double *floats;
+    } data;
+} Vector;
+
+int
+isVectorType (PGtype type);
+
+void
+pushVector (lua_State *L, PGresult *result, int field);
+
+void
+registerVector (lua_State *L);
+
+#endif